@@ -5,18 +5,24 @@
 #include "../lib/kernel/list.h"
 #include "../thread/sync.h"
 #include "../fs/super_block.h"
+#include "../fs/free_index.h"
+
+#define PART_TYPE_SWAP 0x82 // 分区表中交换分区的类型，这种分区不创建文件系统
 
 /*分区结构*/
 struct partition
 {
     uint32_t start_lba;         // 起始扇区
     uint32_t sec_cnt;           // 扇区数
+    uint8_t fs_type;            // 分区表中记录的分区类型
     struct disk *my_disk;       // 分区所属的硬盘
     struct list_elem part_tag;  // 对列标记
     char name[8];               // 分区名称
     struct super_block *sb;     // 超级块
     struct bitmap block_bitmap; // 块的位图
     struct bitmap inode_bitmap; // i节点位图
+    struct free_index block_index; // 块位图的两级空闲索引
+    struct free_index inode_index; // i节点位图的两级空闲索引
     struct list open_inodes;    // i节点队列
 };
 
@@ -8,6 +8,7 @@
 void ioqueue_init(struct ioqueue *ioq)
 {
     lock_init(&ioq->lock);
+    spin_init(&ioq->guard);
     ioq->producer = ioq->consumer = NULL;
     ioq->head = ioq->tail = 0;
 }
@@ -32,14 +33,38 @@ bool ioq_empty(struct ioqueue *ioq)
     return ioq->head == ioq->tail;
 }
 
-/*使当前的消费者或者生产者在缓冲区上等待
+/*使当前的消费者或者生产者在缓冲区上等待，调用者持有ioq->guard，阻塞时放开，返回时不再持有
  *关于下面两个二重指针，第一重是本身的指针，第二重是指向结构体的指针
  *所以第一次解引用后，他就是消费者或者生产者，类型是task_struct* */
-static void ioq_wait(struct task_struct **waiter)
+static void ioq_wait(struct ioqueue *ioq, struct task_struct **waiter)
 {
     ASSERT(waiter != NULL && *waiter == NULL);
     *waiter = running_thread();
-    thread_block(TASK_BLOCKED);
+    thread_block_on(TASK_BLOCKED, &ioq->guard);
+}
+
+/*加上guard，如果cond仍然成立就在waiter上等待一次，没有等待时返回true
+ *等待之前先拿到ioq->lock，它可能阻塞，所以不能在持有guard时获取*/
+static bool ioq_wait_if(struct ioqueue *ioq, bool (*cond)(struct ioqueue *), struct task_struct **waiter)
+{
+    spin_lock(&ioq->guard);
+    if (!cond(ioq))
+    {
+        return true;
+    }
+    spin_unlock(&ioq->guard);
+    lock_acquire(&ioq->lock);
+    spin_lock(&ioq->guard);
+    if (cond(ioq))
+    {
+        ioq_wait(ioq, waiter);
+    }
+    else
+    {
+        spin_unlock(&ioq->guard);
+    }
+    lock_release(&ioq->lock);
+    return false;
 }
 
 /*唤醒waiter线程*/
@@ -56,18 +81,16 @@ static void wake_up(struct task_struct **waiter)
 char ioq_getchar(struct ioqueue *ioq)
 {
     ASSERT(intr_get_status() == INTR_OFF);
-    while (ioq_empty(ioq))
-    {                             // 只要缓冲区为空，就要一直阻塞消费者线程
-        lock_acquire(&ioq->lock); // 保证原子操作，因为涉及到了公共的指针资源
-        ioq_wait(&ioq->consumer); // 取地址后对齐二重指针
-        lock_release(&ioq->lock);
-    }
+    // 只要缓冲区为空，就要一直阻塞消费者线程，返回true时已经持有guard
+    while (!ioq_wait_if(ioq, ioq_empty, &ioq->consumer))
+        ;
     char byte = ioq->buf[ioq->tail];
     ioq->tail = next_pos(ioq->tail); // 不能直接ioq++，可能导致溢出，需要取模构成环形
     if (ioq->producer != NULL)
     {
-        wake_up(&ioq->producer); // 为什么唤醒不需要保证是原子操作？
+        wake_up(&ioq->producer); // 持有guard，生产者不会同时修改这个指针
     }
+    spin_unlock(&ioq->guard);
     return byte;
 }
 
@@ -77,16 +100,13 @@ char ioq_getchar(struct ioqueue *ioq)
 void ioq_putchar(struct ioqueue *ioq, char byte)
 {
     ASSERT(intr_get_status() == INTR_OFF);
-    while (ioq_full(ioq))
-    {
-        lock_acquire(&ioq->lock);
-        ioq_wait(&ioq->producer);
-        lock_release(&ioq->lock);
-    }
+    while (!ioq_wait_if(ioq, ioq_full, &ioq->producer))
+        ;
     ioq->buf[ioq->head] = byte;
     ioq->head = next_pos(ioq->head);
     if (ioq->consumer != NULL)
     {
         wake_up(&ioq->consumer);
     }
+    spin_unlock(&ioq->guard);
 }
\ No newline at end of file
@@ -9,7 +9,8 @@
 
 /*环形队列*/
 struct ioqueue{
-    struct lock lock;
+    struct lock lock;       //同一时间只允许一个生产者或者消费者在缓冲区上等待
+    struct spinlock guard;  //保护缓冲区和两个等待者指针，键盘中断和读取的线程可能在不同的处理器上
     //生产者，缓冲区不满时向其中存入数据，满的时候在缓冲区上睡眠
     struct task_struct* producer;
     //消费者，缓冲区不空时向其中取出数据，空的时候在缓冲区上睡眠
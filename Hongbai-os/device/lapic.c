@@ -0,0 +1,162 @@
+// 本地APIC驱动，只用到多处理器启动、处理器间中断和定时器这几部分
+// 外部设备的中断仍然由8259A经引导处理器的LINT0以虚拟线模式送进来，没有使用IOAPIC
+#include "./lapic.h"
+#include "./timer.h"
+#include "../kernel/memory.h"
+#include "../kernel/debug.h"
+#include "../kernel/global.h"
+#include "../lib/kernel/print.h"
+
+#define IA32_APIC_BASE_MSR 0x1b  // 本地APIC基址所在的MSR
+#define APIC_BASE_ENABLE (1 << 11) // MSR中的全局启用位
+#define CPUID_FEAT_EDX_APIC (1 << 9) // cpuid(1).edx中表示有本地APIC的位
+
+// 本地APIC寄存器相对基址的偏移
+#define LAPIC_ID 0x20          // APIC id，高8位有效
+#define LAPIC_TPR 0x80         // 任务优先级
+#define LAPIC_EOI 0xb0         // 写0表示中断处理结束
+#define LAPIC_SVR 0xf0         // 伪中断向量，第8位是软件启用位
+#define LAPIC_ICR_LOW 0x300    // 中断命令寄存器低32位，写它时发出中断
+#define LAPIC_ICR_HIGH 0x310   // 中断命令寄存器高32位，目标APIC id在高8位
+#define LAPIC_LVT_TIMER 0x320  // 定时器的本地向量表项
+#define LAPIC_LVT_LINT0 0x350
+#define LAPIC_LVT_LINT1 0x360
+#define LAPIC_LVT_ERROR 0x370
+#define LAPIC_TIMER_INIT 0x380 // 定时器初始计数
+#define LAPIC_TIMER_CUR 0x390  // 定时器当前计数
+#define LAPIC_TIMER_DIV 0x3e0  // 定时器分频
+
+#define SVR_ENABLE (1 << 8)
+#define LVT_MASKED (1 << 16)
+#define LVT_TIMER_PERIODIC (1 << 17)
+#define TIMER_DIV_16 0x3
+#define ICR_INIT (5 << 8)
+#define ICR_STARTUP (6 << 8)
+#define ICR_DELIVS (1 << 12) // 中断还没有被目标接收
+#define ICR_ASSERT (1 << 14)
+#define CALIBRATE_TICKS 10   // 校准定时器时数这么多个PIT tick
+
+static volatile uint32_t *lapic; // 本地APIC寄存器映射到的内核虚拟地址，每个处理器访问到的是自己的APIC
+static uint32_t timer_count;     // 本地APIC定时器一个tick的计数，所有处理器的总线频率相同
+
+/* 读本地APIC寄存器 */
+static inline uint32_t lapic_read(uint32_t reg)
+{
+    return lapic[reg / 4];
+}
+
+/* 写本地APIC寄存器，再读一次ID寄存器等待写入完成 */
+static inline void lapic_write(uint32_t reg, uint32_t val)
+{
+    lapic[reg / 4] = val;
+    (void)lapic[LAPIC_ID / 4];
+}
+
+/* cpuid报告是否有本地APIC */
+bool lapic_detect(void)
+{
+    uint32_t eax = 1, ebx, ecx = 0, edx;
+    asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+    return (edx & CPUID_FEAT_EDX_APIC) != 0;
+}
+
+/*启用当前处理器的本地APIC，引导处理器第一次调用时映射寄存器
+ *AP的LINT0/LINT1屏蔽掉，8259A和NMI只送给引导处理器*/
+void lapic_init(bool bsp)
+{
+    uint32_t lo, hi;
+    asm volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(IA32_APIC_BASE_MSR));
+    if (!(lo & APIC_BASE_ENABLE))
+    {
+        lo |= APIC_BASE_ENABLE;
+        asm volatile("wrmsr" : : "a"(lo), "d"(hi), "c"(IA32_APIC_BASE_MSR));
+    }
+    if (lapic == NULL)
+    {
+        ASSERT(bsp);
+        lapic = ioremap(lo & 0xfffff000, PG_SIZE);
+        if (lapic == NULL)
+        {
+            PANIC("lapic_init: ioremap failed");
+        }
+    }
+    lapic_write(LAPIC_SVR, SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+    lapic_write(LAPIC_LVT_TIMER, LVT_MASKED);
+    lapic_write(LAPIC_LVT_ERROR, LVT_MASKED);
+    if (!bsp)
+    {
+        lapic_write(LAPIC_LVT_LINT0, LVT_MASKED);
+        lapic_write(LAPIC_LVT_LINT1, LVT_MASKED);
+    }
+    lapic_write(LAPIC_TPR, 0); // 接收所有优先级的中断
+    lapic_write(LAPIC_EOI, 0); // 清掉可能残留的中断
+}
+
+/* 当前处理器的APIC id */
+uint8_t lapic_id(void)
+{
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+/* 本地APIC中断处理结束，8259A的中断不需要调用 */
+void lapic_eoi(void)
+{
+    lapic_write(LAPIC_EOI, 0);
+}
+
+/* 写中断命令寄存器，等目标接收后返回 */
+static void lapic_icr_send(uint8_t apic_id, uint32_t low)
+{
+    lapic_write(LAPIC_ICR_HIGH, (uint32_t)apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, low);
+    while (lapic_read(LAPIC_ICR_LOW) & ICR_DELIVS)
+        ;
+}
+
+/* 向apic_id发送向量为vector的处理器间中断 */
+void lapic_send_ipi(uint8_t apic_id, uint8_t vector)
+{
+    lapic_icr_send(apic_id, vector);
+}
+
+/* 发送INIT，AP复位后等待SIPI */
+void lapic_send_init(uint8_t apic_id)
+{
+    lapic_icr_send(apic_id, ICR_INIT | ICR_ASSERT);
+}
+
+/* 发送SIPI，AP以实模式从page*4KB处开始执行 */
+void lapic_send_sipi(uint8_t apic_id, uint8_t page)
+{
+    lapic_icr_send(apic_id, ICR_STARTUP | ICR_ASSERT | page);
+}
+
+/*用PIT校准本地APIC定时器，在引导处理器上开中断后调用
+ *从一个tick的边界开始，让定时器以最大初值单次倒数CALIBRATE_TICKS个tick，看减少了多少*/
+void lapic_timer_calibrate(void)
+{
+    volatile uint32_t *now = &ticks;
+    lapic_write(LAPIC_TIMER_DIV, TIMER_DIV_16);
+    lapic_write(LAPIC_LVT_TIMER, LVT_MASKED);
+    uint32_t start = *now;
+    while (*now == start)
+        ;
+    start = *now;
+    lapic_write(LAPIC_TIMER_INIT, 0xffffffff);
+    while (*now - start < CALIBRATE_TICKS)
+        ;
+    timer_count = (0xffffffff - lapic_read(LAPIC_TIMER_CUR)) / CALIBRATE_TICKS;
+    lapic_write(LAPIC_TIMER_INIT, 0);
+    put_str("  lapic timer count per tick: ");
+    put_int(timer_count);
+    put_str("\n");
+}
+
+/* 以TIMER_HZ的频率启动当前处理器的本地APIC定时器，AP用它做时钟中断 */
+void lapic_timer_start(void)
+{
+    ASSERT(timer_count != 0);
+    lapic_write(LAPIC_TIMER_DIV, TIMER_DIV_16);
+    lapic_write(LAPIC_LVT_TIMER, LVT_TIMER_PERIODIC | LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_INIT, timer_count);
+}
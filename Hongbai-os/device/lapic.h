@@ -0,0 +1,20 @@
+// 本地APIC：处理器间中断和每个处理器自己的定时器
+#ifndef __DEVICE_LAPIC_H
+#define __DEVICE_LAPIC_H
+#include "../lib/stdint.h"
+
+#define LAPIC_TIMER_VECTOR 0x30    // 本地APIC定时器，AP用它代替PIT产生时钟中断
+#define IPI_RESCHED_VECTOR 0x31    // 请求目标处理器重新调度
+#define IPI_TLB_VECTOR 0x32        // 请求目标处理器刷新tlb
+#define LAPIC_SPURIOUS_VECTOR 0x3f // 伪中断，不需要EOI
+
+bool lapic_detect(void);                               // cpuid报告是否有本地APIC
+void lapic_init(bool bsp);                             // 启用当前处理器的本地APIC
+uint8_t lapic_id(void);                                // 当前处理器的APIC id
+void lapic_eoi(void);                                  // 本地APIC中断处理结束
+void lapic_send_ipi(uint8_t apic_id, uint8_t vector);  // 向apic_id发送处理器间中断
+void lapic_send_init(uint8_t apic_id);                 // 发送INIT，让AP进入等待SIPI的状态
+void lapic_send_sipi(uint8_t apic_id, uint8_t page);   // 发送SIPI，AP从物理地址page*4KB开始以实模式执行
+void lapic_timer_calibrate(void);                      // 用PIT测出本地APIC定时器一个tick的计数
+void lapic_timer_start(void);                          // 以TIMER_HZ的频率启动当前处理器的本地APIC定时器
+#endif
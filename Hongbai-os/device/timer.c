@@ -5,47 +5,386 @@
 #include "../kernel/interrupt.h"
 #include "../thread/thread.h"
 #include "../kernel/debug.h"
+#include "../kernel/smp.h"
+#include "./lapic.h"
 
-#define IRQ0_FREQUENCY 100      // 时钟中断频率
+#ifndef TIMER_HZ
+#define TIMER_HZ 100 // 时钟中断频率，编译时用make TIMER_HZ=xxx指定
+#endif
+#if TIMER_HZ < 19 || TIMER_HZ > 1000
+#error "TIMER_HZ must be between 19 and 1000" // 低于19Hz时计数器初始值超出16位
+#endif
+
+#define IRQ0_FREQUENCY TIMER_HZ // 时钟中断频率
 #define INPUT_FREQUENCY 1193180 // 8254PIT的输入时钟频率
 // 计数器初始值
-#define COUNTER0_VALUE INPUT_FREQUENCY / IRQ0_FREQUENCY
+#define COUNTER0_VALUE (INPUT_FREQUENCY / IRQ0_FREQUENCY)
 #define COUNTER0_PORT 0X40     // Counter0的数据端口，通过该端口写入计数器初始值
 #define COUNTER0_NO 0          // 选择Counter0
 #define COUNTER_MODE 2         // 选择模式2,进行周期中断
+#define ONESHOT_MODE 0         // 模式0，计数到0时中断一次，之后不再自动重装
 #define READ_WRITE_LATCH 3     // 表示先写低字节，再写高字节
+#define COUNTER_LATCH 0        // 锁存计数器当前值，随后从数据端口读出
 #define PIT_COUNTROL_PORT 0x43 // 控制字寄存器端口
-// 计算每多少毫秒发生1次中断
-#define mil_second_per_intr (1000 / IRQ0_FREQUENCY)
+#define COUNTER_MAX 0xffff     // 计数器是16位的
+#define IDLE_SEG_TICKS ((COUNTER_MAX - 1) / COUNTER0_VALUE) // 一段一次性计数最多能跳过的tick数，更长的空闲分几段接着计
+
+#define WHEEL_BITS 6                             // 每一级时间轮的槽数是2^6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4                           // 4级时间轮能表示2^24个tick，100Hz下约46小时
+#define WHEEL_MAX_DELAY ((1u << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+#define IDLE_MAX_TICKS (WHEEL_SIZE * WHEEL_SIZE) // 一次空闲最多跳过的tick数，100Hz下约41秒
 
 uint32_t ticks; // ticks是内核自中断开启以来的滴答数，一个tick就是一次时钟中断
 
+/*无tick空闲的状态，只有引导处理器的idle线程会进入，由wheel_lock保护
+ *进入时停掉周期时钟，计数器改成一次性模式，在下一个定时器到期时才中断
+ *16位计数器一段最多计IDLE_SEG_TICKS个tick，更远的到期时间分成几段，中间各段到期时只补ticks、接着计下一段*/
+struct tickless_state
+{
+    bool active;           // 计数器处于一次性模式
+    bool rearm;            // 空闲期间其他处理器启动了定时器，要按新的到期时间重新设置
+    uint16_t count;        // 当前这一段写入的计数器初始值
+    uint32_t skip_ticks;   // 当前这一段计数到0时一共经过了多少个tick
+    uint32_t synced_ticks; // 当前这一段中已经补进ticks的tick数
+    uint32_t remain_ticks; // 当前这一段之后还要接着跳过的tick数，为0时这一段到期就恢复周期时钟
+};
+static struct tickless_state tickless;
+
+/*分级时间轮，第0级每个槽是1个tick，第l级每个槽是2^(6l)个tick
+ *定时器按离到期还有多久放到能容纳它的最低一级，第0级转完一圈时把上一级当前槽中的定时器重新分散到下面各级
+ *启动、取消都是O(1)，每个tick只处理第0级的一个槽
+ *PIT只接在引导处理器上，时间轮只在那里推进，其他处理器启动、取消定时器时要持有wheel_lock*/
+struct timer_wheel
+{
+    struct list slots[WHEEL_LEVELS][WHEEL_SIZE];
+    uint32_t now; // 时间轮下一个要处理的tick，落后于ticks时在时钟中断里追上
+};
+static struct timer_wheel wheel;
+static struct spinlock wheel_lock; // 保护wheel和tickless
+
+/* 按到期时间把定时器挂到对应的槽上，调用者需持有wheel_lock */
+static void wheel_insert(struct timer *t)
+{
+    uint32_t expires = t->expires;
+    uint32_t delta = expires - wheel.now;
+    struct list *slot;
+    if ((int32_t)delta < 0)
+    { // 已经过期的放到马上要处理的槽
+        slot = &wheel.slots[0][wheel.now & WHEEL_MASK];
+    }
+    else
+    {
+        if (delta > WHEEL_MAX_DELAY)
+        { // 超出时间轮的范围，先放在最远的位置，降级时会按真实的到期时间重新放置
+            expires = wheel.now + WHEEL_MAX_DELAY;
+            delta = WHEEL_MAX_DELAY;
+        }
+        uint32_t level = 0;
+        while (delta >= (1u << (WHEEL_BITS * (level + 1))))
+        {
+            level++;
+        }
+        slot = &wheel.slots[level][(expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    }
+    list_append(slot, &t->elem);
+}
+
+/* 把第level级当前槽中的定时器重新放到下面各级，返回这个槽的下标，为0说明这一级也转完了一圈 */
+static uint32_t wheel_cascade(uint32_t level)
+{
+    uint32_t idx = (wheel.now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    struct list *slot = &wheel.slots[level][idx];
+    struct list moving;
+    list_init(&moving);
+    while (!list_empty(slot))
+    { // 先整体摘下再放回，重新放置时可能又落回这个槽
+        list_append(&moving, list_pop(slot));
+    }
+    while (!list_empty(&moving))
+    {
+        wheel_insert(elem2entry(struct timer, elem, list_pop(&moving)));
+    }
+    return idx;
+}
+
+/*让时间轮追上ticks，调用所有到期定时器的函数，在时钟中断里调用
+ *回调函数可能唤醒线程而去拿就绪队列的锁，调用它们时不持有wheel_lock*/
+static void wheel_run(void)
+{
+    spin_lock(&wheel_lock);
+    while ((int32_t)(ticks - wheel.now) >= 0)
+    {
+        uint32_t idx = wheel.now & WHEEL_MASK;
+        if (idx == 0)
+        { // 第0级转完一圈，逐级把上一级的定时器降下来
+            uint32_t level = 1;
+            while (level < WHEEL_LEVELS && wheel_cascade(level) == 0)
+            {
+                level++;
+            }
+        }
+        struct list expired;
+        list_init(&expired);
+        while (!list_empty(&wheel.slots[0][idx]))
+        { // 摘下时就清掉pending，之后timer_cancel不会再去动它
+            struct timer *t = elem2entry(struct timer, elem, list_pop(&wheel.slots[0][idx]));
+            t->pending = false;
+            list_append(&expired, &t->elem);
+        }
+        wheel.now++; // 回调函数里新启动的定时器不会落到已经处理过的tick
+        spin_unlock(&wheel_lock);
+        while (!list_empty(&expired))
+        {
+            struct timer *t = elem2entry(struct timer, elem, list_pop(&expired));
+            t->func(t->arg);
+        }
+        spin_lock(&wheel_lock);
+    }
+    spin_unlock(&wheel_lock);
+}
+
+/* 把skip个tick中的一段写入计数器，剩下的记在remain_ticks里，调用者需持有wheel_lock */
+static void tickless_segment(uint32_t skip)
+{
+    uint32_t seg = skip < IDLE_SEG_TICKS ? skip : IDLE_SEG_TICKS;
+    tickless.count = seg * COUNTER0_VALUE;
+    tickless.skip_ticks = seg;
+    tickless.synced_ticks = 0;
+    tickless.remain_ticks = skip - seg;
+    frequency_set(COUNTER0_PORT, COUNTER0_NO, READ_WRITE_LATCH, ONESHOT_MODE, tickless.count);
+}
+
+/*读出当前这一段已经计了多少，计数已经到0时返回false，调用者需持有wheel_lock
+ *计数到0后模式0会从0xffff接着往下数，那种情况中断已经在路上*/
+static bool tickless_elapsed(uint32_t *elapsed)
+{
+    outb(PIT_COUNTROL_PORT, (uint8_t)(COUNTER0_NO << 6 | COUNTER_LATCH << 4));
+    uint16_t remain = inb(COUNTER0_PORT);
+    remain |= (uint16_t)inb(COUNTER0_PORT) << 8;
+    if (remain == 0 || remain > tickless.count)
+    {
+        return false;
+    }
+    *elapsed = tickless.count - remain;
+    return true;
+}
+
+/*无tick空闲期间ticks停在进入空闲时的值，其他处理器启动定时器前先按计数器补到当前时刻，调用者需持有wheel_lock
+ *补进去的tick记在synced_ticks里，这一段到期时中断处理函数只补剩下的*/
+static void tickless_sync(void)
+{
+    uint32_t elapsed;
+    uint32_t whole = tickless_elapsed(&elapsed) ? elapsed / COUNTER0_VALUE : tickless.skip_ticks;
+    ticks += whole - tickless.synced_ticks;
+    tickless.synced_ticks = whole;
+}
+
+/*启动定时器，调用者需持有wheel_lock
+ *引导处理器正在无tick空闲时返回true，调用者放锁后要叫醒它按新的到期时间重新设置计数器*/
+static bool timer_arm(struct timer *t, uint32_t delay)
+{
+    ASSERT(!t->pending);
+    bool kick = tickless.active && running_thread()->cpu != &cpus[0];
+    if (kick)
+    {
+        tickless_sync();
+        tickless.rearm = true;
+    }
+    t->expires = ticks + (delay == 0 ? 1 : delay);
+    t->pending = true;
+    wheel_insert(t);
+    return kick;
+}
+
+/* 启动定时器，delay个tick后到期，delay为0时在下一个tick到期 */
+void timer_add(struct timer *t, uint32_t delay)
+{
+    enum intr_status old_status = spin_lock_irqsave(&wheel_lock);
+    bool kick = timer_arm(t, delay);
+    spin_unlock_irqrestore(&wheel_lock, old_status);
+    if (kick)
+    {
+        lapic_send_ipi(cpus[0].apic_id, IPI_RESCHED_VECTOR);
+    }
+}
+
+/* 取消定时器，返回取消前它是否还在等待，已经到期或者没有启动的返回false */
+bool timer_cancel(struct timer *t)
+{
+    enum intr_status old_status = spin_lock_irqsave(&wheel_lock);
+    bool was_pending = t->pending;
+    if (was_pending)
+    {
+        list_remove(&t->elem);
+        t->pending = false;
+    }
+    spin_unlock_irqrestore(&wheel_lock, old_status);
+    return was_pending;
+}
+
 /* 配置8524PIT */
 void frequency_set(uint8_t counter_port, uint8_t counter_no, uint8_t rwl, uint8_t counter_mode, uint16_t counter_value)
 {
     outb(PIT_COUNTROL_PORT, (uint8_t)(counter_no << 6 | rwl << 4 | counter_mode << 1));
     outb(counter_port, (uint8_t)counter_value);
-    outb(counter_port, (uint8_t)counter_value >> 8);
+    outb(counter_port, (uint8_t)(counter_value >> 8));
     return;
 }
 
-/* 时钟的中断处理函数 */
-void intr_timer_handler(void)
+/*每个处理器自己的时钟处理：线程运行时间、就绪队列老化和时间片
+ *引导处理器由PIT中断调用，其他处理器由本地APIC定时器中断调用*/
+void timer_local_tick(void)
 {
     struct task_struct *cur_thread = running_thread();
     ASSERT(cur_thread->stack_magic == 0x20250325); // 检测栈溢出
     cur_thread->elapsed_ticks++;                   // 线程运行的时间加1
-    // 每次时钟中断，ticks加1
-    ticks++;
-    if (cur_thread->ticks == 0)
-    {               // 如果当前线程的时间片用完
+    run_queue_age();                               // 提升在就绪队列中等待太久的线程
+    run_queue_balance();                           // 和别的处理器之间的长期不均衡
+    if (cur_thread->ticks == 0 || cur_thread->cpu->need_resched)
+    {               // 如果当前线程的时间片用完，或者有级别更高的线程就绪
         schedule(); // 调度其他线程
     }
     else
     {
         cur_thread->ticks--; // 否则，当前线程的时间片减1
     }
-    return;
+}
+
+/* 时钟的中断处理函数，PIT只接在引导处理器上，全局的ticks和时间轮只在这里推进 */
+void intr_timer_handler(void)
+{
+    spin_lock(&wheel_lock);
+    if (tickless.active)
+    { // 一次性计数到期，补上这一段跳过的tick，包括这一次中断
+        ticks += tickless.skip_ticks - tickless.synced_ticks;
+        if (tickless.remain_ticks > 0 && !tickless.rearm)
+        { // 还没到有定时器到期的那个tick，接着计下一段，不做每个tick的工作
+            tickless_segment(tickless.remain_ticks);
+            spin_unlock(&wheel_lock);
+            return;
+        }
+        tickless.active = false; // 恢复周期时钟
+        frequency_set(COUNTER0_PORT, COUNTER0_NO, READ_WRITE_LATCH, COUNTER_MODE, COUNTER0_VALUE);
+    }
+    else
+    {
+        ticks++; // 每次时钟中断，ticks加1
+    }
+    spin_unlock(&wheel_lock);
+    wheel_run();        // 处理到期的定时器，醒来的线程进入就绪队列
+    timer_local_tick(); // 本处理器的时间片
+}
+
+/* 本地APIC定时器的中断处理函数，AP用它代替PIT */
+static void intr_lapic_timer_handler(void)
+{
+    lapic_eoi();
+    timer_local_tick();
+}
+
+/* 时间轮处理到when这个tick时，上面各级要降级的槽里有没有定时器，调用者需持有wheel_lock */
+static bool wheel_cascades_at(uint32_t when)
+{
+    uint32_t level;
+    for (level = 1; level < WHEEL_LEVELS; level++)
+    {
+        if (((when >> (WHEEL_BITS * (level - 1))) & WHEEL_MASK) != 0)
+        { // 下一级还没转完一圈，这一级不降级
+            return false;
+        }
+        if (!list_empty(&wheel.slots[level][(when >> (WHEEL_BITS * level)) & WHEEL_MASK]))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*从现在起还有多少个tick会有定时器到期，最多看limit个tick，调用者需持有wheel_lock
+ *第0级的定时器都在接下来WHEEL_SIZE个tick内到期，每个tick一个槽；
+ *更远的只看第0级每转完一圈时有没有定时器从上面降下来，有就在那时醒来重新计算*/
+static uint32_t wheel_next_expiry(uint32_t limit)
+{
+    uint32_t delta;
+    for (delta = 0; delta < limit && delta < WHEEL_SIZE; delta++)
+    {
+        uint32_t when = wheel.now + delta;
+        if (((when & WHEEL_MASK) == 0 && wheel_cascades_at(when)) ||
+            !list_empty(&wheel.slots[0][when & WHEEL_MASK]))
+        {
+            return delta + 1;
+        }
+    }
+    // 再往后第0级的槽和前面是同一批，只看转完一圈的时刻
+    for (delta = (WHEEL_SIZE - (wheel.now & WHEEL_MASK)) % WHEEL_SIZE + WHEEL_SIZE; delta < limit; delta += WHEEL_SIZE)
+    {
+        if (wheel_cascades_at(wheel.now + delta))
+        {
+            return delta + 1;
+        }
+    }
+    return limit;
+}
+
+/*idle线程在没有就绪线程时调用，代替固定的sti; hlt
+ *按最近一个定时器的到期时间把计数器设为一次性模式再停机，空闲期间不再每个tick都中断，
+ *中间各段到期的中断只补ticks，醒来后接着停机
+ *有线程就绪或者其他处理器启动了定时器时，补上已经过去的整数个tick，再用一次性计数对齐到下一个tick边界
+ *其他处理器没有PIT，本地APIC定时器照常运行，只是简单地停机*/
+void timer_idle_halt(void)
+{
+    intr_disable();
+    if (running_thread()->cpu != &cpus[0] || !run_queue_empty())
+    { // 关中断后再检查一次，唤醒本处理器的处理器间中断会在hlt时送达
+        if (run_queue_empty())
+        {
+            asm volatile("sti; hlt" : : : "memory");
+        }
+        intr_enable();
+        return;
+    }
+    spin_lock(&wheel_lock);
+    uint32_t skip = tickless.active ? 0 : wheel_next_expiry(IDLE_MAX_TICKS);
+    if (skip <= 1)
+    { // 下一个tick就有定时器到期，或者上次提前醒来对齐用的一次性计数还没到，停机等这个tick
+        spin_unlock(&wheel_lock);
+        asm volatile("sti; hlt" : : : "memory");
+        return;
+    }
+    tickless_segment(skip);
+    tickless.rearm = false;
+    tickless.active = true; // 持锁设置，之后其他处理器启动的定时器会发处理器间中断叫醒这里
+    spin_unlock(&wheel_lock);
+    while (true)
+    {
+        asm volatile("sti; hlt" : : : "memory");
+        intr_disable();
+        spin_lock(&wheel_lock);
+        if (!tickless.active)
+        { // 最后一段到期，周期时钟已经恢复
+            break;
+        }
+        if (run_queue_empty() && !tickless.rearm)
+        { // 中间一段到期，或者中断没有唤醒任何线程，接着停机
+            spin_unlock(&wheel_lock);
+            continue;
+        }
+        uint32_t elapsed;
+        if (tickless_elapsed(&elapsed))
+        {
+            ticks += elapsed / COUNTER0_VALUE - tickless.synced_ticks;
+            tickless.count = COUNTER0_VALUE - elapsed % COUNTER0_VALUE;
+            tickless.skip_ticks = 1;
+            tickless.synced_ticks = 0;
+            frequency_set(COUNTER0_PORT, COUNTER0_NO, READ_WRITE_LATCH, ONESHOT_MODE, tickless.count);
+        }
+        tickless.remain_ticks = 0; // 这一段到期时恢复周期时钟
+        break;
+    }
+    spin_unlock(&wheel_lock);
+    intr_enable();
 }
 
 /* 初始化PIT8253 */
@@ -53,27 +392,69 @@ void timer_init(void)
 {
     put_str("timer_init start\n");
     frequency_set(COUNTER0_PORT, COUNTER0_NO, READ_WRITE_LATCH, COUNTER_MODE, COUNTER0_VALUE);
-    register_handler(0x20, intr_timer_handler); // 注册时钟中断处理函数
+    uint32_t level, idx;
+    for (level = 0; level < WHEEL_LEVELS; level++)
+    {
+        for (idx = 0; idx < WHEEL_SIZE; idx++)
+        {
+            list_init(&wheel.slots[level][idx]);
+        }
+    }
+    wheel.now = ticks + 1;
+    tickless.active = false;
+    spin_init(&wheel_lock);
+    register_handler(0x20, intr_timer_handler);                     // 注册时钟中断处理函数
+    register_handler(LAPIC_TIMER_VECTOR, intr_lapic_timer_handler); // AP的时钟中断
     put_str("timer_init done\n");
     return;
 }
 
+/* 休眠定时器到期，唤醒睡眠的线程 */
+static void sleep_wakeup(void *arg)
+{
+    thread_unblock((struct task_struct *)arg);
+}
+
 /*以tick为单位的sleep，让当前线程休眠sleep_ticks次中断
- *每次中断全局变量ticks++，计算某次中断后ticks和开始休眠时的start_tick的差值，
- *决定是继续休眠还是结束休眠*/
+ *定时器放在睡眠线程自己的内核栈上，线程阻塞期间不占用就绪队列，到期时由时钟中断唤醒*/
 static void ticks_to_sleep(uint32_t sleep_ticks)
 {
-    uint32_t start_tick = ticks;
-    while (ticks - start_tick < sleep_ticks) // 如果差值没达到目标，就一直休眠
-    {
-        thread_yield();
+    struct timer t;
+    t.func = sleep_wakeup;
+    t.arg = running_thread();
+    t.pending = false;
+    // 持有wheel_lock直到状态改为阻塞，定时器不会在阻塞前就到期
+    enum intr_status old_status = spin_lock_irqsave(&wheel_lock);
+    bool kick = timer_arm(&t, sleep_ticks);
+    if (kick)
+    { // 叫醒引导处理器不需要等它处理，先于阻塞发出也没有关系
+        lapic_send_ipi(cpus[0].apic_id, IPI_RESCHED_VECTOR);
     }
+    thread_block_on(TASK_BLOCKED, &wheel_lock);
+    intr_set_status(old_status);
+}
+
+/* 毫秒数换算成tick数，不足一个tick的部分向上取整，分两段计算避免乘法溢出 */
+static uint32_t ms_to_ticks(uint32_t m_second)
+{
+    return m_second / 1000 * IRQ0_FREQUENCY + DIV_ROUND_UP(m_second % 1000 * IRQ0_FREQUENCY, 1000);
 }
 
 /*以毫秒ms为单位的休眠*/
 void mtime_sleep(uint32_t m_second)
 {
-    uint32_t sleep_ticks = DIV_ROUND_UP(m_second, mil_second_per_intr);
+    uint32_t sleep_ticks = ms_to_ticks(m_second);
     ASSERT(sleep_ticks > 0);
     ticks_to_sleep(sleep_ticks);
-}
\ No newline at end of file
+}
+
+/*sleep系统调用，让当前进程休眠m_second毫秒，为0时只让出cpu*/
+void sys_sleep(uint32_t m_second)
+{
+    if (m_second == 0)
+    {
+        thread_yield();
+        return;
+    }
+    mtime_sleep(m_second);
+}
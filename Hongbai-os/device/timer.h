@@ -1,10 +1,29 @@
 #ifndef __DEVICE_TIME_H
 #define __DEVICE_TIME_H
 #include "../lib/stdint.h"
+#include "../lib/kernel/list.h"
+
+/*定时器，由调用者提供存储，填好func和arg后用timer_add启动
+ *func在引导处理器的时钟中断里、关中断的状态下调用，不能阻塞*/
+struct timer
+{
+    struct list_elem elem;   // 挂在时间轮的槽上
+    uint32_t expires;        // 到期时的ticks
+    void (*func)(void *arg); // 到期时调用的函数
+    void *arg;               // func的参数
+    bool pending;            // 是否还挂在时间轮上等待到期
+};
 
 void frequency_set(uint8_t counter_port, uint8_t counter_no, uint8_t rwl, uint8_t counter_mode, uint16_t counter_value);
 void intr_timer_handler(void);        // 定时器中断处理函数
+void timer_local_tick(void);          // 每个处理器自己的时钟处理
 void timer_init(void);                // 初始化PIT8253
-void mtime_sleep(uint32_t m_second);
+void mtime_sleep(uint32_t m_second);  // 以毫秒为单位阻塞当前线程
+void timer_add(struct timer *t, uint32_t delay); // 启动定时器，delay个tick后到期
+bool timer_cancel(struct timer *t);              // 取消还没到期的定时器，返回它是否还在等待
+void sys_sleep(uint32_t m_second);               // sleep系统调用
+void timer_idle_halt(void);                      // idle线程停机，空闲期间停掉周期时钟
+
+extern uint32_t ticks; // 内核自中断开启以来的滴答数
 
 #endif
@@ -8,7 +8,8 @@
 #include "../lib/stdio.h"     //printk函数
 #include "../lib/string.h"    //strcmp函数
 
-struct dir root_dir; // 根目录
+struct dir root_dir;         // 根目录
+struct kmem_cache dir_cache; // 目录结构的对象缓存
 
 /*打开根目录，即初始化*/
 void open_root_dir(struct partition *part)
@@ -20,7 +21,7 @@ void open_root_dir(struct partition *part)
 /*在part分区打开i结点编号inode_no的目录，并返回目录指针*/
 struct dir *dir_open(struct partition *part, uint32_t inode_no)
 {
-    struct dir *pdir = (struct dir *)sys_malloc(sizeof(struct dir));
+    struct dir *pdir = (struct dir *)kmem_cache_alloc(&dir_cache);
     pdir->inode = inode_open(part, inode_no);
     pdir->dir_pos = 0;
     return pdir;
@@ -110,7 +111,7 @@ void dir_close(struct dir *dir)
     }
     // 对于一般目录，关闭目录就是关闭目录文件inode，然后释放dir所占内存
     inode_close(dir->inode);
-    sys_free(dir);
+    kmem_cache_free(&dir_cache, dir);
 }
 
 /*在内存中初始化目录项p_de*/
@@ -179,7 +180,7 @@ bool sync_dir_entry(struct dir *parent_dir, struct dir_entry *p_de, void *io_buf
                 if (block_lba == -1)                      // 分配失败
                 {
                     block_bitmap_idx = dir_inode->i_sectors[12] - cur_part->sb->data_start_lba;
-                    bitmap_set(&cur_part->block_bitmap, block_bitmap_idx, 0); // 将相应块位图设置为未使用
+                    free_index_release(&cur_part->block_index, block_bitmap_idx); // 将相应块位图设置为未使用
                     dir_inode->i_sectors[12] = 0;
                     printk("alloc block bitmap for sync_dir_entry failed\n");
                     return false;
@@ -23,6 +23,8 @@ struct dir_entry
     enum file_types f_type;           // 文件类型，1对应普通文件，2对应目录文件
 };
 
+extern struct kmem_cache dir_cache; // 目录结构的对象缓存
+
 /*打开根目录*/
 void open_root_dir(struct partition *part);
 /*在part分区打开i结点编号inode_no的目录，并返回目录指针*/
@@ -7,6 +7,7 @@
 #include "../lib/stdio.h"     //printk
 #include "../lib/string.h"
 #include "../lib/stdint.h"
+#include "../kernel/memory.h" //kmem_cache
 
 /*文件表，前三个成员预留给标准输入、标准输出、标准错误*/
 struct file file_table[MAX_FILE_OPEN];
@@ -60,25 +61,18 @@ int32_t pcb_fd_install(int32_t global_fd_idx)
 /*分配一个i节点，返回i结点号*/
 int32_t inode_bitmap_alloc(struct partition *part)
 {
-    int32_t bit_idx = bitmap_scan(&part->inode_bitmap, 1);
-    if (bit_idx == -1)
-    {
-        return -1; // 申请失败
-    }
-    // 申请成功，设置位图并返回编号
-    bitmap_set(&part->inode_bitmap, bit_idx, 1);
-    return bit_idx;
+    // 通过空闲索引直接定位空闲位，索引同时完成位图的设置
+    return free_index_alloc(&part->inode_index);
 }
 
 /*分配1个扇区，返回扇区lba地址*/
 int32_t block_bitmap_alloc(struct partition *part)
 {
-    int32_t bit_idx = bitmap_scan(&part->block_bitmap, 1);
+    int32_t bit_idx = free_index_alloc(&part->block_index);
     if (bit_idx == -1)
     {
         return -1; // 申请失败
     }
-    bitmap_set(&part->block_bitmap, bit_idx, 1);
     // 返回扇区lba号
     return (part->sb->data_start_lba + bit_idx);
 }
@@ -125,10 +119,10 @@ int32_t file_create(struct dir *parent_dir, char *filename, uint8_t flag)
         printk("inode_bitmap_alloc for i_no failed\n");
         return -1;
     }
-    struct inode *new_file_inode = (struct inode *)sys_malloc(sizeof(struct inode));
+    struct inode *new_file_inode = (struct inode *)kmem_cache_alloc(&inode_cache);
     if (new_file_inode == NULL)
     {
-        printk("sys_malloc for inode failed\n");
+        printk("kmem_cache_alloc for inode failed\n");
         rollback_step = 1;
         goto rollback;
     }
@@ -170,8 +164,7 @@ int32_t file_create(struct dir *parent_dir, char *filename, uint8_t flag)
     // 4.同步inode_bitmap
     bitmap_sync(cur_part, i_no, INODE_BITMAP);
     // 5.将inode加入到open_inode链表
-    list_push(&cur_part->open_inodes, &new_file_inode->inode_tag);
-    new_file_inode->i_open_cnts = 1;
+    inode_open_add(cur_part, new_file_inode);
 
     sys_free(io_buf);
     return pcb_fd_install(fd_idx);
@@ -183,9 +176,9 @@ rollback:
     case 3:
         memset(&file_table[fd_idx], 0, sizeof(struct file)); // 清空文件表
     case 2:
-        sys_free(new_file_inode);
+        kmem_cache_free(&inode_cache, new_file_inode);
     case 1:
-        bitmap_set(&cur_part->inode_bitmap, i_no, 0);
+        free_index_release(&cur_part->inode_index, i_no);
         break;
     }
     sys_free(io_buf);
@@ -0,0 +1,113 @@
+#include "free_index.h"
+#include "fs.h"               //BITS_PER_SECTOR
+#include "../kernel/memory.h" //sys_malloc函数
+#include "../kernel/debug.h"  //ASSERT哨兵
+#include "../lib/string.h"
+
+/*位图的第word_idx个32位字*/
+static uint32_t index_word(struct free_index *fi, uint32_t word_idx)
+{
+    return ((uint32_t *)fi->btmp->btmp_bits)[word_idx];
+}
+
+/*根据位图btmp的当前内容建立空闲索引fi，在挂载分区时调用*/
+void free_index_build(struct free_index *fi, struct bitmap *btmp)
+{
+    // 分区位图总是整扇区大小，字数一定是整数
+    ASSERT(btmp->btmp_bytes_len % 4 == 0);
+    uint32_t word_cnt = btmp->btmp_bytes_len / 4;
+    uint32_t bit_len = btmp->btmp_bytes_len * 8;
+    fi->btmp = btmp;
+    fi->group_cnt = DIV_ROUND_UP(bit_len, BITS_PER_SECTOR);
+    fi->summary.btmp_bytes_len = DIV_ROUND_UP(word_cnt, 8);
+    fi->summary.btmp_bits = (uint8_t *)sys_malloc(fi->summary.btmp_bytes_len);
+    fi->group_free = (uint16_t *)sys_malloc(fi->group_cnt * sizeof(uint16_t));
+    if (fi->summary.btmp_bits == NULL || fi->group_free == NULL)
+    {
+        PANIC("alloc memory failed!");
+    }
+    bitmap_init(&fi->summary);
+    memset(fi->group_free, 0, fi->group_cnt * sizeof(uint16_t));
+    fi->free_cnt = 0;
+
+    uint32_t word_idx;
+    for (word_idx = 0; word_idx < word_cnt; word_idx++)
+    {
+        uint32_t word = index_word(fi, word_idx);
+        if (word == 0xffffffff)
+        {
+            bitmap_set(&fi->summary, word_idx, 1);
+            continue;
+        }
+        // 统计字内0的个数
+        uint32_t free_bits = ~word, free_in_word = 0;
+        while (free_bits != 0)
+        {
+            free_bits &= free_bits - 1;
+            free_in_word++;
+        }
+        fi->group_free[word_idx * BITS_PER_WORD / BITS_PER_SECTOR] += free_in_word;
+        fi->free_cnt += free_in_word;
+    }
+    // 摘要位图末尾多出来的位不对应任何字，标记为已占用
+    uint32_t pad_idx;
+    for (pad_idx = word_cnt; pad_idx < fi->summary.btmp_bytes_len * 8; pad_idx++)
+    {
+        bitmap_set(&fi->summary, pad_idx, 1);
+    }
+}
+
+#define SUMMARY_WORDS_PER_GROUP (BITS_PER_SECTOR / BITS_PER_WORD / BITS_PER_WORD) // 一组在摘要位图里占几个字
+
+/*通过索引分配一个空闲位，成功返回位下标，失败返回-1
+ *先按group_free跳过已满的组，再在组内的摘要字里找到一个未满的字，最后用bsf在字内定位空闲位*/
+int32_t free_index_alloc(struct free_index *fi)
+{
+    if (fi->free_cnt == 0)
+    {
+        return -1;
+    }
+    uint32_t group = 0;
+    while (group < fi->group_cnt && fi->group_free[group] == 0)
+    {
+        group++;
+    }
+    if (group == fi->group_cnt)
+    {
+        return -1;
+    }
+    // 位图按整扇区分配，每组在摘要位图里正好占SUMMARY_WORDS_PER_GROUP个完整的字
+    uint32_t *summary_words = (uint32_t *)fi->summary.btmp_bits + group * SUMMARY_WORDS_PER_GROUP;
+    uint32_t i = 0;
+    while (summary_words[i] == 0xffffffff)
+    {
+        i++;
+        ASSERT(i < SUMMARY_WORDS_PER_GROUP); // group_free不为0，组内一定有未满的字
+    }
+    uint32_t word_idx = (group * SUMMARY_WORDS_PER_GROUP + i) * BITS_PER_WORD + bit_scan_forward(~summary_words[i]);
+    uint32_t bit_idx = word_idx * BITS_PER_WORD + bit_scan_forward(~index_word(fi, word_idx));
+    bitmap_set(fi->btmp, bit_idx, 1);
+    if (index_word(fi, word_idx) == 0xffffffff)
+    {
+        bitmap_set(&fi->summary, word_idx, 1); // 这个字满了
+    }
+    fi->group_free[group]--;
+    fi->free_cnt--;
+    return bit_idx;
+}
+
+/*返回位图里剩余的空闲位数*/
+uint32_t free_index_free_cnt(struct free_index *fi)
+{
+    return fi->free_cnt;
+}
+
+/*释放位bit_idx并更新索引*/
+void free_index_release(struct free_index *fi, uint32_t bit_idx)
+{
+    ASSERT(bitmap_scan_test(fi->btmp, bit_idx));
+    bitmap_set(fi->btmp, bit_idx, 0);
+    bitmap_set(&fi->summary, bit_idx / BITS_PER_WORD, 0);
+    fi->group_free[bit_idx / BITS_PER_SECTOR]++;
+    fi->free_cnt++;
+}
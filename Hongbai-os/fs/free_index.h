@@ -0,0 +1,27 @@
+#ifndef __FS_FREE_INDEX_H
+#define __FS_FREE_INDEX_H
+
+#include "../lib/stdint.h"
+#include "../lib/kernel/bitmap.h"
+
+/*位图的两级空闲索引，建立在分区的inode位图和块位图之上
+ *summary的第i位为1表示位图第i个32位字已经全部占用，为0表示字内还有空闲位
+ *位图每BITS_PER_SECTOR位(一个位图扇区)为一组，group_free记录每组的空闲位数，分配时据此跳过已满的组*/
+struct free_index
+{
+    struct bitmap *btmp;   // 被索引的位图
+    struct bitmap summary; // 摘要位图，一位对应btmp的一个字
+    uint16_t *group_free;  // 每组的空闲位数
+    uint32_t group_cnt;    // 组数
+    uint32_t free_cnt;     // 整个位图的空闲位数
+};
+
+/*根据位图btmp的当前内容建立空闲索引fi*/
+void free_index_build(struct free_index *fi, struct bitmap *btmp);
+/*通过索引分配一个空闲位，成功返回位下标，失败返回-1*/
+int32_t free_index_alloc(struct free_index *fi);
+/*返回位图里剩余的空闲位数*/
+uint32_t free_index_free_cnt(struct free_index *fi);
+/*释放位bit_idx并更新索引*/
+void free_index_release(struct free_index *fi, uint32_t bit_idx);
+#endif
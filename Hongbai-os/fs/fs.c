@@ -9,6 +9,7 @@
 #include "../lib/stdio.h"
 #include "../device/ide.h" //partition
 #include "../kernel/debug.h"
+#include "../kernel/memory.h" //kmem_cache
 
 struct partition *cur_part; // 记录默认情况下操作的分区
 
@@ -50,6 +51,7 @@ static bool mount_partition(struct list_elem *pelem, int arg)
         // sb_buf->block_bitmap_sects等价于cur_part->sb->block_bitmap_sects
         // 给位图指针赋值
         ide_read(hd, sb_buf->block_bitmap_lba, cur_part->block_bitmap.btmp_bits, sb_buf->block_bitmap_sects);
+        cur_part->block_bitmap.hint = 0; // 位图内容直接从硬盘读入，扫描从头开始
 
         /*将分区的inode位图写入内存*/
         cur_part->inode_bitmap.btmp_bits = (uint8_t *)sys_malloc(sb_buf->inode_bitmap_sects * SECTOR_SIZE);
@@ -57,8 +59,15 @@ static bool mount_partition(struct list_elem *pelem, int arg)
         {
             PANIC("alloc memory failed!");
         }
-        cur_part->inode_bitmap.btmp_bytes_len = sb_buf->block_bitmap_sects * SECTOR_SIZE;
+        cur_part->inode_bitmap.btmp_bytes_len = sb_buf->inode_bitmap_sects * SECTOR_SIZE;
         ide_read(hd, sb_buf->inode_bitmap_lba, cur_part->inode_bitmap.btmp_bits, sb_buf->inode_bitmap_sects);
+        cur_part->inode_bitmap.hint = 0;
+
+        /*根据读入的两个位图建立空闲索引，之后的分配都经过索引*/
+        free_index_build(&cur_part->block_index, &cur_part->block_bitmap);
+        free_index_build(&cur_part->inode_index, &cur_part->inode_bitmap);
+        printk("%s free blocks: %d, free inodes: %d\n", part->name,
+               free_index_free_cnt(&cur_part->block_index), free_index_free_cnt(&cur_part->inode_index));
 
         list_init(&cur_part->open_inodes);
         printk("mount %s done!\n", part->name);
@@ -192,6 +201,9 @@ static void partition_format(struct disk *hd, struct partition *part)
 void filesys_init()
 {
     uint8_t channel_no = 0, dev_no, part_idx = 0;
+    // 内存中的inode和目录结构频繁创建销毁，各自使用独立的对象缓存
+    kmem_cache_create(&inode_cache, "inode", sizeof(struct inode), KMEM_CACHE_ALIGN, NULL);
+    kmem_cache_create(&dir_cache, "dir", sizeof(struct dir), 0, NULL);
     // 开辟超级块缓冲区
     struct super_block *sb_buf = (struct super_block *)sys_malloc(SECTOR_SIZE);
     if (sb_buf == NULL)
@@ -218,7 +230,11 @@ void filesys_init()
                 {
                     part = hd->logic_parts; // 开始处理逻辑分区
                 }
-                if (part->sec_cnt != 0)
+                if (part->fs_type == PART_TYPE_SWAP)
+                { // 交换分区由swap_init接管，不能格式化
+                    printk("    %s is swap partition\n", part->name);
+                }
+                else if (part->sec_cnt != 0)
                 {
                     memset(sb_buf, 0, SECTOR_SIZE);
                     // 读取超级块，根据魔数判断是否存在文件系统
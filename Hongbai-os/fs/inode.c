@@ -7,9 +7,15 @@
 #include "../lib/string.h"       //memset,memcpy函数
 #include "../lib/stdint.h"
 #include "../lib/kernel/list.h" //list_elem结构体
+#include "../thread/spinlock.h"  //自旋锁
 
 // 已经编译过一次，没有编译错误了
 
+struct kmem_cache inode_cache; // inode对象缓存，对象总在内核空间，可以被所有进程共享
+/*保护各分区的open_inodes链表和其中inode的i_open_cnts
+ *关中断只能挡住本处理器，不同处理器上的进程会同时打开、关闭同一个inode*/
+static struct spinlock open_inodes_lock;
+
 /*用来存储inode位置的结构体*/
 struct inode_position
 {
@@ -80,15 +86,13 @@ void inode_sync(struct partition *part, struct inode *inode, void *io_buf)
     }
 }
 
-/*根据i节点号返回i节点指针*/
-struct inode *inode_open(struct partition *part, uint32_t inode_no)
+/*在分区的打开链表中找inode_no，找到时打开次数+1，调用者需持有open_inodes_lock*/
+static struct inode *inode_find_open(struct partition *part, uint32_t inode_no)
 {
-    // 先在每个分区中存在的，打开的i节点链表中寻找i节点，此链表是为了提速创建的缓冲区
     struct list_elem *elem = part->open_inodes.head.next;
-    struct inode *inode_found;
     while (elem != &part->open_inodes.tail)
     {
-        inode_found = elem2entry(struct inode, inode_tag, elem);
+        struct inode *inode_found = elem2entry(struct inode, inode_tag, elem);
         if (inode_found->i_no == inode_no) // 如果成功找到，inode打开次数+1,返回indoe地址
         {
             inode_found->i_open_cnts++;
@@ -96,19 +100,28 @@ struct inode *inode_open(struct partition *part, uint32_t inode_no)
         }
         elem = elem->next;
     }
+    return NULL;
+}
+
+/*根据i节点号返回i节点指针*/
+struct inode *inode_open(struct partition *part, uint32_t inode_no)
+{
+    // 先在每个分区中存在的，打开的i节点链表中寻找i节点，此链表是为了提速创建的缓冲区
+    enum intr_status old_status = spin_lock_irqsave(&open_inodes_lock);
+    struct inode *inode_found = inode_find_open(part, inode_no);
+    spin_unlock_irqrestore(&open_inodes_lock, old_status);
+    if (inode_found != NULL)
+    {
+        return inode_found;
+    }
 
     /*目前在链表中没有找到，于是从硬盘中读入inode并加入链表*/
     struct inode_position inode_pos;
     // 调用locate函数，获知no对应的inode的信息
     inode_locate(part, inode_no, &inode_pos);
 
-    /*为了让进程新创建的inode被共享，需要将inode放在内核区
-     *需要临时将pcb的pgdir设置为NULL*/
-    struct task_struct *cur = running_thread();
-    uint32_t *cur_pagedir_bak = cur->pgdir; // 临时记录
-    cur->pgdir = NULL;
-    inode_found = (struct inode *)sys_malloc(sizeof(struct inode));
-    cur->pgdir = cur_pagedir_bak;
+    /*为了让进程新创建的inode被共享，inode从内核的inode_cache中分配*/
+    inode_found = (struct inode *)kmem_cache_alloc(&inode_cache);
 
     char *inode_buf;
     if (inode_pos.two_sec == true)
@@ -123,29 +136,57 @@ struct inode *inode_open(struct partition *part, uint32_t inode_no)
         ide_read(part->my_disk, inode_pos.sec_lba, inode_buf, 1);
     }
     memcpy(inode_found, inode_buf + inode_pos.off_size, sizeof(struct inode));
-    // 加入队列方便后续使用
-    list_push(&part->open_inodes, &inode_found->inode_tag);
-    // 队列里没有，说明这是第一次被打开，打开次数设置为1
-    inode_found->i_open_cnts = 1;
     sys_free(inode_buf);
+    // 读盘时没有持锁，其他线程可能已经把同一个inode加入了队列，那时用它的
+    old_status = spin_lock_irqsave(&open_inodes_lock);
+    struct inode *raced = inode_find_open(part, inode_no);
+    if (raced == NULL)
+    {
+        // 加入队列方便后续使用
+        list_push(&part->open_inodes, &inode_found->inode_tag);
+        // 队列里没有，说明这是第一次被打开，打开次数设置为1
+        inode_found->i_open_cnts = 1;
+    }
+    spin_unlock_irqrestore(&open_inodes_lock, old_status);
+    if (raced != NULL)
+    {
+        kmem_cache_free(&inode_cache, inode_found);
+        return raced;
+    }
     return inode_found;
 }
 
 /*关闭indoe或减少inode打开数*/
 void inode_close(struct inode *inode)
 {
-    enum intr_status old_status = intr_disable(); // 关inode应为原子操作
-    if (--inode->i_open_cnts == 0)
+    enum intr_status old_status = spin_lock_irqsave(&open_inodes_lock); // 关inode应为原子操作
+    bool last = --inode->i_open_cnts == 0;
+    if (last)
     {
         list_remove(&inode->inode_tag);
-        // 内存中新的inode开辟在内核空间，移除时也需要确保回收内核空间
-        struct task_struct *cur = running_thread();
-        uint32_t *cur_pagedir_bak = cur->pgdir; // 临时记录
-        cur->pgdir = NULL;
-        sys_free(inode);
-        cur->pgdir = cur_pagedir_bak;
     }
-    intr_set_status(old_status);
+    spin_unlock_irqrestore(&open_inodes_lock, old_status);
+    if (last)
+    { // 内存中的inode来自inode_cache，关闭后放回缓存等待复用
+        kmem_cache_free(&inode_cache, inode);
+    }
+}
+
+/*把新建的inode挂到分区的打开链表上，打开次数为1*/
+void inode_open_add(struct partition *part, struct inode *inode)
+{
+    enum intr_status old_status = spin_lock_irqsave(&open_inodes_lock);
+    list_push(&part->open_inodes, &inode->inode_tag);
+    inode->i_open_cnts = 1;
+    spin_unlock_irqrestore(&open_inodes_lock, old_status);
+}
+
+/*已经打开的inode再增加一次打开次数*/
+void inode_dup(struct inode *inode)
+{
+    enum intr_status old_status = spin_lock_irqsave(&open_inodes_lock);
+    inode->i_open_cnts++;
+    spin_unlock_irqrestore(&open_inodes_lock, old_status);
 }
 
 /*初始化new_inode*/
@@ -18,12 +18,18 @@ struct inode
     struct list_elem inode_tag;
 };
 
+extern struct kmem_cache inode_cache; // 内存中inode的对象缓存
+
 /*将inode写入到分区part*/
 void inode_sync(struct partition *part, struct inode *inode, void *io_buf);
 /*根据i节点号返回i节点指针*/
 struct inode *inode_open(struct partition *part, uint32_t inode_no);
 /*关闭indoe或减少inode打开数*/
 void inode_close(struct inode *inode);
+/*把新建的inode挂到分区的打开链表上，打开次数为1*/
+void inode_open_add(struct partition *part, struct inode *inode);
+/*已经打开的inode再增加一次打开次数*/
+void inode_dup(struct inode *inode);
 /*初始化new_inode*/
 void inode_init(uint32_t inode_no, struct inode *new_inode);
 #endif
\ No newline at end of file
@@ -0,0 +1,717 @@
+// 启动时的性能测量，每一项打印改进前后两种做法每次操作的平均周期数
+// 改进前的做法已经不在内核里的，照抄一份作为对照组放在这里
+#include "./bench.h"
+#include "./memory.h"
+#include "./global.h"
+#include "./debug.h"
+#include "../lib/stdio.h"
+#include "../lib/kernel/bitmap.h"
+#include "../lib/string.h"
+#include "../lib/kernel/list.h"
+#include "./interrupt.h"
+#include "./smp.h"
+#include "../device/timer.h"
+#include "../thread/thread.h"
+#include "../thread/sync.h"
+#include "../thread/spinlock.h"
+#include "../userprog/process.h"
+#include "../lib/user/syscall.h"
+#include "../lib/user/malloc.h"
+
+#define PG_SIZE 4096
+#define PALLOC_ITERS 4096 // 单页申请释放的总次数
+#define PALLOC_BATCH 64   // 每批连续申请这么多页再全部释放，让伙伴系统经历拆分和合并
+#define SCAN_BITS (512 * 1024 * 1024 / PG_SIZE) // 512MB内存池的位图
+#define SCAN_ITERS 64     // 每种扫描重复的次数
+#define MALLOC_CNT 2048   // 16字节小块的申请次数，大约8个arena
+#define LEGACY_ARENA_HDR 12 // 原来的arena头：desc指针、large、cnt
+#define WALK_PAGES 1000   // 跨步访问的页数，超过一级tlb的容量
+#define WALK_STRIDE (PG_SIZE + 64) // 每次跨过一页再错开一个缓存行，避免都落在同一个缓存组
+#define WALK_ROUNDS 32
+#define ZERO_PAGES 128    // 单页申请的次数，是预清零链表上限的两倍，前一半命中后一半落空
+#define PINGPONG_ROUNDS 1000 // 两个线程来回切换的轮数
+#define PINGPONG_PAGES 32    // 每次被唤醒后读这么多页，tlb里留着它们时才便宜
+#define USER_MALLOC_PAIRS 1000000 // 用户进程里malloc/free的对数
+#define HOG_CNT 3            // 占满处理器的最高级线程数
+#define STARVE_RUN_MS 5000   // 饥饿测量持续的时间
+#define SLEEPER_MS 10        // sleeper每次睡眠的时长
+#define FORKJOIN_THREADS NR_CPUS // fork-join的工作线程数
+#define FORKJOIN_WORK 50000000   // 每个工作线程的循环次数，几十毫秒，比偷线程的延迟长得多
+
+/* 64位的cycles除以cnt，商超过32位时返回0xffffffff */
+uint32_t cycles_per(uint64_t cycles, uint32_t cnt)
+{
+    uint32_t hi = (uint32_t)(cycles >> 32), lo = (uint32_t)cycles;
+    if (hi >= cnt)
+    {
+        return 0xffffffff;
+    }
+    uint32_t quot, rem;
+    asm("divl %4" : "=a"(quot), "=d"(rem) : "a"(lo), "d"(hi), "rm"(cnt));
+    return quot;
+}
+
+/*原来的bitmap_scan：从第0个字节开始逐字节和0xff比较，再逐位测试
+ *cnt大于1时从第一个空位往后逐位数连续的空位*/
+static int legacy_bitmap_scan(struct bitmap *btmp, uint32_t cnt)
+{
+    uint32_t idx_byte = 0;
+    while (idx_byte < btmp->btmp_bytes_len && btmp->btmp_bits[idx_byte] == 0xff)
+    {
+        idx_byte++;
+    }
+    if (idx_byte == btmp->btmp_bytes_len)
+    {
+        return -1;
+    }
+    int idx_bit = 0;
+    while (idx_bit < 8 && (btmp->btmp_bits[idx_byte] & (BITMAP_MASK << idx_bit)))
+    {
+        idx_bit++;
+    }
+    int bit_idx_start = idx_byte * 8 + idx_bit;
+    if (cnt == 1)
+    {
+        return bit_idx_start;
+    }
+    uint32_t bit_left = btmp->btmp_bytes_len * 8 - bit_idx_start;
+    uint32_t next_bit = bit_idx_start + 1;
+    uint32_t count = 1;
+    bit_idx_start = -1;
+    while (bit_left-- > 0 && next_bit < btmp->btmp_bytes_len * 8)
+    {
+        count = bitmap_scan_test(btmp, next_bit) ? 0 : count + 1;
+        if (count == cnt)
+        {
+            bit_idx_start = next_bit - cnt + 1;
+            break;
+        }
+        next_bit++;
+    }
+    return bit_idx_start;
+}
+
+/*单页物理页的申请和释放：伙伴系统对比原来的位图路径
+ *原来的palloc每次从第0位开始bitmap_scan，这里用和内核池页数一样大、前90%已占用的位图重现池快满时的情形*/
+static void bench_palloc(void)
+{
+    struct pool_stat st;
+    mem_pool_stat(PF_KERNEL, &st);
+    uint32_t bits = st.owned_pages;
+    struct bitmap bm;
+    bm.btmp_bytes_len = DIV_ROUND_UP(bits, 32) * 4; // 新的位图按32位字扫描，长度取4字节的整数倍
+    bm.btmp_bits = sys_malloc(bm.btmp_bytes_len);
+    if (bm.btmp_bits == NULL)
+    {
+        printk("palloc: skipped, no memory\n");
+        return;
+    }
+    bitmap_init(&bm);
+    bitmap_set_range(&bm, 0, bits / 10 * 9);
+    uint32_t idx[PALLOC_BATCH];
+    uint32_t round, i;
+    uint64_t start = rdtsc();
+    for (round = 0; round < PALLOC_ITERS / PALLOC_BATCH; round++)
+    {
+        for (i = 0; i < PALLOC_BATCH; i++)
+        {
+            idx[i] = legacy_bitmap_scan(&bm, 1);
+            bitmap_set(&bm, idx[i], 1);
+        }
+        for (i = 0; i < PALLOC_BATCH; i++)
+        {
+            bitmap_set(&bm, idx[i], 0);
+        }
+    }
+    uint64_t legacy = rdtsc() - start;
+    uint64_t buddy = mem_bench_palloc(PALLOC_ITERS, PALLOC_BATCH);
+    printk("palloc+pfree cycles/page (%d frames, 9/10 used): bitmap %d, buddy %d\n",
+           bits, cycles_per(legacy, PALLOC_ITERS), cycles_per(buddy, PALLOC_ITERS));
+    sys_free(bm.btmp_bits);
+}
+
+/*对bm重复扫描SCAN_ITERS次，cold为true时每次把hint清零，返回总周期数
+ *legacy为true时用原来的逐字节扫描，不修改位图，每次扫描的工作量相同*/
+static uint64_t scan_loop(struct bitmap *bm, uint32_t cnt, bool legacy, bool cold)
+{
+    uint32_t i;
+    uint64_t start = rdtsc();
+    for (i = 0; i < SCAN_ITERS; i++)
+    {
+        if (cold)
+        {
+            bm->hint = 0;
+        }
+        int idx = legacy ? legacy_bitmap_scan(bm, cnt) : bitmap_scan(bm, cnt);
+        ASSERT(idx != -1);
+    }
+    return rdtsc() - start;
+}
+
+/*位图扫描：512MB内存池大小的位图，空闲位都在末尾
+ *满图：只剩最后32位空闲，cnt=1；碎片：每8位空一位，末尾留64位连续空闲，cnt=8
+ *新的扫描分hint清零（冷）和hint已指向第一个空闲位（热）两种*/
+static void bench_bitmap_scan(void)
+{
+    struct bitmap bm;
+    bm.btmp_bytes_len = SCAN_BITS / 8;
+    bm.btmp_bits = sys_malloc(bm.btmp_bytes_len);
+    if (bm.btmp_bits == NULL)
+    {
+        printk("bitmap scan: skipped, no memory\n");
+        return;
+    }
+    bitmap_init(&bm);
+    bitmap_set_range(&bm, 0, SCAN_BITS - 32);
+    uint64_t legacy = scan_loop(&bm, 1, true, true);
+    uint64_t cold = scan_loop(&bm, 1, false, true);
+    uint64_t warm = scan_loop(&bm, 1, false, false);
+    printk("bitmap scan cycles (%d bits, full, cnt=1): byte %d, word %d, word+hint %d\n",
+           SCAN_BITS, cycles_per(legacy, SCAN_ITERS), cycles_per(cold, SCAN_ITERS), cycles_per(warm, SCAN_ITERS));
+
+    memset(bm.btmp_bits, 0xfe, bm.btmp_bytes_len);
+    bitmap_clear_range(&bm, SCAN_BITS - 64, 64); // 每个字节只有最低位空闲，末尾64位全空
+    legacy = scan_loop(&bm, 8, true, true);
+    cold = scan_loop(&bm, 8, false, true);
+    printk("bitmap scan cycles (%d bits, 1/8 free, cnt=8): byte %d, word %d\n",
+           SCAN_BITS, cycles_per(legacy, SCAN_ITERS), cycles_per(cold, SCAN_ITERS));
+    sys_free(bm.btmp_bits);
+}
+
+/*原来的sys_malloc补充小块：整页arena拆成小块逐个挂到空闲链表，每块先用elem_find确认不在链表里
+ *原来的sys_free在arena全空时逆着做一遍，两者都在关中断下进行，返回拆分和回收各自的周期数*/
+static void legacy_arena_cycle(void *page, uint32_t block_size, uint64_t *carve, uint64_t *release)
+{
+    struct list free_list;
+    list_init(&free_list);
+    uint32_t blocks = (PG_SIZE - LEGACY_ARENA_HDR) / block_size;
+    uint32_t block_idx;
+    enum intr_status old_status = intr_disable();
+    uint64_t start = rdtsc();
+    for (block_idx = 0; block_idx < blocks; block_idx++)
+    {
+        struct mem_block *b = (struct mem_block *)((uint32_t)page + LEGACY_ARENA_HDR + block_idx * block_size);
+        ASSERT(!elem_find(&free_list, &b->free_elem));
+        list_append(&free_list, &b->free_elem);
+    }
+    *carve = rdtsc() - start;
+    start = rdtsc();
+    for (block_idx = 0; block_idx < blocks; block_idx++)
+    {
+        struct mem_block *b = (struct mem_block *)((uint32_t)page + LEGACY_ARENA_HDR + block_idx * block_size);
+        ASSERT(elem_find(&free_list, &b->free_elem));
+        list_remove(&b->free_elem);
+    }
+    *release = rdtsc() - start;
+    intr_set_status(old_status);
+}
+
+/*16字节小块：逐次计时sys_malloc和sys_free，取最大值和平均值
+ *最大值落在补充magazine时新建arena、以及归还magazine时释放整个arena的那一次
+ *每次调用单独关中断，时钟中断不计入*/
+static void bench_malloc(void)
+{
+    void *page = sys_malloc(PG_SIZE); // 原来的arena只用到页内的地址，不需要页对齐
+    if (page == NULL)
+    {
+        printk("malloc: skipped, no memory\n");
+        return;
+    }
+    uint64_t carve, release;
+    legacy_arena_cycle(page, 16, &carve, &release);
+    sys_free(page);
+    void **ptrs = sys_malloc(MALLOC_CNT * sizeof(void *));
+    if (ptrs == NULL)
+    {
+        printk("malloc: skipped, no memory\n");
+        return;
+    }
+
+    uint64_t alloc_sum = 0, free_sum = 0, t;
+    uint32_t alloc_max = 0, free_max = 0, i;
+    for (i = 0; i < MALLOC_CNT; i++)
+    {
+        enum intr_status old_status = intr_disable();
+        uint64_t start = rdtsc();
+        ptrs[i] = sys_malloc(16);
+        t = rdtsc() - start;
+        intr_set_status(old_status);
+        ASSERT(ptrs[i] != NULL);
+        alloc_sum += t;
+        alloc_max = t > alloc_max ? (uint32_t)t : alloc_max;
+    }
+    for (i = 0; i < MALLOC_CNT; i++)
+    {
+        enum intr_status old_status = intr_disable();
+        uint64_t start = rdtsc();
+        sys_free(ptrs[i]);
+        t = rdtsc() - start;
+        intr_set_status(old_status);
+        free_sum += t;
+        free_max = t > free_max ? (uint32_t)t : free_max;
+    }
+    printk("malloc(16) cycles: legacy carve %d, legacy release %d (per arena, intr off)\n",
+           cycles_per(carve, 1), cycles_per(release, 1));
+    printk("malloc(16) cycles: alloc avg %d max %d, free avg %d max %d\n",
+           cycles_per(alloc_sum, MALLOC_CNT), alloc_max, cycles_per(free_sum, MALLOC_CNT), free_max);
+    sys_free(ptrs);
+}
+
+/*在buf开始的WALK_PAGES页内跨步读取WALK_ROUNDS遍，返回每次访问的平均周期数*/
+static uint32_t stride_walk(volatile uint8_t *buf)
+{
+    uint32_t round, off, sum = 0, accesses = 0;
+    uint64_t start = rdtsc();
+    for (round = 0; round < WALK_ROUNDS; round++)
+    {
+        for (off = 0; off + WALK_STRIDE <= WALK_PAGES * PG_SIZE; off += WALK_STRIDE)
+        {
+            sum += buf[off];
+            accesses++;
+        }
+    }
+    uint64_t cycles = rdtsc() - start;
+    ASSERT(sum == 0); // sys_malloc的整页分配已经清零
+    return cycles_per(cycles, accesses);
+}
+
+/*4KB页和4MB大页映射的同样大小的内存上做跨步访问，对比tlb缺失的开销
+ *不满1024页的内核大块走4KB页，满1024页的走malloc_large_page*/
+static void bench_large_page(void)
+{
+    void *small = sys_malloc((LARGE_PG_PAGES - 1) * PG_SIZE - 64);
+    void *large = sys_malloc(LARGE_PG_SIZE);
+    if (small == NULL || large == NULL || !(*pde_ptr((uint32_t)large) & PG_PS_1))
+    {
+        printk("large page: skipped, no 4MB page available\n");
+    }
+    else
+    {
+        stride_walk(small); // 先各走一遍，排除第一次访问的缓存缺失
+        stride_walk(large);
+        printk("stride walk cycles/access (%d pages): 4KB %d, 4MB %d\n",
+               WALK_PAGES, stride_walk(small), stride_walk(large));
+    }
+    if (small != NULL)
+    {
+        sys_free(small);
+    }
+    if (large != NULL)
+    {
+        sys_free(large);
+    }
+}
+
+/*get_kernel_pages(1)：先睡一会儿让idle线程把预清零链表填满，再连续申请ZERO_PAGES页
+ *按每次申请前后zero_hits有没有增加，把周期数分别记到命中和落空上，落空时要当场memset*/
+static void bench_zero_page(void)
+{
+    void **pages = sys_malloc(ZERO_PAGES * sizeof(void *));
+    if (pages == NULL)
+    {
+        printk("zero page: skipped, no memory\n");
+        return;
+    }
+    mtime_sleep(100);
+    uint32_t hits_before = alloc_stats.zero_hits, misses_before = alloc_stats.zero_misses;
+    uint64_t hit_cycles = 0, miss_cycles = 0;
+    uint32_t hits = 0, cnt;
+    for (cnt = 0; cnt < ZERO_PAGES; cnt++)
+    {
+        uint32_t zero_hits = alloc_stats.zero_hits;
+        enum intr_status old_status = intr_disable();
+        uint64_t start = rdtsc();
+        pages[cnt] = get_kernel_pages(1);
+        uint64_t t = rdtsc() - start;
+        intr_set_status(old_status);
+        if (pages[cnt] == NULL)
+        {
+            break;
+        }
+        if (alloc_stats.zero_hits != zero_hits)
+        {
+            hit_cycles += t;
+            hits++;
+        }
+        else
+        {
+            miss_cycles += t;
+        }
+    }
+    printk("get_kernel_pages(1) cycles: prezeroed %d (%d hits), memset %d (%d misses)\n",
+           hits ? cycles_per(hit_cycles, hits) : 0, alloc_stats.zero_hits - hits_before,
+           cnt > hits ? cycles_per(miss_cycles, cnt - hits) : 0, alloc_stats.zero_misses - misses_before);
+    mem_bench_free_pages(pages, cnt);
+    sys_free(pages);
+}
+
+/*测量线程没有退出的办法，做完后永远阻塞*/
+static void bench_thread_park(void)
+{
+    thread_block(TASK_BLOCKED);
+}
+
+struct pingpong
+{
+    struct semaphore ping;    // 轮到运行测量的线程
+    struct semaphore pong;    // 轮到pong线程
+    volatile uint8_t *buf;    // 两边轮流读的PINGPONG_PAGES页
+    bool flush;               // 每次被唤醒后连同全局页刷掉整个tlb，重现原来每次切换都重新加载cr3的情形
+    uint32_t rounds;          // 还要来回几轮，0时pong线程停下
+};
+
+/*被唤醒后按flush决定是否刷tlb，再把buf的每页读一遍*/
+static void pingpong_touch(struct pingpong *pp)
+{
+    if (pp->flush)
+    {
+        tlb_flush_local((uint32_t)pp->buf, PINGPONG_PAGES * 2); // 超过逐页invlpg的阈值，内核地址整体刷新
+    }
+    uint32_t i, sum = 0;
+    for (i = 0; i < PINGPONG_PAGES; i++)
+    {
+        sum += pp->buf[i * PG_SIZE];
+    }
+    ASSERT(sum == 0);
+}
+
+static void pingpong_thread(void *arg)
+{
+    struct pingpong *pp = arg;
+    while (true)
+    {
+        sema_down(&pp->pong);
+        if (pp->rounds == 0)
+        {
+            break;
+        }
+        pingpong_touch(pp);
+        sema_up(&pp->ping);
+    }
+    sema_up(&pp->ping);
+    bench_thread_park();
+}
+
+/*来回PINGPONG_ROUNDS轮，返回每轮(两次切换)的周期数*/
+static uint32_t pingpong_run(struct pingpong *pp, bool flush)
+{
+    pp->flush = flush;
+    uint32_t round;
+    uint64_t start = rdtsc();
+    for (round = 0; round < PINGPONG_ROUNDS; round++)
+    {
+        sema_up(&pp->pong);
+        sema_down(&pp->ping);
+        pingpong_touch(pp);
+    }
+    return cycles_per(rdtsc() - start, PINGPONG_ROUNDS);
+}
+
+/*两个内核线程用信号量来回切换，每次被唤醒后读几十页
+ *内核线程共用内核页目录表，现在切换时不重新加载cr3，内核页又是全局页，tlb项一直有效；
+ *flush的一组每次唤醒后整体刷tlb，代价相当于原来的切换。两个线程都固定在引导处理器上*/
+static void bench_pingpong(void)
+{
+    struct pingpong *pp = sys_malloc(sizeof(struct pingpong));
+    void *buf = sys_malloc(PINGPONG_PAGES * PG_SIZE);
+    if (pp == NULL || buf == NULL)
+    {
+        printk("pingpong: skipped, no memory\n");
+        return;
+    }
+    sema_init(&pp->ping, 0);
+    sema_init(&pp->pong, 0);
+    pp->buf = buf;
+    pp->rounds = 1;
+    struct task_struct *cur = running_thread();
+    uint32_t old_mask = cur->cpus_allowed;
+    thread_set_affinity(cur, 1);
+    struct task_struct *pong = thread_start("bench_pong", 31, pingpong_thread, pp);
+    thread_set_affinity(pong, 1);
+    pingpong_run(pp, false); // 先来回一遍，让pong线程迁移到引导处理器上
+    uint32_t lazy = pingpong_run(pp, false);
+    uint32_t flushed = pingpong_run(pp, true);
+    pp->rounds = 0;
+    sema_up(&pp->pong);
+    sema_down(&pp->ping);
+    thread_set_affinity(cur, old_mask);
+    printk("pingpong cycles/round (%d pages touched): no cr3 reload %d, full tlb flush %d\n",
+           PINGPONG_PAGES, lazy, flushed);
+    sys_free(buf);
+    sys_free(pp);
+}
+
+/*原来用户态的malloc/free：每次都陷入内核，由sys_malloc/sys_free在用户池上分配*/
+static void *trap_malloc(uint32_t size)
+{
+    void *ptr;
+    asm volatile("int $0x80" : "=a"(ptr) : "a"(SYS_MALLOC), "b"(size) : "memory");
+    return ptr;
+}
+
+static void trap_free(void *ptr)
+{
+    uint32_t retval;
+    asm volatile("int $0x80" : "=a"(retval) : "a"(SYS_FREE), "b"(ptr) : "memory");
+}
+
+/*用户进程：lib/user的分配器和陷入内核的老办法各做USER_MALLOC_PAIRS对32字节的malloc/free
+ *rdtsc在用户态也能执行，结果用printf打印，和内核线程的测量异步输出*/
+static void bench_user_malloc(void)
+{
+    uint32_t i;
+    uint64_t start = rdtsc();
+    for (i = 0; i < USER_MALLOC_PAIRS; i++)
+    {
+        void *ptr = malloc(32);
+        if (ptr == NULL)
+        {
+            break; // 用户态不能用ASSERT，它会关中断
+        }
+        free(ptr);
+    }
+    uint32_t user_lib = cycles_per(rdtsc() - start, USER_MALLOC_PAIRS);
+    start = rdtsc();
+    for (i = 0; i < USER_MALLOC_PAIRS; i++)
+    {
+        void *ptr = trap_malloc(32);
+        if (ptr == NULL)
+        {
+            break;
+        }
+        trap_free(ptr);
+    }
+    uint32_t trap = cycles_per(rdtsc() - start, USER_MALLOC_PAIRS);
+    printf("user malloc+free(32) cycles/pair (%d pairs): lib/user %d, int 0x80 %d\n",
+           USER_MALLOC_PAIRS, user_lib, trap);
+    while (true)
+    {
+        sleep(1000); // 用户进程没有exit，做完后一直睡眠
+    }
+}
+
+/*多个线程做完时各调用一次，最后一个做完的叫醒等待的线程
+ *信号量是二值的，等待的线程还没醒来时再up一次会出错，所以只up一次*/
+static void bench_join_done(volatile uint32_t *left, struct semaphore *done)
+{
+    if (atomic_dec_and_test(left))
+    {
+        sema_up(done);
+    }
+}
+
+struct starve
+{
+    volatile bool stop;       // 测量结束，各线程停下
+    volatile uint32_t left;   // 还没停下的线程数
+    struct semaphore done;    // 所有线程都停下时up一次
+    uint32_t victim_gap;      // 0级计算线程两次运行之间最长隔了多少tick
+    uint32_t wake_max;        // sleeper醒来比预定时刻晚的最大tick数
+    uint32_t wake_sum;        // 晚到的tick数之和
+    uint32_t wake_cnt;        // sleeper醒来的次数
+};
+
+/*最高级的计算线程，一直占着处理器*/
+static void starve_hog(void *arg)
+{
+    struct starve *sv = arg;
+    while (!sv->stop)
+    {
+    }
+    bench_join_done(&sv->left, &sv->done);
+    bench_thread_park();
+}
+
+/*0级的计算线程：不停地读ticks，两次读到的值相差多少就是中间被换下了多久*/
+static void starve_victim(void *arg)
+{
+    struct starve *sv = arg;
+    uint32_t last = ticks;
+    while (!sv->stop)
+    {
+        uint32_t now = ticks;
+        if (now - last > sv->victim_gap)
+        {
+            sv->victim_gap = now - last;
+        }
+        last = now;
+    }
+    bench_join_done(&sv->left, &sv->done);
+    bench_thread_park();
+}
+
+/*低优先级的交互线程：反复睡SLEEPER_MS毫秒，记下每次醒来后真正运行时比预定晚了几个tick*/
+static void starve_sleeper(void *arg)
+{
+    struct starve *sv = arg;
+    uint32_t sleep_ticks = DIV_ROUND_UP(SLEEPER_MS * TIMER_HZ, 1000);
+    while (!sv->stop)
+    {
+        uint32_t due = ticks + sleep_ticks;
+        mtime_sleep(SLEEPER_MS);
+        uint32_t late = ticks - due;
+        sv->wake_max = late > sv->wake_max ? late : sv->wake_max;
+        sv->wake_sum += late;
+        sv->wake_cnt++;
+    }
+    bench_join_done(&sv->left, &sv->done);
+    bench_thread_park();
+}
+
+/*负载下的调度延迟：HOG_CNT个最高级的计算线程占满引导处理器，
+ *看一个0级的计算线程最长要等多久才能再运行，以及一个1级的sleeper醒来后多久能运行
+ *老化保证前者不超过STARVE_TICKS+AGE_INTERVAL再加上最高级每个线程一个时间片，后者有唤醒加成*/
+static void bench_starve(void)
+{
+    struct starve *sv = sys_malloc(sizeof(struct starve));
+    if (sv == NULL)
+    {
+        printk("starve: skipped, no memory\n");
+        return;
+    }
+    memset(sv, 0, sizeof(struct starve));
+    sema_init(&sv->done, 0);
+    sv->left = HOG_CNT + 2;
+    uint32_t i;
+    for (i = 0; i < HOG_CNT; i++)
+    {
+        thread_set_affinity(thread_start("bench_hog", 31, starve_hog, sv), 1);
+    }
+    thread_set_affinity(thread_start("bench_victim", 0, starve_victim, sv), 1);
+    thread_set_affinity(thread_start("bench_sleeper", 1, starve_sleeper, sv), 1);
+    mtime_sleep(STARVE_RUN_MS);
+    sv->stop = true;
+    sema_down(&sv->done);
+    printk("under load (%d hogs): prio 0 max wait %d ticks, prio 1 wakeup late avg %d max %d ticks\n",
+           HOG_CNT, sv->victim_gap, sv->wake_cnt ? sv->wake_sum / sv->wake_cnt : 0, sv->wake_max);
+    sys_free(sv);
+}
+
+struct forkjoin;
+
+struct forkjoin_worker
+{
+    struct forkjoin *fj;
+    struct semaphore go;        // 放行这个线程做一轮
+    struct task_struct *thread;
+};
+
+struct forkjoin
+{
+    struct forkjoin_worker workers[FORKJOIN_THREADS];
+    volatile uint32_t left;     // 这一轮还没做完的线程数
+    struct semaphore done;      // 这一轮都做完时up一次
+    volatile bool stop;         // 为true时放行的线程停下
+};
+
+/* 固定的计算量，不碰共享数据 */
+static void forkjoin_work(void)
+{
+    volatile uint32_t sum = 0;
+    uint32_t i;
+    for (i = 0; i < FORKJOIN_WORK; i++)
+    {
+        sum += i;
+    }
+}
+
+static void forkjoin_thread(void *arg)
+{
+    struct forkjoin_worker *w = arg;
+    while (true)
+    {
+        sema_down(&w->go);
+        if (w->fj->stop)
+        {
+            break;
+        }
+        forkjoin_work();
+        bench_join_done(&w->fj->left, &w->fj->done);
+    }
+    bench_join_done(&w->fj->left, &w->fj->done);
+    bench_thread_park();
+}
+
+/*把工作线程的亲和性设为mask后一起放行，返回从放行到最后一个做完的周期数
+ *被唤醒的线程留在上次运行的处理器上，只要那里还允许*/
+static uint64_t forkjoin_run(struct forkjoin *fj, uint32_t mask)
+{
+    uint32_t i;
+    for (i = 0; i < FORKJOIN_THREADS; i++)
+    {
+        thread_set_affinity(fj->workers[i].thread, mask);
+    }
+    fj->left = FORKJOIN_THREADS;
+    uint64_t start = rdtsc();
+    for (i = 0; i < FORKJOIN_THREADS; i++)
+    {
+        sema_up(&fj->workers[i].go);
+    }
+    sema_down(&fj->done);
+    return rdtsc() - start;
+}
+
+/*fork-join：FORKJOIN_THREADS个线程各做一份固定的计算，最后一个做完时汇合
+ *对照组是本线程串行做完全部计算，以及工作线程都固定在引导处理器上；
+ *偷线程的一组先让它们在引导处理器上跑过一轮，放开亲和性后唤醒时仍然都排在那里，只有空闲处理器来偷才能分散
+ *加速比乘以100打印，单处理器时都在100左右*/
+static void bench_forkjoin(void)
+{
+    struct forkjoin *fj = sys_malloc(sizeof(struct forkjoin));
+    if (fj == NULL)
+    {
+        printk("forkjoin: skipped, no memory\n");
+        return;
+    }
+    memset(fj, 0, sizeof(struct forkjoin));
+    sema_init(&fj->done, 0);
+    struct task_struct *cur = running_thread();
+    uint32_t old_mask = cur->cpus_allowed;
+    thread_set_affinity(cur, 1); // rdtsc总在引导处理器上读
+    uint32_t i;
+    for (i = 0; i < FORKJOIN_THREADS; i++)
+    {
+        struct forkjoin_worker *w = &fj->workers[i];
+        w->fj = fj;
+        sema_init(&w->go, 0);
+        w->thread = thread_start("bench_fj", 31, forkjoin_thread, w);
+    }
+    uint64_t start = rdtsc();
+    for (i = 0; i < FORKJOIN_THREADS; i++)
+    {
+        forkjoin_work();
+    }
+    uint64_t serial = rdtsc() - start;
+    uint64_t pinned = forkjoin_run(fj, 1);
+    uint64_t stolen = forkjoin_run(fj, CPU_MASK_ALL);
+    fj->stop = true;
+    fj->left = FORKJOIN_THREADS;
+    for (i = 0; i < FORKJOIN_THREADS; i++)
+    {
+        sema_up(&fj->workers[i].go);
+    }
+    sema_down(&fj->done);
+    thread_set_affinity(cur, old_mask);
+    // 按1024个周期为单位相除，商和除数都不会超过32位
+    printk("fork-join %d threads on %d cpus: serial %d Mcycles, speedup x100: pinned to cpu0 %d, stealing %d\n",
+           FORKJOIN_THREADS, cpu_cnt, cycles_per(serial, 1000000),
+           cycles_per((serial >> 10) * 100, (uint32_t)(pinned >> 10)),
+           cycles_per((serial >> 10) * 100, (uint32_t)(stolen >> 10)));
+    sys_free(fj);
+}
+
+/* 依次运行所有测量 */
+void bench_run(void)
+{
+    printk("bench start\n");
+    bench_palloc();
+    bench_bitmap_scan();
+    bench_malloc();
+    bench_large_page();
+    bench_zero_page();
+    bench_pingpong();
+    bench_starve();
+    bench_forkjoin();
+    process_execute(bench_user_malloc, "bench_malloc");
+    printk("bench done\n");
+}
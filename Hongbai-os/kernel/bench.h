@@ -0,0 +1,16 @@
+// 启动时的性能测量，make BENCH=1时才编译进内核，由main在开中断后调用bench_run
+#ifndef __KERNEL_BENCH_H
+#define __KERNEL_BENCH_H
+#include "../lib/stdint.h"
+
+/* 读时间戳计数器，用户态也能执行 */
+static inline uint64_t rdtsc(void)
+{
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+uint32_t cycles_per(uint64_t cycles, uint32_t cnt); // cycles/cnt，内核里没有64位除法的库函数
+void bench_run(void);                              // 依次运行所有测量并打印结果
+#endif
@@ -12,6 +12,7 @@
 #include "../userprog/syscall-init.h"
 #include "../device/ide.h"
 #include "../fs/fs.h"
+#include "./swap.h"
 
 /*负责初始化所有模块 */
 void init_all()
@@ -26,5 +27,6 @@ void init_all()
     tss_init();      // TSS和GDT初始化
     syscall_init();  // 系统调用初始化
     ide_init();      // 硬盘驱动初始化
+    swap_init();     // 交换分区初始化
     filesys_init();  // 文件系统初始化
 }
\ No newline at end of file
@@ -86,9 +86,9 @@ static void idt_desc_init(void)
 /* 通用的中断处理函数,一般用在异常出现时的处理 */
 static void general_intr_handler(uint8_t vec_nr)
 {
-    if (vec_nr == 0x27 || vec_nr == 0x2f)
+    if (vec_nr == 0x27 || vec_nr == 0x2f || vec_nr == 0x3f)
     {           // 0x2f是从片8259A上的最后一个irq引脚，保留
-        return; // IRQ7和IRQ15会产生伪中断(spurious interrupt),无须处理。
+        return; // IRQ7和IRQ15会产生伪中断(spurious interrupt),无须处理。本地APIC的伪中断0x3f也一样
     }
     // put_str("test general_intr_handler\n");
     /* 将光标置为0，从屏幕左上角清出一片打印异常信息的区域，方便阅读 */
@@ -159,10 +159,15 @@ void idt_init()
     idt_desc_init();  // 初始化中断描述符表
     exception_init(); // 异常名初始化并注册通常的中断处理函数
     pic_init();       // 初始化8259A
-    /* 加载idt */
+    idt_load();       // 加载idt
+    put_str("idt_init done\n");
+}
+
+/*把idt加载到当前处理器的IDTR，所有处理器共用一张idt，AP启动后也调用*/
+void idt_load(void)
+{
     uint64_t idt_operand = ((sizeof(idt) - 1) | ((uint64_t)(uint32_t)idt << 16));
     asm volatile("lidt %0" : : "m"(idt_operand));
-    put_str("idt_init done\n");
 }
 
 /* 在中断处理程序数组第vector_no个元素中注册安装中断处理程序function */
@@ -17,6 +17,7 @@ enum intr_status
 
 void register_handler(uint8_t vector_no, intr_handler function); // 在中断处理程序数组第vector_no个元素中注册安装中断处理程序function
 void idt_init(void);                                             // 完成有关中断的所有初始化工作
+void idt_load(void);                                             // 把idt加载到当前处理器
 
 enum intr_status intr_enable(void);                        // 打开中断
 enum intr_status intr_disable(void);                       // 关闭中断
@@ -6,6 +6,10 @@
 #include "../userprog/process.h"
 #include "../lib/user/syscall.h"
 #include "../userprog/syscall-init.h"
+#include "smp.h"
+#if BENCH
+#include "bench.h"
+#endif
 // 本章测试头文件
 #include "../fs/fs.h"
 
@@ -18,6 +22,10 @@ int main(void)
     init_all(); // 初始化所有模块
     printk("HongBai's OS kernel\n");
     intr_enable();
+    smp_init(); // 需要时钟中断来校准本地APIC定时器和等待AP，放在开中断之后
+#if BENCH
+    bench_run(); // make BENCH=1时运行启动测量
+#endif
     sys_open("/file1",O_CREAT);
     sys_open("/hongbai",O_CREAT);
     // process_execute(u_prog_a, "user_prog_a");
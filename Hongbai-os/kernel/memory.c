@@ -5,13 +5,55 @@
 #include "../lib/string.h"
 #include "../thread/thread.h"
 #include "../thread/sync.h"
+#include "../thread/spinlock.h"
 #include "global.h"
 #include "interrupt.h"
+#include "../userprog/process.h"
+#include "../lib/user/syscall.h"
+#include "swap.h"
+#include "smp.h"
+#if BENCH
+#include "bench.h"
+#endif
 
 #define PAGE_SIZE 4096 // 定义页面大小为4KB
-// 关于位图地址，安排在0xc009a000，我的整个系统支持4个4kb位图，共管理512MB的内存
-#define MEM_BITMAP_BASE 0xc009a000 // 内核内存池位图基地址
-#define K_HEAP_START 0xc0100000    // 内核堆起始地址
+// 内核低4MB用一个4MB大页线性映射，堆从下一个页目录项开始
+#define K_HEAP_START 0xc0400000    // 内核堆起始地址
+#define K_LINEAR_MAP_BASE 0xc0000000 // 物理0~4MB在内核中的线性映射起点
+#define KERNEL_PGDIR ((uint32_t *)(K_LINEAR_MAP_BASE + 0x100000)) // 内核页目录表，通过线性映射访问
+#define CR4_PSE (1 << 4) // cr4的PSE位，开启后页目录项可以直接映射4MB大页
+#define CR4_PGE (1 << 7) // cr4的PGE位，开启后带G位的页表项在切换cr3时保留在tlb中
+#define KERNEL_HEAP_PAGES ((0xffc00000 - K_HEAP_START) / PG_SIZE) // 内核堆最多的页数，最后4MB是页目录表自身
+#define PREZERO_TARGET 64 // 每个池最多预清零的页数
+#define TLB_FLUSH_THRESHOLD 32 // 一次解除映射超过这么多页就整体刷新tlb，而不是逐页invlpg
+#define BORROW_ORDER 6         // 池之间借页时一次至少借2^6=64页，避免频繁借还
+#define WMARK_DIV 32           // 池的低水位是初始页数的1/32
+#define PF_ERR_USER 4          // 页错误码的U/S位，置位表示错误发生在用户态
+
+// loader.S中，total_mem_bytes(0xb00)后面依次是6字节的gdt_ptr、244字节的ards_buf和2字节的ards_nr
+#define ARDS_BUF_ADDR 0xb0a // e820返回的ards数组
+#define ARDS_NR_ADDR 0xbfe  // ards的个数
+#define ARDS_MAX_NR 12      // ards_buf最多放得下12个ards
+#define ARDS_TYPE_USABLE 1  // 可以被操作系统使用的内存
+
+/*e820返回的地址范围描述符*/
+struct ards
+{
+    uint32_t base_low;
+    uint32_t base_high;
+    uint32_t length_low;
+    uint32_t length_high;
+    uint32_t type;
+};
+
+/*一段可用的物理内存[start, end)，页对齐*/
+struct mem_range
+{
+    uint32_t start;
+    uint32_t end;
+};
+static struct mem_range usable_ranges[ARDS_MAX_NR]; // 按起始地址排序的可用内存
+static uint32_t usable_cnt;                         // usable_ranges的个数
 
 #define PDE_INDEX(addr) ((addr & 0xffc00000) >> 22) // 获取页目录项索引
 #define PTE_INDEX(addr) ((addr & 0x003ff000) >> 12) // 获取页表项索引
@@ -19,24 +61,60 @@
 // 内存池结构体
 struct pool
 {
-    struct bitmap pool_bitmap; // 内存池位图
-    struct lock lock;          // 创建用户进程会用到，让用户进程申请内存的行为互斥
-    uint32_t phy_addr_start;   // 物理内存池起始地址
-    uint32_t pool_size;        // 内存池大小
+    struct lock lock;                           // 创建用户进程会用到，让用户进程申请内存的行为互斥
+    uint32_t phy_addr_start;                    // 物理内存池初始的起始地址，之后池之间借页不受这个范围限制
+    uint32_t pool_size;                         // 内存池大小
+    uint32_t idx_base;                          // frames[0]对应的物理地址，按4MB对齐，最高阶的块在物理上也按4MB对齐
+    uint32_t frame_cnt;                         // frames数组长度，两个池相同
+    struct frame *frames;                       // 页框描述符数组，两个池共用，下标是页相对idx_base的序号
+    struct list free_area[BUDDY_MAX_ORDER + 1]; // 伙伴系统各阶的空闲块链表
+    uint32_t free_pages;                        // 伙伴系统中的空闲页数，不含预清零链表上的页
+    uint32_t owned_pages;                       // 池拥有的页数，free_pages、zeroed_cnt加上已分配出去的
+    uint32_t max_pages;                         // owned_pages的上限，内核池受内核虚拟地址空间限制
+    uint32_t low_wmark;                         // 空闲页低于这个数时向另一个池借页
+    uint32_t borrowed_in;                       // 累计借入的页数
+    uint32_t lent_out;                          // 累计借出的页数
+    struct list zeroed_list;                    // idle线程预先清零的页，用frame.elem串起来，持有zeroed_lock访问
+    struct spinlock zeroed_lock;                // 保护zeroed_list和zeroed_cnt
+    uint32_t zeroed_cnt;                        // zeroed_list中的页数
 };
 struct pool kernel_pool, user_pool; // 内核内存池和用户内存池
 struct virtual_addr kernel_vaddr;   // 用来给内核分配虚拟地址
+static void page_fault_handler(uint8_t vec_nr); // 缺页处理函数，mem_init中注册
+static void *palloc_user(void);                 // 为用户页申请物理页，必要时换出冷页
+static void vaddr_remove(enum pool_flags pf, void *_vaddr, uint32_t pg_cnt); // 归还虚拟地址，malloc_page和ioremap失败回滚时用
+static void *prezero_window;                    // idle线程清零物理页时临时映射用的内核虚拟页
+static void *reclaim_window;                    // 换入换出时临时映射页表和物理页用的两个内核虚拟页
+static pid_t clock_pid;                         // 时钟算法的指针所在的进程
+static uint32_t clock_vaddr;                    // 时钟算法的指针在该进程中的虚拟地址
 
 // arena结构体
+// 用户进程的arena在用户空间，fork后会被子进程原样共享，
+// 所以arena里不能保存指向pcb(mem_block_desc)的指针，只记规格下标
 struct arena
 {
-    struct mem_block_desc *desc; // 此arena关联的mem_block_desc
+    uint32_t desc_idx; // 此arena的块规格在mem_block_desc数组中的下标
     // 如果large为true，cnt代表arena拥有的页数
-    // 否则代表空闲的mem_block数
+    // 否则代表空闲的mem_block数(包括还没切出来的)
     bool large;
     uint32_t cnt;
+    uint32_t carved;         // 已经切出来的块数，之后的块还没用过，按顺序往后切
+    struct list free_blocks; // 本arena中被释放回来的小块
+    struct arena *prev;      // 还有空闲块时挂在desc->partial_arenas上，以NULL结尾
+    struct arena *next;
 };
 struct mem_block_desc k_block_descs[DESC_CNT]; // 内核内存块描述符数组
+struct alloc_stats alloc_stats;                // 小块分配统计
+
+/*小对象kmem_cache的slab头，位于slab页的开头*/
+struct slab
+{
+    struct kmem_cache *cache;  // 所属的cache
+    uint32_t inuse;            // 已分配出去的对象数
+    struct list_elem slab_tag; // 挂在cache->slabs上
+};
+struct list kmem_caches;                // 所有kmem_cache组成的链表，只增不减
+static struct spinlock kmem_caches_lock; // 保护kmem_caches的追加
 
 /* 在pf表示的虚拟内存池中申请pg_cnt个虚拟页
  * 成功则返回虚拟页的起始地址，失败则返回NULL */
@@ -44,7 +122,6 @@ static void *vaddr_get(enum pool_flags pf, uint32_t pg_cnt)
 {
     int bit_idx_start = -1;   // 位图索引
     uint32_t vaddr_start = 0; // 虚拟地址
-    uint32_t cnt = 0;         // 计数器
     if (pf == PF_KERNEL)
     { // 内核内存池
         // 扫描位图，找到空余的pg_cnt个位，对应相等的页
@@ -54,29 +131,19 @@ static void *vaddr_get(enum pool_flags pf, uint32_t pg_cnt)
             return NULL;
         }
         // 找到后把位图中pg_cnt个位置设置为1，表示这些页已分配
-        while (cnt < pg_cnt)
-        {
-            bitmap_set(&kernel_vaddr.vaddr_bitmap, bit_idx_start + cnt, 1); // 设置位图
-            cnt++;
-        }
+        bitmap_set_range(&kernel_vaddr.vaddr_bitmap, bit_idx_start, pg_cnt);
         vaddr_start = kernel_vaddr.vaddr_start + bit_idx_start * PG_SIZE; // 计算虚拟地址
     }
     else
     { // 用户内存池
-        /*整体和内核内存池申请过程一致，进行扫描-设置-更新三个过程
+        /*用户空间在当前进程的vma树中找一段空隙预留
          *因为我们是通过线程建立用户进程，需要先获取目前线程状态*/
         struct task_struct *cur = running_thread();
-        bit_idx_start = bitmap_scan(&cur->userprog_vaddr.vaddr_bitmap, pg_cnt);
-        if (bit_idx_start == -1)
+        vaddr_start = vma_alloc(&cur->vmas, pg_cnt, VMA_READ | VMA_WRITE);
+        if (vaddr_start == 0)
         {
             return NULL;
         }
-        while (cnt < pg_cnt)
-        {
-            bitmap_set(&cur->userprog_vaddr.vaddr_bitmap, bit_idx_start + cnt, 1);
-            cnt++;
-        }
-        vaddr_start = cur->userprog_vaddr.vaddr_start + bit_idx_start * PG_SIZE;
         // 这是在用户内存，最大页起点就是分界线0xc0000000-一个页大小
         ASSERT((uint32_t)vaddr_start < (0xc0000000 - PG_SIZE));
     }
@@ -97,49 +164,319 @@ uint32_t *pde_ptr(uint32_t vaddr)
     return pde;                                                      // 返回页目录项地址
 }
 
+/* 伙伴系统：把m_pool中以第idx页起始、阶为order的块放回空闲链表
+ * 如果它的伙伴块也空闲且同阶，就合并成更高阶的块，直到不能合并为止 */
+static void buddy_free(struct pool *m_pool, uint32_t idx, uint8_t order)
+{
+    uint32_t pg_cnt = m_pool->frame_cnt;
+    ASSERT(!(m_pool->frames[idx].flags & FRAME_BUDDY));
+    m_pool->free_pages += 1 << order;
+    while (order < BUDDY_MAX_ORDER)
+    {
+        // 同阶的两个伙伴块，序号只在第order位上不同
+        uint32_t buddy_idx = idx ^ (1 << order);
+        if (buddy_idx + (1 << order) > pg_cnt)
+        { // 伙伴块超出了内存池
+            break;
+        }
+        struct frame *buddy = &m_pool->frames[buddy_idx];
+        if (!(buddy->flags & FRAME_BUDDY) || buddy->order != order || buddy->pool != m_pool)
+        { // 伙伴块不空闲，或者已经被拆开了，或者属于另一个池
+            break;
+        }
+        list_remove(&buddy->elem);
+        buddy->flags &= ~FRAME_BUDDY;
+        idx &= ~(1 << order); // 合并后的块从两者中较小的序号开始
+        order++;
+    }
+    struct frame *f = &m_pool->frames[idx];
+    f->flags |= FRAME_BUDDY;
+    f->order = order;
+    list_push(&m_pool->free_area[order], &f->elem);
+}
+
+/* 伙伴系统：在m_pool中申请一个阶为order的块，即2^order个连续的物理页
+ * 成功返回块首页在池内的序号，失败返回-1 */
+static int32_t buddy_alloc(struct pool *m_pool, uint8_t order)
+{
+    // 从order阶开始往上找第一个非空的空闲链表
+    uint8_t cur_order = order;
+    while (cur_order <= BUDDY_MAX_ORDER && list_empty(&m_pool->free_area[cur_order]))
+    {
+        cur_order++;
+    }
+    if (cur_order > BUDDY_MAX_ORDER)
+    {
+        return -1;
+    }
+    struct frame *f = elem2entry(struct frame, elem, list_pop(&m_pool->free_area[cur_order]));
+    f->flags &= ~FRAME_BUDDY;
+    uint32_t idx = f - m_pool->frames;
+    // 块比需要的大，就不断对半拆开，把后一半挂到低一阶的链表上
+    while (cur_order > order)
+    {
+        cur_order--;
+        struct frame *half = &m_pool->frames[idx + (1 << cur_order)];
+        half->flags |= FRAME_BUDDY;
+        half->order = cur_order;
+        list_push(&m_pool->free_area[cur_order], &half->elem);
+    }
+    m_pool->free_pages -= 1 << order;
+    return idx;
+}
+
+/* 把m_pool中从第idx页开始的cnt个页按尽量大的对齐块归还给伙伴系统 */
+static void buddy_free_range(struct pool *m_pool, uint32_t idx, uint32_t cnt)
+{
+    while (cnt > 0)
+    {
+        uint8_t order = 0;
+        // idx在order+1阶上对齐，并且剩余页数够一个order+1阶的块，才能升阶
+        while (order < BUDDY_MAX_ORDER && ((idx >> order) & 1) == 0 && (2u << order) <= cnt)
+        {
+            order++;
+        }
+        buddy_free(m_pool, idx, order);
+        idx += 1 << order;
+        cnt -= 1 << order;
+    }
+}
+
+/* 返回能容纳pg_cnt个页的最小阶 */
+static uint8_t pages_to_order(uint32_t pg_cnt)
+{
+    uint8_t order = 0;
+    while ((1u << order) < pg_cnt)
+    {
+        order++;
+    }
+    return order;
+}
+
+/* 池内可用的页数：伙伴系统的空闲页加上预清零链表上的页，水位检查都用它
+ * 预清零的页从伙伴系统取出后不再计入free_pages，但单页申请随时能用它们顶上 */
+static uint32_t pool_avail_pages(struct pool *m_pool)
+{
+    return m_pool->free_pages + m_pool->zeroed_cnt;
+}
+
+/* 从另一个池借一个至少order阶的空闲块给m_pool，借到返回true
+ * 调用者需持有m_pool的锁。出借池的锁只尝试获取：持有它的线程可能正在等m_pool的锁，阻塞等待会死锁
+ * 出借池借出后空闲页不能低于它的低水位，m_pool借入后不能超过它的上限 */
+static bool pool_borrow(struct pool *m_pool, uint8_t order)
+{
+    struct pool *donor = m_pool == &kernel_pool ? &user_pool : &kernel_pool;
+    uint8_t want = order < BORROW_ORDER ? BORROW_ORDER : order; // 一次多借一些
+    if (!lock_try_acquire(&donor->lock))
+    {
+        return false;
+    }
+    int32_t idx = -1;
+    while (idx == -1 && want >= order)
+    {
+        if (m_pool->owned_pages + (1u << want) <= m_pool->max_pages &&
+            pool_avail_pages(donor) >= (1u << want) + donor->low_wmark)
+        {
+            idx = buddy_alloc(donor, want);
+        }
+        if (idx == -1)
+        {
+            if (want == 0)
+            {
+                break;
+            }
+            want--;
+        }
+    }
+    if (idx != -1)
+    {
+        donor->owned_pages -= 1u << want;
+        donor->lent_out += 1u << want;
+    }
+    lock_release(&donor->lock);
+    if (idx == -1)
+    {
+        return false;
+    }
+    // 块已经从出借池的空闲链表上摘下来了，改掉归属后按m_pool的块释放
+    uint32_t i;
+    for (i = 0; i < (1u << want); i++)
+    {
+        m_pool->frames[idx + i].pool = m_pool;
+    }
+    m_pool->owned_pages += 1u << want;
+    m_pool->borrowed_in += 1u << want;
+    buddy_free(m_pool, idx, want);
+    return true;
+}
+
+/* 从m_pool的预清零链表取一个页，成功返回页物理地址，链表为空返回NULL
+ * 只持有zeroed_lock，不需要持有池的锁 */
+static void *zeroed_frame_get(struct pool *m_pool)
+{
+    enum intr_status old_status = spin_lock_irqsave(&m_pool->zeroed_lock);
+    if (list_empty(&m_pool->zeroed_list))
+    {
+        spin_unlock_irqrestore(&m_pool->zeroed_lock, old_status);
+        return NULL;
+    }
+    struct frame *f = elem2entry(struct frame, elem, list_pop(&m_pool->zeroed_list));
+    m_pool->zeroed_cnt--;
+    spin_unlock_irqrestore(&m_pool->zeroed_lock, old_status);
+    f->flags &= ~FRAME_ZEROED;
+    f->ref_cnt = 1;
+    return (void *)frame_to_phys(f);
+}
+
+/* 在m_pool中申请pg_cnt个物理上连续的页，成功返回起始物理地址，失败返回NULL
+ * 伙伴系统只能按2的幂分配，多出来的尾部页会立即归还 */
+static void *palloc_pages(struct pool *m_pool, uint32_t pg_cnt)
+{
+    uint8_t order = pages_to_order(pg_cnt);
+    if (order > BUDDY_MAX_ORDER)
+    {
+        return NULL;
+    }
+    int32_t idx = buddy_alloc(m_pool, order);
+    if (idx == -1 && pool_borrow(m_pool, order))
+    { // 本池没有足够大的块，从另一个池借到后再试
+        idx = buddy_alloc(m_pool, order);
+    }
+    if (idx == -1)
+    { // 伙伴系统空了，单页申请还可以用预清零的页顶上
+        return pg_cnt == 1 ? zeroed_frame_get(m_pool) : NULL;
+    }
+    buddy_free_range(m_pool, idx + pg_cnt, (1 << order) - pg_cnt);
+    uint32_t i;
+    for (i = 0; i < pg_cnt; i++)
+    {
+        m_pool->frames[idx + i].ref_cnt = 1;
+    }
+    return (void *)(m_pool->idx_base + idx * PG_SIZE);
+}
+
 /* 在m_pool 指向的物理内存池中申请一个物理页，成功返回页物理地址，失败返回NULL */
 static void *palloc(struct pool *m_pool)
 {
-    /* 扫描或设置位图要保证原子操作 */
-    int bit_idx = bitmap_scan(&m_pool->pool_bitmap, 1); // 扫描位图
-    if (bit_idx == -1)
-    { // 没有找到合适的地址
-        return NULL;
+    int32_t idx = buddy_alloc(m_pool, 0);
+    if (idx == -1 && pool_borrow(m_pool, 0))
+    { // 本池没有空闲页了，从另一个池借到后再试
+        idx = buddy_alloc(m_pool, 0);
+    }
+    if (idx == -1)
+    { // 伙伴系统没有空闲页了，再看预清零链表
+        return zeroed_frame_get(m_pool);
     }
-    bitmap_set(&m_pool->pool_bitmap, bit_idx, 1);                         // 设置位图
-    uint32_t page_phyaddr = m_pool->phy_addr_start + bit_idx * PG_SIZE; // 计算物理地址
-    return (void *)page_phyaddr;                                          // 返回物理地址
+    m_pool->frames[idx].ref_cnt = 1;
+    uint32_t page_phyaddr = m_pool->idx_base + idx * PG_SIZE; // 计算物理地址
+    return (void *)page_phyaddr;                                      // 返回物理地址
 }
 
-/* 页表中添加虚拟地址_vaddr与物理地址_page_phyaddr的映射 */
-static void page_table_add(void *_vaddr, void *_page_phyaddr)
+#if BENCH
+/*测量内核池单页palloc/pfree的总周期数，每批申请batch页再全部释放，一共iters页
+ *palloc是静态函数，bench.c通过这里调用*/
+uint64_t mem_bench_palloc(uint32_t iters, uint32_t batch)
+{
+    uint32_t phy[64];
+    ASSERT(batch <= 64);
+    lock_acquire(&kernel_pool.lock);
+    uint64_t start = rdtsc();
+    uint32_t round, i;
+    for (round = 0; round < iters / batch; round++)
+    {
+        for (i = 0; i < batch; i++)
+        {
+            phy[i] = (uint32_t)palloc(&kernel_pool);
+            ASSERT(phy[i] != 0);
+        }
+        for (i = 0; i < batch; i++)
+        {
+            pfree(phy[i]);
+        }
+    }
+    uint64_t cycles = rdtsc() - start;
+    lock_release(&kernel_pool.lock);
+    return cycles;
+}
+
+/*释放bench.c用get_kernel_pages(1)申请的cnt个页，mfree_page需要持有池的锁*/
+void mem_bench_free_pages(void **pages, uint32_t cnt)
+{
+    uint32_t i;
+    lock_acquire(&kernel_pool.lock);
+    for (i = 0; i < cnt; i++)
+    {
+        mfree_page(PF_KERNEL, pages[i], 1);
+    }
+    lock_release(&kernel_pool.lock);
+}
+#endif
+
+/* 把从_vaddr开始的pg_cnt个虚拟页映射到从_page_phyaddr开始的连续物理页
+ * 每个4MB区间只检查一次页目录项，之后连续填写页表项
+ * 原来不存在的页表项不会被tlb缓存，所以不需要刷新tlb
+ * 没有物理页做页表时撤销本次填写的页表项并返回false，物理页由调用者处理
+ * 分配页表时获取kernel_pool的锁，持有user_pool锁的调用者按先用户后内核的顺序加锁 */
+bool map_range(void *_vaddr, void *_page_phyaddr, uint32_t pg_cnt)
 {
     uint32_t vaddr = (uint32_t)_vaddr;               // 虚拟地址
     uint32_t page_phyaddr = (uint32_t)_page_phyaddr; // 物理地址
-    uint32_t *pde = pde_ptr(vaddr);                  // 获取页目录项指针
-    uint32_t *pte = pte_ptr(vaddr);                  // 获取页表项指针
-
-    if (*pde & 0x00000001)
-    { // 页目录项存在
-        ASSERT(!(*pte & 0x00000001));
-        if (!(*pte & 0x00000001))
-        {                                                     // 页表项不存在
-            *pte = page_phyaddr | PG_US_U | PG_RW_W | PG_P_1; // 设置页表项
+    // 内核空间在所有进程中的映射都一样，标成全局页，切换进程时不用刷掉
+    uint32_t attr = PG_US_U | PG_RW_W | PG_P_1 | (vaddr >= K_LINEAR_MAP_BASE ? PG_G_1 : 0);
+    while (pg_cnt > 0)
+    {
+        uint32_t *pde = pde_ptr(vaddr); // 获取页目录项指针
+        uint32_t *pte = pte_ptr(vaddr); // 获取页表项指针
+        uint32_t span = 1024 - PTE_INDEX(vaddr); // 这个页目录项还能覆盖的页数
+        if (span > pg_cnt)
+        {
+            span = pg_cnt;
         }
-        else
-        { // 页表项存在
-            PANIC("page_table_add: pte repeat");
-            *pte = page_phyaddr | PG_US_U | PG_RW_W | PG_P_1; // 设置页表项
+        if (!(*pde & PG_P_1))
+        {                                                             // 页目录项不存在
+            lock_acquire(&kernel_pool.lock);                          // 页表总从内核池分配，映射用户页时也要拿内核池的锁
+            uint32_t pde_phyaddr = (uint32_t)palloc(&kernel_pool);    // 分配一个物理页作为页表
+            lock_release(&kernel_pool.lock);
+            if (pde_phyaddr == 0)
+            {
+                uint32_t done = (vaddr - (uint32_t)_vaddr) / PG_SIZE;
+                uint32_t i;
+                for (i = 0; i < done; i++)
+                {
+                    *pte_ptr((uint32_t)_vaddr + i * PG_SIZE) = 0;
+                }
+                tlb_flush_local((uint32_t)_vaddr, done);
+                return false;
+            }
+            *pde = pde_phyaddr | PG_US_U | PG_RW_W | PG_P_1;          // 设置页目录项
+            memset((void *)((uint32_t)pte & 0xfffff000), 0, PG_SIZE); // 清空页表
+        }
+        ASSERT(!(*pde & PG_PS_1));
+        uint32_t i;
+        for (i = 0; i < span; i++)
+        {
+            if (pte[i] & PG_P_1)
+            {
+                PANIC("map_range: pte repeat");
+            }
+            pte[i] = page_phyaddr | attr; // 设置页表项
+            page_phyaddr += PG_SIZE;
         }
+        vaddr += span * PG_SIZE;
+        pg_cnt -= span;
     }
-    else
-    {                                                               // 页目录项不存在
-        uint32_t pde_phyaddr = (uint32_t)palloc(&kernel_pool);      // 分配一个物理页作为页表
-        *pde = pde_phyaddr | PG_US_U | PG_RW_W | PG_P_1;            // 设置页目录项
-        memset((void *)((uint32_t)pte & 0xfffff000), 0, PG_SIZE); // 清空页表
-        ASSERT(!(*pte & 0x00000001));
-        *pte = page_phyaddr | PG_US_U | PG_RW_W | PG_P_1; // 设置页表项
+    return true;
+}
+
+/*页表中添加虚拟地址_vaddr与物理地址_page_phyaddr的映射
+ *临时窗口页会被不同的处理器轮流映射，别的处理器映射着它时本处理器可能预取过那时的页表项，所以本地刷新一次*/
+static void page_table_add(void *_vaddr, void *_page_phyaddr)
+{
+    if (!map_range(_vaddr, _page_phyaddr, 1))
+    {
+        PANIC("page_table_add: no page for page table");
     }
+    asm volatile("invlpg (%0)" : : "r"(_vaddr) : "memory");
 }
 
 /* 分配pg_cnt个页空间，成功则返回起始虚拟地址，失败时返回NULL */
@@ -153,18 +490,64 @@ void *malloc_page(enum pool_flags pf, uint32_t pg_cnt)
     { // 没有找到合适的地址
         return NULL;
     }
+    // 用户内存只预留虚拟地址，物理页等第一次访问时由page_fault_handler分配
+    if (pf == PF_USER)
+    {
+        return vaddr_start;
+    }
     uint32_t vaddr = (uint32_t)vaddr_start;                             // 虚拟地址起始位置
-    uint32_t cnt = pg_cnt;                                              // 计数器
+    uint32_t cnt = pg_cnt;                                              // 剩余待分配的页数
     struct pool *mem_pool = pf & PF_KERNEL ? &kernel_pool : &user_pool; // 选择内存池
-    while (cnt-- > 0)                                                   // cnt-- 后是否 > 0
-    {                                                                   // 分配物理页
-        void *page_phyaddr = palloc(mem_pool);                          // 分配物理页
+    uint32_t run = cnt > (1u << BUDDY_MAX_ORDER) ? (1u << BUDDY_MAX_ORDER) : cnt;
+    bool reclaimed = false; // 是否已经尝试过回收kmem_cache
+    while (cnt > 0)
+    {
+        if (run > cnt)
+        {
+            run = cnt;
+        }
+        // 优先一次申请run个物理连续的页，碎片化导致失败时再减半重试
+        void *page_phyaddr = palloc_pages(mem_pool, run);
         if (page_phyaddr == NULL)
-        { // 失败时要将曾经已申请的虚拟地址和物理页全部回滚，在将来完成内存回收时再补充
+        {
+            if (run > 1)
+            {
+                run /= 2;
+                continue;
+            }
+            // 内核内存不足时，先让各个对象缓存交出空闲的slab再试一次
+            if (pf == PF_KERNEL && !reclaimed)
+            {
+                reclaimed = true;
+                if (kmem_reclaim() > 0)
+                {
+                    continue;
+                }
+            }
+            // 失败时把已经映射的物理页和预留的虚拟地址全部回滚
+            if (cnt < pg_cnt)
+            {
+                unmap_range(vaddr_start, pg_cnt - cnt);
+            }
+            vaddr_remove(pf, vaddr_start, pg_cnt);
+            return NULL;
+        }
+        if (!map_range((void *)vaddr, page_phyaddr, run)) // 一次映射整段物理连续的页
+        { // 没有物理页做页表了，这一段的物理页直接还回去，之前的段照常回滚
+            uint32_t i;
+            for (i = 0; i < run; i++)
+            {
+                pfree((uint32_t)page_phyaddr + i * PG_SIZE);
+            }
+            if (cnt < pg_cnt)
+            {
+                unmap_range(vaddr_start, pg_cnt - cnt);
+            }
+            vaddr_remove(pf, vaddr_start, pg_cnt);
             return NULL;
         }
-        page_table_add((void *)vaddr, page_phyaddr); // 添加映射关系
-        vaddr += PG_SIZE;                          // 移动到下一个页
+        vaddr += run * PG_SIZE;
+        cnt -= run;
     }
     return vaddr_start; // 返回虚拟地址
 }
@@ -172,7 +555,29 @@ void *malloc_page(enum pool_flags pf, uint32_t pg_cnt)
 /* 从内核物理内存池中申请pg_cnt页内存，成功则返回其虚拟地址，失败则返回NULL */
 void *get_kernel_pages(uint32_t pg_cnt)
 {
+    lock_acquire(&kernel_pool.lock); // 内核虚拟地址位图和伙伴系统都由它保护
+    if (pg_cnt == 1)
+    { // 单页优先用idle线程预先清零的页，省掉memset
+        void *page_phyaddr = zeroed_frame_get(&kernel_pool);
+        if (page_phyaddr != NULL)
+        {
+            void *page_vaddr = vaddr_get(PF_KERNEL, 1);
+            if (page_vaddr == NULL)
+            {
+                pfree((uint32_t)page_phyaddr);
+            }
+            else
+            {
+                page_table_add(page_vaddr, page_phyaddr);
+                atomic_inc(&alloc_stats.zero_hits);
+            }
+            lock_release(&kernel_pool.lock);
+            return page_vaddr;
+        }
+        atomic_inc(&alloc_stats.zero_misses);
+    }
     void *vaddr = malloc_page(PF_KERNEL, pg_cnt); // 申请内存
+    lock_release(&kernel_pool.lock);
     if (vaddr != NULL)                            // 申请成功
     {
         memset(vaddr, 0, pg_cnt * PG_SIZE); // 把这部分内存上的内容清理干净，准备让申请的东西使用
@@ -181,14 +586,11 @@ void *get_kernel_pages(uint32_t pg_cnt)
 }
 
 /* 从用户内存池申请pg_cnt页内存 */
+/* 缺页时分配的物理页都已清零，这里不需要再memset */
 void *get_user_page(uint32_t pg_cnt)
 {
     lock_acquire(&user_pool.lock); // 保证互斥
     void *vaddr = malloc_page(PF_USER, pg_cnt);
-    if (vaddr != NULL)
-    {
-        memset(vaddr, 0, pg_cnt * PG_SIZE);
-    }
     lock_release(&user_pool.lock);
     return vaddr;
 }
@@ -204,9 +606,9 @@ void *get_a_page(enum pool_flags pf, uint32_t vaddr)
     int32_t bit_idx = -1;
     if (cur->pgdir != NULL && pf == PF_USER)
     {
-        bit_idx = (vaddr - cur->userprog_vaddr.vaddr_start) / PG_SIZE;
-        ASSERT(bit_idx > 0);
-        bitmap_set(&cur->userprog_vaddr.vaddr_bitmap, bit_idx, 1);
+        ASSERT(vaddr >= USER_VADDR_START);
+        // 已经预留过的地址插入会失败，不影响后面的映射
+        vma_insert(&cur->vmas, vaddr, vaddr + PG_SIZE, VMA_READ | VMA_WRITE);
     }
     else if (cur->pgdir == NULL && pf == PF_KERNEL)
     {
@@ -219,9 +621,10 @@ void *get_a_page(enum pool_flags pf, uint32_t vaddr)
         PANIC("get_a_page:not allow kernel alloc userspace or user alloc kernelspace by get_a_page");
     }
 
-    void *page_phyaddr = palloc(mem_pool);
+    void *page_phyaddr = pf == PF_USER ? palloc_user() : palloc(mem_pool);
     if (page_phyaddr == NULL)
     {
+        lock_release(&mem_pool->lock);
         return NULL;
     }
     page_table_add((void *)vaddr, page_phyaddr);
@@ -232,46 +635,272 @@ void *get_a_page(enum pool_flags pf, uint32_t vaddr)
 /*得到虚拟地址映射到的物理地址*/
 uint32_t addr_v2p(uint32_t vaddr)
 {
+    uint32_t pde = *pde_ptr(vaddr);
+    if (pde & PG_PS_1)
+    { // 4MB大页没有页表，物理地址直接由页目录项给出
+        return (pde & 0xffc00000) + (vaddr & 0x003fffff);
+    }
     uint32_t *pte = pte_ptr(vaddr);
 
     return ((*pte & 0xfffff000) + (vaddr & 0x00000fff));
 }
 
-/* 初始化内存池 */
+/* 初始化m_pool的伙伴系统，池内所有页都作为空闲块挂入free_area
+ * frames是两个池共用的页框描述符数组，已经全部标为保留，池范围内的页框都归m_pool所有 */
+static void buddy_init(struct pool *m_pool, struct frame *frames, uint32_t frame_cnt)
+{
+    uint32_t pool_end = m_pool->phy_addr_start + m_pool->pool_size;
+    uint32_t range_idx, idx;
+    uint8_t order;
+    m_pool->frames = frames;
+    m_pool->frame_cnt = frame_cnt;
+    m_pool->free_pages = 0;
+    m_pool->borrowed_in = 0;
+    m_pool->lent_out = 0;
+    list_init(&m_pool->zeroed_list);
+    spin_init(&m_pool->zeroed_lock);
+    m_pool->zeroed_cnt = 0;
+    for (idx = (m_pool->phy_addr_start - m_pool->idx_base) / PG_SIZE; idx < (pool_end - m_pool->idx_base) / PG_SIZE; idx++)
+    {
+        frames[idx].pool = m_pool;
+    }
+    for (order = 0; order <= BUDDY_MAX_ORDER; order++)
+    {
+        list_init(&m_pool->free_area[order]);
+    }
+    // 只有e820报告可用的页进入伙伴系统，池内的空洞保持保留状态，永远不会被分配或合并
+    for (range_idx = 0; range_idx < usable_cnt; range_idx++)
+    {
+        uint32_t start = usable_ranges[range_idx].start;
+        uint32_t end = usable_ranges[range_idx].end;
+        start = start > m_pool->phy_addr_start ? start : m_pool->phy_addr_start;
+        end = end < pool_end ? end : pool_end;
+        if (start < end)
+        {
+            for (idx = (start - m_pool->idx_base) / PG_SIZE; idx < (end - m_pool->idx_base) / PG_SIZE; idx++)
+            {
+                frames[idx].flags &= ~FRAME_RESERVED;
+            }
+            buddy_free_range(m_pool, (start - m_pool->idx_base) / PG_SIZE, (end - start) / PG_SIZE);
+        }
+    }
+    m_pool->owned_pages = m_pool->free_pages;
+    m_pool->low_wmark = m_pool->owned_pages / WMARK_DIV;
+}
+
+/* 把[start, end)中low_limit以上的页对齐部分按起始地址插入usable_ranges */
+static void mem_range_add(uint32_t start, uint32_t end, uint32_t low_limit)
+{
+    if (start < low_limit)
+    {
+        start = low_limit;
+    }
+    start = (start + PG_SIZE - 1) & 0xfffff000;
+    end &= 0xfffff000;
+    if (start >= end || usable_cnt == ARDS_MAX_NR)
+    {
+        return;
+    }
+    uint32_t idx = usable_cnt++;
+    while (idx > 0 && usable_ranges[idx - 1].start > start)
+    {
+        usable_ranges[idx] = usable_ranges[idx - 1];
+        idx--;
+    }
+    usable_ranges[idx].start = start;
+    usable_ranges[idx].end = end;
+}
+
+/* 读取loader保存的e820内存布局，记录low_limit以上的可用内存
+ * 只处理4GB以下的部分；e820失败时loader只记录了总量all_mem，这时把它当作一整段 */
+static void e820_collect(uint32_t all_mem, uint32_t low_limit)
+{
+    uint16_t ards_nr = *(uint16_t *)ARDS_NR_ADDR;
+    struct ards *ards = (struct ards *)ARDS_BUF_ADDR;
+    uint32_t ards_idx;
+    usable_cnt = 0;
+    if (ards_nr == 0)
+    {
+        mem_range_add(0, all_mem, low_limit);
+        return;
+    }
+    if (ards_nr > ARDS_MAX_NR)
+    {
+        ards_nr = ARDS_MAX_NR;
+    }
+    for (ards_idx = 0; ards_idx < ards_nr; ards_idx++)
+    {
+        if (ards[ards_idx].type != ARDS_TYPE_USABLE || ards[ards_idx].base_high != 0)
+        {
+            continue;
+        }
+        uint32_t base = ards[ards_idx].base_low;
+        uint32_t end = 0xfffff000; // 跨过4GB的部分截掉
+        if (ards[ards_idx].length_high == 0 && ards[ards_idx].length_low <= 0xfffff000 - base)
+        {
+            end = base + ards[ards_idx].length_low;
+        }
+        mem_range_add(base, end, low_limit);
+    }
+}
+
+/* 从start开始数过pg_cnt个可用页后的地址 */
+static uint32_t usable_addr_after(uint32_t start, uint32_t pg_cnt)
+{
+    uint32_t range_idx;
+    for (range_idx = 0; range_idx < usable_cnt; range_idx++)
+    {
+        uint32_t r_start = usable_ranges[range_idx].start;
+        uint32_t r_end = usable_ranges[range_idx].end;
+        if (r_end <= start)
+        {
+            continue;
+        }
+        if (r_start < start)
+        {
+            r_start = start;
+        }
+        if ((r_end - r_start) / PG_SIZE >= pg_cnt)
+        {
+            return r_start + pg_cnt * PG_SIZE;
+        }
+        pg_cnt -= (r_end - r_start) / PG_SIZE;
+    }
+    return usable_ranges[usable_cnt - 1].end;
+}
+
+#ifndef NDEBUG
+/* 启动时对伙伴系统做一次自检：拆分、对齐、合并后空闲页数应恢复原值 */
+static void buddy_self_test(struct pool *m_pool)
+{
+    uint32_t free_before = m_pool->free_pages;
+    int32_t single = buddy_alloc(m_pool, 0);
+    int32_t block = buddy_alloc(m_pool, 3);
+    ASSERT(single != -1 && block != -1);
+    ASSERT((block & 0x7) == 0); // 3阶块必须按8页对齐
+    ASSERT(m_pool->free_pages == free_before - 1 - 8);
+    buddy_free(m_pool, block, 3);
+    buddy_free(m_pool, single, 0);
+    ASSERT(m_pool->free_pages == free_before);
+
+    // 连续分配的尾部会被归还，释放后也要完整合并回去
+    void *run = palloc_pages(m_pool, 5);
+    ASSERT(run != NULL && m_pool->free_pages == free_before - 5);
+    buddy_free_range(m_pool, ((uint32_t)run - m_pool->idx_base) / PG_SIZE, 5);
+    ASSERT(m_pool->free_pages == free_before);
+}
+#endif
+
+/* 开启PSE，把内核的0xc0000000~0xc0400000换成一个4MB大页，线性映射物理0~4MB
+ * loader用4KB页只映射了低1MB，现在内核映像、页目录表和页表都落在一个tlb项里 */
+static void linear_map_init(void)
+{
+    uint32_t cr4;
+    asm volatile("movl %%cr4, %0" : "=r"(cr4));
+    cr4 |= CR4_PSE | CR4_PGE;
+    asm volatile("movl %0, %%cr4" : : "r"(cr4) : "memory");
+    // 用户进程直接运行内核映像里的函数，所以保留用户可访问
+    *pde_ptr(K_LINEAR_MAP_BASE) = 0 | PG_PS_1 | PG_G_1 | PG_US_U | PG_RW_W | PG_P_1;
+    asm volatile("movl %%cr3, %%eax; movl %%eax, %%cr3" : : : "eax", "memory");
+}
+
+/* 初始化内存池
+ * 按e820的可用内存建池，两个池各是一段连续的物理地址范围，中间的空洞作为保留页框 */
 void mem_pool_init(uint32_t all_mem)
 {
     put_str("  mem_pool_init start\n");
 
     uint32_t page_table_size = 256 * PG_SIZE;     // 计算页表使用的内存的大小
     uint32_t used_mem = page_table_size + 0x100000; // 计算已用内存
-    uint32_t free_mem = all_mem - used_mem;         // 计算总可用内存
+    e820_collect(all_mem, used_mem);
+    // 元数据要紧跟在used_mem之后，这里必须是可用内存
+    ASSERT(usable_cnt > 0 && usable_ranges[0].start == used_mem);
+    uint32_t max_end = usable_ranges[usable_cnt - 1].end;
+    uint32_t all_free_pages = 0; // 计算总可用页数
+    uint32_t range_idx;
+    for (range_idx = 0; range_idx < usable_cnt; range_idx++)
+    {
+        all_free_pages += (usable_ranges[range_idx].end - usable_ranges[range_idx].start) / PG_SIZE;
+    }
+
+    // 内核虚拟地址位图和页框描述符数组依次放在已用内存之后，大小都随内存量变化
+    // 描述符数组覆盖两个池的整个跨度(包括空洞)，再加上4MB对齐的保留页
+    uint32_t frames_pg_cnt = DIV_ROUND_UP(((max_end - used_mem) / PG_SIZE + LARGE_PG_PAGES) * sizeof(struct frame), PG_SIZE);
+    uint32_t kernel_vpages = all_free_pages + frames_pg_cnt; // 内核虚拟页数的上限，内核池可能借到几乎全部内存
+    if (kernel_vpages > KERNEL_HEAP_PAGES)
+    {
+        kernel_vpages = KERNEL_HEAP_PAGES;
+    }
+    uint32_t kbm_pg_cnt = DIV_ROUND_UP(kernel_vpages / 8, PG_SIZE);
+    uint32_t kbm_phy_start = used_mem;                                   // 位图在4MB线性映射内，可以直接访问
+    uint32_t frames_phy_start = kbm_phy_start + kbm_pg_cnt * PG_SIZE;
+    uint32_t meta_end = frames_phy_start + frames_pg_cnt * PG_SIZE;
+    ASSERT(meta_end <= usable_ranges[0].end);
+    usable_ranges[0].start = meta_end;
+    all_free_pages -= kbm_pg_cnt + frames_pg_cnt;
 
-    uint16_t all_free_pages = free_mem / PG_SIZE;                // 计算总可用页数
-    uint16_t kernel_free_pages = all_free_pages / 2;               // 内核可用页数
-    uint16_t user_free_pages = all_free_pages - kernel_free_pages; // 用户可用页数
+    // 内核池最多拥有的页数受内核虚拟地址空间限制，用户池没有限制
+    uint32_t kernel_max_pages = all_free_pages;
+    if (kernel_max_pages > KERNEL_HEAP_PAGES - frames_pg_cnt)
+    {
+        kernel_max_pages = KERNEL_HEAP_PAGES - frames_pg_cnt;
+    }
+    // 可用页先对半分，之后哪个池不够用了再从另一个池借
+    uint32_t kernel_free_pages = all_free_pages / 2;               // 内核可用页数
+    if (kernel_free_pages > kernel_max_pages)
+    {
+        kernel_free_pages = kernel_max_pages;
+    }
+    uint32_t user_free_pages = all_free_pages - kernel_free_pages; // 用户可用页数
 
-    uint32_t kbm_len = kernel_free_pages / 8; // 内核位图长度
-    uint32_t ubm_len = user_free_pages / 8;   // 用户位图长度
+    // 内核虚拟地址还要容纳页框描述符数组
+    uint32_t kbm_len = (kernel_max_pages + frames_pg_cnt) / 8; // 内核虚拟地址位图长度
 
-    uint32_t kp_start = used_mem;                                 // 内核内存池起始地址
-    uint32_t up_start = kp_start + kernel_free_pages * PG_SIZE; // 用户内存池起始地址
+    uint32_t kp_start = meta_end;                                       // 内核内存池起始地址
+    uint32_t up_start = usable_addr_after(kp_start, kernel_free_pages); // 用户内存池起始地址
 
     kernel_pool.phy_addr_start = kp_start; // 设置内核内存池起始地址
     user_pool.phy_addr_start = up_start;   // 设置用户内存池起始地址
 
-    kernel_pool.pool_size = kernel_free_pages * PG_SIZE; // 设置内核内存池大小
-    user_pool.pool_size = user_free_pages * PG_SIZE;     // 设置用户内存池大小
+    kernel_pool.pool_size = up_start - kp_start; // 设置内核内存池跨度，包括空洞
+    user_pool.pool_size = max_end - up_start;    // 设置用户内存池跨度，包括空洞
+
+    // 两个池共用一个页框描述符数组，页在池之间移动时描述符不用搬家
+    kernel_pool.idx_base = kp_start & ~(LARGE_PG_SIZE - 1);
+    user_pool.idx_base = kernel_pool.idx_base;
+    uint32_t frame_cnt = (max_end - kernel_pool.idx_base) / PG_SIZE;
+    kernel_pool.max_pages = kernel_max_pages;
+    user_pool.max_pages = all_free_pages;
 
-    kernel_pool.pool_bitmap.btmp_bytes_len = kbm_len; // 设置内核位图长度
-    user_pool.pool_bitmap.btmp_bytes_len = ubm_len;   // 设置用户位图长度
+    /* 初始化内核虚拟地址的位图 */
+    kernel_vaddr.vaddr_bitmap.btmp_bytes_len = kbm_len;                                // 设置内核虚拟地址位图长度
+    kernel_vaddr.vaddr_bitmap.btmp_bits = (void *)(K_LINEAR_MAP_BASE + kbm_phy_start); // 设置内核虚拟地址位图地址
+    kernel_vaddr.vaddr_start = K_HEAP_START;                                           // 设置内核虚拟地址起始位置
+    bitmap_init(&kernel_vaddr.vaddr_bitmap);                                           // 初始化内核虚拟地址位图
 
-    kernel_pool.pool_bitmap.btmp_bits = (void *)MEM_BITMAP_BASE;           // 设置内核位图地址
-    user_pool.pool_bitmap.btmp_bits = (void *)(MEM_BITMAP_BASE + kbm_len); // 设置用户位图地址
+    /* 把页框描述符数组映射到内核虚拟地址，此时内核的页目录项都已存在，page_table_add不会再申请页表 */
+    struct frame *frames = vaddr_get(PF_KERNEL, frames_pg_cnt);
+    uint32_t pg_idx;
+    for (pg_idx = 0; pg_idx < frames_pg_cnt; pg_idx++)
+    {
+        page_table_add((void *)((uint32_t)frames + pg_idx * PG_SIZE),
+                       (void *)(frames_phy_start + pg_idx * PG_SIZE));
+    }
+    memset(frames, 0, frame_cnt * sizeof(struct frame));
+    for (pg_idx = 0; pg_idx < frame_cnt; pg_idx++)
+    { // 先全部标为保留，buddy_init只放开e820报告可用的页
+        frames[pg_idx].flags = FRAME_RESERVED;
+    }
+    buddy_init(&kernel_pool, frames, frame_cnt); // 初始化内核伙伴系统
+    buddy_init(&user_pool, frames, frame_cnt);   // 初始化用户伙伴系统
 
     /* 输出内存池信息 */
+    put_str("    usable_ranges: ");
+    put_int(usable_cnt);
+    put_char('\n');
     put_str("    all_free_pages: ");
     put_int(all_free_pages);
-    put_char('\n'); // 总内存512mb，使用了2mb，可用页 510mb/4kb=127000
+    put_char('\n');
     put_str("    kernel_free_pages: ");
     put_int(kernel_free_pages);
     put_char('\n');
@@ -279,32 +908,22 @@ void mem_pool_init(uint32_t all_mem)
     put_int(user_free_pages);
     put_char('\n');
 
-    put_str("    kernel_pool_bitmap_start: ");
-    put_int((int)kernel_pool.pool_bitmap.btmp_bits);
+    put_str("    frames_start: ");
+    put_int((int)frames);
     put_char('\n');
     put_str("    kernel_pool_phy_addr_start: ");
     put_int(kernel_pool.phy_addr_start);
     put_char('\n');
-
-    put_str("    user_pool_bitmap_start: ");
-    put_int((int)user_pool.pool_bitmap.btmp_bits);
-    put_char('\n');
     put_str("    user_pool_phy_addr_start: ");
     put_int(user_pool.phy_addr_start);
     put_char('\n');
 
-    /* 将池内位图置0 */
-    bitmap_init(&kernel_pool.pool_bitmap); // 初始化内核位图
-    bitmap_init(&user_pool.pool_bitmap);   // 初始化用户位图
-
-    /* 初始化内核虚拟地址的位图 */
-    kernel_vaddr.vaddr_bitmap.btmp_bytes_len = kbm_len; // 设置内核虚拟地址位图长度
-    kernel_vaddr.vaddr_bitmap.btmp_bits =
-        (void *)(MEM_BITMAP_BASE + kbm_len + ubm_len); // 设置内核虚拟地址位图地址
-    kernel_vaddr.vaddr_start = K_HEAP_START;           // 设置内核虚拟地址起始位置
-    bitmap_init(&kernel_vaddr.vaddr_bitmap);           // 初始化内核虚拟地址位图
     lock_init(&kernel_pool.lock);
     lock_init(&user_pool.lock);
+#ifndef NDEBUG
+    buddy_self_test(&kernel_pool);
+    buddy_self_test(&user_pool);
+#endif
     put_str("  mem_pool_init done\n");
 }
 
@@ -317,7 +936,7 @@ void block_init(struct mem_block_desc *desc_array)
     {
         desc_array[desc_index].block_size = block_size;
         desc_array[desc_index].block_per_arena = (PG_SIZE - sizeof(struct arena)) / block_size;
-        list_init(&desc_array[desc_index].free_list);
+        desc_array[desc_index].partial_arenas = NULL;
         block_size *= 2;
     }
 }
@@ -328,16 +947,27 @@ void mem_init(void)
     put_str("mem_init start\n");
     // 之前loader在开启分页时就获取了全部内存的大小，放到了0xb00中
     uint32_t mem_bytes_total = (*(uint32_t *)(0xb00));
+    linear_map_init();              // 用4MB大页映射内核低端
     mem_pool_init(mem_bytes_total); // 初始化内存池
     block_init(k_block_descs);      // 初始化mem_block_desc数组
+    list_init(&kmem_caches);        // 初始化kmem_cache链表
+    spin_init(&kmem_caches_lock);
+    vma_init();                     // 初始化vma对象缓存
+    register_handler(0x0e, page_fault_handler); // 注册缺页处理函数
+    prezero_window = vaddr_get(PF_KERNEL, 1);   // 预留预清零用的映射窗口
+    reclaim_window = vaddr_get(PF_KERNEL, 2);   // 预留换入换出用的映射窗口
+    clock_pid = 0;
+    clock_vaddr = USER_VADDR_START;
+    // 打开cr0的WP位，内核写用户只读页时也触发缺页，写时复制才能覆盖内核代替用户写入的情况
+    asm volatile("movl %%cr0, %%eax; orl $0x10000, %%eax; movl %%eax, %%cr0" : : : "eax", "memory");
     put_str("mem_init done\n");
 }
 
 /*返回arena中第idx内存块的地址*/
 /*参考arena示意图，还是很好理解的，某块地址=起始地址+元数据+若干个块*/
-static struct mem_block *arena2block(struct arena *ar, uint32_t idx)
+static struct mem_block *arena2block(struct arena *ar, uint32_t block_size, uint32_t idx)
 {
-    return (struct mem_block *)((uint32_t)ar + sizeof(struct arena) + idx * ar->desc->block_size);
+    return (struct mem_block *)((uint32_t)ar + sizeof(struct arena) + idx * block_size);
 }
 
 /*返回b内存块对应的arena起始地址*/
@@ -347,57 +977,168 @@ static struct arena *block2arena(struct mem_block *b)
     return (struct arena *)((uint32_t)b & 0xfffff000);
 }
 
-/*在堆中申请size个字节的内存*/
-void *sys_malloc(uint32_t size)
+/*返回sys_malloc系列函数分配出去的ptr所属的arena
+ *小块和普通的整页分配都在arena头之后，不会按页对齐；
+ *按页对齐的地址只能来自sys_malloc_aligned，它的arena头放在前一页*/
+static struct arena *ptr2arena(void *ptr)
 {
-    enum pool_flags PF;
-    struct pool *mem_pool;
-    uint32_t pool_size;
-    struct mem_block_desc *descs;
-    struct task_struct *cur = running_thread();
-    // 判断使用哪个内存池
-    if (cur->pgdir == NULL)
+    if ((uint32_t)ptr % PG_SIZE == 0)
     {
-        PF = PF_KERNEL;
-        mem_pool = &kernel_pool;
-        pool_size = kernel_pool.pool_size;
-        descs = k_block_descs; // 全局变量
+        return (struct arena *)((uint32_t)ptr - PG_SIZE);
+    }
+    return block2arena(ptr);
+}
+
+/*把arena挂到desc->partial_arenas的表头*/
+static void arena_link(struct mem_block_desc *desc, struct arena *a)
+{
+    a->prev = NULL;
+    a->next = desc->partial_arenas;
+    if (a->next != NULL)
+    {
+        a->next->prev = a;
+    }
+    desc->partial_arenas = a;
+}
+
+/*把arena从desc->partial_arenas上摘下*/
+static void arena_unlink(struct mem_block_desc *desc, struct arena *a)
+{
+    if (a->prev != NULL)
+    {
+        a->prev->next = a->next;
     }
     else
     {
-        PF = PF_USER;
-        mem_pool = &user_pool;
-        pool_size = user_pool.pool_size;
-        descs = cur->u_block_desc;
+        desc->partial_arenas = a->next;
     }
-    // 如果申请的内存不在内存池容量范围内
-    if (!(size > 0 && size < pool_size))
+    if (a->next != NULL)
     {
-        return NULL;
+        a->next->prev = a->prev;
     }
+}
 
+/*从descs[desc_idx]中取出一个小块，没有还有空闲块的arena时创建新的arena
+ *新arena不预先拆分，而是用carved当作指针按需往后切，所以每次都是O(1)
+ *调用者需持有对应内存池的锁*/
+static struct mem_block *desc_block_get(enum pool_flags PF, struct mem_block_desc *descs, uint8_t desc_idx)
+{
     struct arena *a;
     struct mem_block *b;
-    lock_acquire(&mem_pool->lock); // 保证互斥
-    if (size > 1024)               // 需要整页分配
+    struct mem_block_desc *desc = &descs[desc_idx];
+    if (desc->partial_arenas == NULL) // 如果对应的大小已经没有空余的块，就要创建新的arena
+    {
+        a = malloc_page(PF, 1);
+        if (a == NULL)
+        {
+            return NULL;
+        }
+        // 更新arena信息，块在分配时才切出来，不需要清零整页
+        a->desc_idx = desc_idx;
+        a->cnt = desc->block_per_arena;
+        a->large = false;
+        a->carved = 0;
+        list_init(&a->free_blocks);
+        arena_link(desc, a);
+    }
+    // 开始分配内存块，优先复用释放回来的块，保持缓存是热的
+    a = desc->partial_arenas;
+    if (!list_empty(&a->free_blocks))
+    {
+        b = (struct mem_block *)list_pop(&a->free_blocks);
+    }
+    else
+    {
+        ASSERT(a->carved < desc->block_per_arena);
+        b = arena2block(a, desc->block_size, a->carved++);
+    }
+    if (--a->cnt == 0) // arena已经分完，从partial_arenas上摘下
+    {
+        arena_unlink(desc, a);
+    }
+    return b;
+}
+
+/*把小块b放回它所属的arena，arena全部空闲时直接释放整个arena，返回是否释放了arena
+ *调用者需持有对应内存池的锁*/
+static bool desc_block_put(enum pool_flags pf, struct mem_block_desc *descs, struct mem_block *b)
+{
+    struct arena *a = block2arena(b);
+    struct mem_block_desc *desc = &descs[a->desc_idx];
+    if (a->cnt == 0) // arena原本是满的，重新挂回partial_arenas
+    {
+        arena_link(desc, a);
+    }
+    // 然后判断这个arena是否空闲，是的话释放整个arena
+    if (++a->cnt == desc->block_per_arena)
+    {
+        // 空闲块都在arena内部，摘下arena即可，不需要逐块处理
+        arena_unlink(desc, a);
+        mfree_page(pf, a, 1);
+        return true;
+    }
+    list_push(&a->free_blocks, &b->free_elem);
+    return false;
+}
+
+/*在堆中申请size个字节的内存*/
+void *sys_malloc(uint32_t size)
+{
+    enum pool_flags PF;
+    struct pool *mem_pool;
+    uint32_t pool_size;
+    struct mem_block_desc *descs;
+    struct task_struct *cur = running_thread();
+    // 判断使用哪个内存池
+    if (cur->pgdir == NULL)
+    {
+        PF = PF_KERNEL;
+        mem_pool = &kernel_pool;
+        pool_size = kernel_pool.pool_size;
+        descs = k_block_descs; // 全局变量
+    }
+    else
+    {
+        PF = PF_USER;
+        mem_pool = &user_pool;
+        pool_size = user_pool.pool_size;
+        descs = cur->u_block_desc;
+    }
+    // 如果申请的内存不在内存池容量范围内
+    if (!(size > 0 && size < pool_size))
+    {
+        return NULL;
+    }
+
+    struct arena *a;
+    struct mem_block *b;
+    if (size > 1024) // 需要整页分配
     {
         // 计算需要的页数，向上取整
         uint32_t page_cnt = DIV_ROUND_UP(size + sizeof(struct arena), PG_SIZE);
 
-        a = malloc_page(PF, page_cnt);
-        if (a != NULL) // 成功申请
-        {
-            memset(a, 0, page_cnt * PG_SIZE); // 清零以备使用
-            a->desc = NULL;
-            a->cnt = page_cnt;
-            a->large = true;
-            return (void *)(a + 1); // 返回剩余内存
+        a = NULL;
+        if (PF == PF_KERNEL && page_cnt >= LARGE_PG_PAGES)
+        { // 内核的超大分配优先用4MB大页，省掉页表和tlb项，失败再退回4KB页
+            a = malloc_large_page(DIV_ROUND_UP(page_cnt, LARGE_PG_PAGES));
         }
-        else
+        if (a == NULL)
         {
+            lock_acquire(&mem_pool->lock); // 保证互斥
+            a = malloc_page(PF, page_cnt);
             lock_release(&mem_pool->lock);
+        }
+        if (a == NULL)
+        {
             return NULL;
         }
+        if (PF == PF_KERNEL)
+        {
+            memset(a, 0, page_cnt * PG_SIZE); // 清零以备使用，用户页缺页时已经清零
+        }
+        a->cnt = page_cnt;
+        a->large = true;
+        return (void *)(a + 1); // 返回剩余内存
     }
     else // 分配小块即可
     {
@@ -409,58 +1150,60 @@ void *sys_malloc(uint32_t size)
                 break;
             }
         }
-        if (list_empty(&descs[desc_idx].free_list)) // 如果对应的大小已经没有空余的块，就要创建新的arena
+        /*快速路径：magazine只属于当前线程，别的线程不会碰它，不需要锁也不需要关中断*/
+        struct magazine *mag = &cur->mags[desc_idx];
+        if (mag->cnt > 0)
         {
-            a = malloc_page(PF, 1);
-            if (a == NULL)
-            {
-                lock_release(&mem_pool->lock);
-                return NULL;
-            }
-            memset(a, 0, PG_SIZE);
-
-            // 更新desc信息
-            a->desc = &descs[desc_idx];
-            a->cnt = descs[desc_idx].block_per_arena;
-            a->large = false;
-
-            // 将新的arena拆成小块放入队列
-            uint32_t block_idx;
-            enum intr_status old_status = intr_disable();
-            for (block_idx = 0; block_idx < descs[desc_idx].block_per_arena; block_idx++)
-            {
-                b = arena2block(a, block_idx);
-                ASSERT(!elem_find(&a->desc->free_list, &b->free_elem));
-                list_append(&a->desc->free_list, &b->free_elem);
-            }
-            intr_set_status(old_status);
+            atomic_inc(&alloc_stats.mag_alloc_hits);
+            return (void *)mag->blocks[--mag->cnt];
+        }
+        /*慢速路径：加锁后除了本次要用的块，再顺手从共享链表批量取出半个magazine*/
+        lock_acquire(&mem_pool->lock);
+        atomic_inc(&alloc_stats.lock_acquires);
+        b = desc_block_get(PF, descs, desc_idx);
+        while (b != NULL && mag->cnt < MAG_SIZE / 2 && descs[desc_idx].partial_arenas != NULL)
+        {
+            mag->blocks[mag->cnt++] = desc_block_get(PF, descs, desc_idx);
         }
-        // 开始分配内存块
-        b = (struct mem_block *)(list_pop(&descs[desc_idx].free_list));
-        memset(b, descs[desc_idx].block_size, 0); // 清理一个小块
-        a = block2arena(b);
-        a->cnt--;
         lock_release(&mem_pool->lock);
         return (void *)b;
     }
 }
 
-/*将物理地址pg_phy_addr回收到物理内存池，实现单页回收*/
+/*由物理地址得到页框描述符，地址不在描述符数组覆盖的范围内时返回NULL*/
+struct frame *phys_to_frame(uint32_t pg_phy_addr)
+{
+    uint32_t idx = (pg_phy_addr - kernel_pool.idx_base) / PG_SIZE;
+    if (pg_phy_addr < kernel_pool.idx_base || idx >= kernel_pool.frame_cnt)
+    {
+        return NULL;
+    }
+    return &kernel_pool.frames[idx];
+}
+
+/*由页框描述符得到物理页地址*/
+uint32_t frame_to_phys(struct frame *f)
+{
+    return kernel_pool.idx_base + (f - kernel_pool.frames) * PG_SIZE;
+}
+
+/*将物理地址pg_phy_addr回收到物理内存池，实现单页回收
+ *重复释放、释放保留页或空闲页都会直接panic，这些检查只看描述符里本来就要读的字段*/
 void pfree(uint32_t pg_phy_addr)
 {
-    struct pool *mem_pool;
-    uint32_t bit_idx = 0;
-    if (pg_phy_addr >= user_pool.phy_addr_start)
+    struct frame *f = phys_to_frame(pg_phy_addr);
+    if (f == NULL || f->pool == NULL || f->ref_cnt == 0 ||
+        (f->flags & (FRAME_BUDDY | FRAME_RESERVED | FRAME_ZEROED)))
     {
-        mem_pool = &user_pool;
-        bit_idx = (pg_phy_addr - user_pool.phy_addr_start) / PG_SIZE;
+        PANIC("pfree: page is not allocated");
     }
-    else
+    // 还有其他进程共享此页时只减少引用计数
+    if (--f->ref_cnt > 0)
     {
-        mem_pool = &kernel_pool;
-        bit_idx = (pg_phy_addr - kernel_pool.phy_addr_start) / PG_SIZE;
+        return;
     }
-    bitmap_set(&mem_pool->pool_bitmap, bit_idx, 0);
+    // 页可能是从另一个池借来的，所属的池要看页框描述符，不能按地址判断
+    buddy_free(f->pool, f - f->pool->frames, 0);
 }
 
 /*去除页表中vaddr虚拟地址的映射，即vaddr对应的pte页表项设为0*/
@@ -468,130 +1211,1297 @@ static void page_table_pte_remove(uint32_t vaddr)
 {
     uint32_t *pte = pte_ptr(vaddr);
     *pte &= ~PG_P_1; // 只清除P位，不影响其他位
-    asm volatile("invlpg %0" : : "m"(vaddr) : "memory");
+    // invlpg的操作数是要刷新的线性地址本身，而不是存放它的变量
+    asm volatile("invlpg (%0)" : : "r"(vaddr) : "memory");
 }
 
 /*在虚拟地址池中释放vaddr起始的连续pg_cnt个内存页*/
 static void vaddr_remove(enum pool_flags pf, void *_vaddr, uint32_t pg_cnt)
 {
-    uint32_t bit_idx_start = 0, vaddr = (uint32_t)_vaddr, cnt = 0;
+    uint32_t bit_idx_start = 0, vaddr = (uint32_t)_vaddr;
     if (pf == PF_KERNEL)
     {
         bit_idx_start = (vaddr - kernel_vaddr.vaddr_start) / PG_SIZE;
-        while (cnt < pg_cnt)
-        {
-            bitmap_set(&kernel_vaddr.vaddr_bitmap, bit_idx_start + cnt, 0);
-            cnt++;
-        }
+        bitmap_clear_range(&kernel_vaddr.vaddr_bitmap, bit_idx_start, pg_cnt);
     }
     else
     {
         struct task_struct *cur = running_thread();
-        bit_idx_start = (vaddr - cur->userprog_vaddr.vaddr_start) / PG_SIZE;
-        while (cnt < pg_cnt)
+        vma_remove(&cur->vmas, vaddr, vaddr + pg_cnt * PG_SIZE);
+    }
+}
+
+/*vaddr是否已经映射了物理页，页目录项不存在时不能访问页表项*/
+static bool vaddr_mapped(uint32_t vaddr)
+{
+    uint32_t pde = *pde_ptr(vaddr);
+    if (!(pde & PG_P_1))
+    {
+        return false;
+    }
+    return (pde & PG_PS_1) || (*pte_ptr(vaddr) & PG_P_1);
+}
+
+/*连同全局页一起刷新整个tlb
+ *重新加载cr3刷不掉全局页，要把cr4.PGE关掉再打开*/
+static void tlb_flush_all(void)
+{
+    asm volatile("movl %%cr4, %%eax; andl %0, %%eax; movl %%eax, %%cr4; orl %1, %%eax; movl %%eax, %%cr4"
+                 : : "i"(~CR4_PGE), "i"(CR4_PGE) : "eax", "memory");
+}
+
+/*使[vaddr, vaddr + pg_cnt * PG_SIZE)在当前处理器tlb中的缓存失效
+ *页数超过TLB_FLUSH_THRESHOLD时整体刷新，比逐页invlpg便宜
+ *内核空间是全局页，只能用tlb_flush_all，用户空间重新加载cr3就够了*/
+void tlb_flush_local(uint32_t vaddr, uint32_t pg_cnt)
+{
+    if (pg_cnt > TLB_FLUSH_THRESHOLD)
+    {
+        if (vaddr >= K_LINEAR_MAP_BASE)
         {
-            bitmap_set(&cur->userprog_vaddr.vaddr_bitmap, bit_idx_start + cnt, 0);
-            cnt++;
+            tlb_flush_all();
         }
+        else
+        {
+            asm volatile("movl %%cr3, %%eax; movl %%eax, %%cr3" : : : "eax", "memory");
+        }
+        return;
+    }
+    while (pg_cnt-- > 0)
+    {
+        asm volatile("invlpg (%0)" : : "r"(vaddr) : "memory");
+        vaddr += PG_SIZE;
+    }
+}
+
+/*解除映射后刷新tlb，内核空间被所有处理器共享，要通知其他处理器一起刷新
+ *用户进程同一时间只在一个处理器上运行，别的处理器上残留的旧项在它换处理器时随cr3重新加载刷掉*/
+static void tlb_flush_range(uint32_t vaddr, uint32_t pg_cnt)
+{
+    tlb_flush_local(vaddr, pg_cnt);
+    if (vaddr >= K_LINEAR_MAP_BASE)
+    {
+        tlb_shootdown(vaddr, pg_cnt);
+    }
+}
+
+/*解除从_vaddr开始的pg_cnt个虚拟页的映射，映射着的物理页交给pfree回收
+ *没有映射的页和整个不存在的页目录项直接跳过，全部处理完后统一刷新一次tlb
+ *在刷新之前物理页就已经还给了内存池，但这段虚拟地址此后不会再被访问，旧的tlb项不会被用到*/
+void unmap_range(void *_vaddr, uint32_t pg_cnt)
+{
+    uint32_t vaddr = (uint32_t)_vaddr;
+    uint32_t remain = pg_cnt;
+    while (remain > 0)
+    {
+        uint32_t pde = *pde_ptr(vaddr);
+        uint32_t span = 1024 - PTE_INDEX(vaddr); // 这个页目录项还能覆盖的页数
+        if (span > remain)
+        {
+            span = remain;
+        }
+        if (pde & PG_P_1)
+        {
+            ASSERT(!(pde & PG_PS_1)); // 4MB大页由mfree_large_page释放
+            uint32_t *pte = pte_ptr(vaddr);
+            uint32_t i;
+            for (i = 0; i < span; i++)
+            {
+                if (!(pte[i] & PG_P_1))
+                { // 换出的页没有物理页，只需释放交换槽
+                    if (pte[i] & PG_SWAP)
+                    {
+                        swap_slot_free(pte[i] >> 12);
+                        pte[i] = 0;
+                    }
+                    continue;
+                }
+                uint32_t pg_phy_addr = pte[i] & 0xfffff000;
+                ASSERT(pg_phy_addr >= kernel_pool.phy_addr_start);
+                pfree(pg_phy_addr);
+                pte[i] &= ~PG_P_1; // 只清除P位，不影响其他位
+            }
+        }
+        vaddr += span * PG_SIZE;
+        remain -= span;
     }
+    tlb_flush_range((uint32_t)_vaddr, pg_cnt);
 }
 
 /*释放以虚拟地址vaddr为起始的cnt个物理页框*/
 void mfree_page(enum pool_flags pf, void *_vaddr, uint32_t pg_cnt)
 {
-    uint32_t pg_phy_addr;
-    uint32_t vaddr = (uint32_t)_vaddr, cnt = 0;
-    ASSERT(pg_cnt >= 1 && (vaddr % PG_SIZE) == 0);
-    pg_phy_addr = addr_v2p(vaddr);
+    ASSERT(pg_cnt >= 1 && ((uint32_t)_vaddr % PG_SIZE) == 0);
+    // 用户内存按需分配，从未访问过的页没有物理页，unmap_range会跳过它们，只需要归还虚拟地址
+    unmap_range(_vaddr, pg_cnt);
+    vaddr_remove(pf, _vaddr, pg_cnt);
+}
 
-    // 确保待释放的物理内存在1MB低端内存+1KB页目录表+1KB页表地址外
-    // 同时还必须是整4KB地址
-    ASSERT(pg_phy_addr >= 0x102000 && (pg_phy_addr % PG_SIZE) == 0);
+/*把从物理地址phy_addr开始的size字节设备寄存器映射到内核空间，成功返回对应的虚拟地址，失败返回NULL
+ *页表项关闭缓存，物理页不属于任何内存池，以后也不会被释放*/
+void *ioremap(uint32_t phy_addr, uint32_t size)
+{
+    uint32_t offset = phy_addr & 0xfff;
+    uint32_t pg_cnt = DIV_ROUND_UP(offset + size, PG_SIZE);
+    lock_acquire(&kernel_pool.lock);
+    void *vaddr = vaddr_get(PF_KERNEL, pg_cnt);
+    if (vaddr == NULL)
+    {
+        lock_release(&kernel_pool.lock);
+        return NULL;
+    }
+    if (!map_range(vaddr, (void *)(phy_addr - offset), pg_cnt))
+    {
+        vaddr_remove(PF_KERNEL, vaddr, pg_cnt);
+        lock_release(&kernel_pool.lock);
+        return NULL;
+    }
+    uint32_t i;
+    for (i = 0; i < pg_cnt; i++)
+    {
+        uint32_t *pte = pte_ptr((uint32_t)vaddr + i * PG_SIZE);
+        *pte = (*pte & ~PG_US_U) | PG_PCD_1 | PG_PWT_1; // 设备寄存器只给内核访问
+    }
+    lock_release(&kernel_pool.lock);
+    return (void *)((uint32_t)vaddr + offset);
+}
 
-    if (pg_phy_addr >= user_pool.phy_addr_start)
+/*修改内核空间vaddr所在的页目录项，内核页目录项在每个进程的页目录表里都有一份拷贝，要一起改*/
+static void kernel_pde_set(uint32_t vaddr, uint32_t pde_val)
+{
+    uint32_t pde_idx = PDE_INDEX(vaddr);
+    enum intr_status old_status = spin_lock_irqsave(&all_list_lock);
+    KERNEL_PGDIR[pde_idx] = pde_val;
+    struct list_elem *elem = thread_all_list.head.next;
+    while (elem != &thread_all_list.tail)
     {
-        vaddr -= PG_SIZE; // 为了对齐
-        while (cnt < pg_cnt)
+        struct task_struct *pthread = elem2entry(struct task_struct, all_list_tag, elem);
+        if (pthread->pgdir != NULL)
         {
-            vaddr += PG_SIZE; // 每次都能正确指向下一个页
-            pg_phy_addr = addr_v2p(vaddr);
-            // 确保待回收地址在用户物理地址池内，并且是整4KB地址
-            //put_int(user_pool.phy_addr_start);
-            //put_char(' ');
-            //put_int(pg_phy_addr);
-            ASSERT(pg_phy_addr >= user_pool.phy_addr_start && (pg_phy_addr % PG_SIZE) == 0);
-            pfree(pg_phy_addr);
-            page_table_pte_remove(vaddr);
-            cnt++;
+            pthread->pgdir[pde_idx] = pde_val;
         }
-        vaddr_remove(pf, _vaddr, pg_cnt);
+        elem = elem->next;
     }
-    else
+    spin_unlock_irqrestore(&all_list_lock, old_status);
+    // 页目录项可能被缓存在分页结构缓存里，原来的大页又是全局页，所有处理器都整体刷新一次
+    tlb_flush_all();
+    tlb_shootdown(vaddr & 0xffc00000, LARGE_PG_PAGES);
+}
+
+/* 申请cnt个4MB大页，成功返回内核虚拟地址，失败返回NULL
+ * 每个大页只占一个页目录项，不占页表，也只占一个tlb项，适合需要大块内存的内核模块
+ * 物理上每个大页是伙伴系统中一个最高阶的块，它们之间不要求连续 */
+void *malloc_large_page(uint32_t cnt)
+{
+    ASSERT(cnt > 0);
+    lock_acquire(&kernel_pool.lock);
+    int bit_idx = bitmap_scan_aligned(&kernel_vaddr.vaddr_bitmap, cnt * LARGE_PG_PAGES, LARGE_PG_PAGES);
+    if (bit_idx == -1)
+    {
+        lock_release(&kernel_pool.lock);
+        return NULL;
+    }
+    uint32_t vaddr_start = kernel_vaddr.vaddr_start + bit_idx * PG_SIZE;
+    uint32_t i;
+    for (i = 0; i < cnt; i++)
     {
-        vaddr -= PG_SIZE;
-        while (cnt < pg_cnt)
+        int32_t idx = buddy_alloc(&kernel_pool, BUDDY_MAX_ORDER);
+        if (idx == -1 && pool_borrow(&kernel_pool, BUDDY_MAX_ORDER))
         {
-            vaddr += PG_SIZE;
-            pg_phy_addr = addr_v2p(vaddr);
-            // 确保待回收地址只在内核物理地址池内，并且是整4KB地址
-            ASSERT(pg_phy_addr >= kernel_pool.phy_addr_start &&
-                   pg_phy_addr < user_pool.phy_addr_start &&
-                   (pg_phy_addr % PG_SIZE) == 0);
-            pfree(pg_phy_addr);
-            page_table_pte_remove(vaddr);
-            cnt++;
+            idx = buddy_alloc(&kernel_pool, BUDDY_MAX_ORDER);
+        }
+        if (idx == -1)
+        { // 失败时回滚已经映射的大页
+            while (i-- > 0)
+            {
+                uint32_t vaddr = vaddr_start + i * LARGE_PG_SIZE;
+                uint32_t pg_phy = addr_v2p(vaddr);
+                kernel_pde_set(vaddr, (0x100000 + (PDE_INDEX(vaddr) - 767) * PG_SIZE) | PG_US_U | PG_RW_W | PG_P_1);
+                buddy_free(&kernel_pool, (pg_phy - kernel_pool.idx_base) / PG_SIZE, BUDDY_MAX_ORDER);
+            }
+            lock_release(&kernel_pool.lock);
+            return NULL;
         }
-        vaddr_remove(pf, _vaddr, pg_cnt);
+        uint32_t pg_phy = kernel_pool.idx_base + idx * PG_SIZE;
+        kernel_pde_set(vaddr_start + i * LARGE_PG_SIZE, pg_phy | PG_PS_1 | PG_G_1 | PG_US_S | PG_RW_W | PG_P_1);
     }
+    bitmap_set_range(&kernel_vaddr.vaddr_bitmap, bit_idx, cnt * LARGE_PG_PAGES);
+    lock_release(&kernel_pool.lock);
+    return (void *)vaddr_start;
 }
 
-/*回收ptr处的内存*/
-void sys_free(void *ptr)
+/* 释放malloc_large_page申请的cnt个大页
+ * 页目录项恢复成loader预先建好的页表，这些页表在大页期间一直空着 */
+void mfree_large_page(void *_vaddr, uint32_t cnt)
 {
-    ASSERT(ptr != NULL);
-    if (ptr != NULL)
+    uint32_t vaddr = (uint32_t)_vaddr;
+    ASSERT(vaddr % LARGE_PG_SIZE == 0 && vaddr >= K_HEAP_START);
+    lock_acquire(&kernel_pool.lock);
+    uint32_t i;
+    for (i = 0; i < cnt; i++)
     {
-        enum pool_flags pf;
-        struct pool *mem_pool;
-        /*判断是线程还是进程*/
-        if (running_thread()->pgdir == NULL)
+        uint32_t cur = vaddr + i * LARGE_PG_SIZE;
+        ASSERT(*pde_ptr(cur) & PG_PS_1);
+        uint32_t pg_phy = addr_v2p(cur);
+        // loader把第769项以后的页目录项依次指向0x102000开始的页表
+        kernel_pde_set(cur, (0x100000 + (PDE_INDEX(cur) - 767) * PG_SIZE) | PG_US_U | PG_RW_W | PG_P_1);
+        buddy_free(&kernel_pool, (pg_phy - kernel_pool.idx_base) / PG_SIZE, BUDDY_MAX_ORDER);
+    }
+    vaddr_remove(PF_KERNEL, _vaddr, cnt * LARGE_PG_PAGES);
+    lock_release(&kernel_pool.lock);
+}
+
+/*给m_pool预清零一个页，成功返回true
+ *池的锁被占用、伙伴系统没有空闲页或者预清零链表已满时返回false，整个过程不会阻塞*/
+static bool pool_prezero_one(struct pool *m_pool)
+{
+    if (m_pool->zeroed_cnt >= PREZERO_TARGET || !lock_try_acquire(&m_pool->lock))
+    {
+        return false;
+    }
+    int32_t idx = buddy_alloc(m_pool, 0);
+    lock_release(&m_pool->lock);
+    if (idx == -1)
+    {
+        return false;
+    }
+    // 物理页不一定在线性映射范围内，借专用窗口映射后清零
+    page_table_add(prezero_window, (void *)(m_pool->idx_base + idx * PG_SIZE));
+    memset(prezero_window, 0, PG_SIZE);
+    page_table_pte_remove((uint32_t)prezero_window);
+
+    enum intr_status old_status = spin_lock_irqsave(&m_pool->zeroed_lock);
+    m_pool->frames[idx].flags |= FRAME_ZEROED;
+    list_push(&m_pool->zeroed_list, &m_pool->frames[idx].elem);
+    m_pool->zeroed_cnt++;
+    spin_unlock_irqrestore(&m_pool->zeroed_lock, old_status);
+    return true;
+}
+
+/*由idle线程在空闲时调用，每次清零一个页，用户池优先，因为缺页路径上的清零最多
+ *两个池都达到PREZERO_TARGET或者暂时无法清零时返回false*/
+bool page_prezero_one(void)
+{
+    return pool_prezero_one(&user_pool) || pool_prezero_one(&kernel_pool);
+}
+
+/*由idle线程在空闲时调用，空闲页低于低水位的池提前从另一个池借一批页，
+ *这样申请页时就不用在关键路径上借，借到返回true*/
+bool pool_balance(void)
+{
+    struct pool *pools[2] = {&kernel_pool, &user_pool};
+    uint32_t i;
+    for (i = 0; i < 2; i++)
+    {
+        struct pool *m_pool = pools[i];
+        if (pool_avail_pages(m_pool) >= m_pool->low_wmark || !lock_try_acquire(&m_pool->lock))
         {
-            ASSERT((uint32_t)ptr >= K_HEAP_START);
-            pf = PF_KERNEL;
-            mem_pool = &kernel_pool;
+            continue;
         }
-        else
+        bool borrowed = pool_avail_pages(m_pool) < m_pool->low_wmark && pool_borrow(m_pool, 0);
+        lock_release(&m_pool->lock);
+        if (borrowed)
         {
-            pf = PF_USER;
-            mem_pool = &user_pool;
+            return true;
         }
+    }
+    return false;
+}
 
-        lock_acquire(&mem_pool->lock);
-        struct mem_block *b = ptr;
-        struct arena *a = block2arena(b);
-        ASSERT(a->large == 1 || a->large == 0);
-        // 判断是整页还是小块
-        if (a->desc == 0 || a->large == true)
+/*把pf对应内存池的使用情况填入st
+ *计数在持有池的锁时修改，只关中断挡不住其他处理器，要持锁才能读到一份一致的数据*/
+void mem_pool_stat(enum pool_flags pf, struct pool_stat *st)
+{
+    struct pool *m_pool = pf & PF_KERNEL ? &kernel_pool : &user_pool;
+    lock_acquire(&m_pool->lock);
+    st->owned_pages = m_pool->owned_pages;
+    st->free_pages = pool_avail_pages(m_pool);
+    st->max_pages = m_pool->max_pages;
+    st->low_wmark = m_pool->low_wmark;
+    st->borrowed_in = m_pool->borrowed_in;
+    st->lent_out = m_pool->lent_out;
+    lock_release(&m_pool->lock);
+}
+
+/*返回pid不小于pid的用户进程中pid最小的一个，没有则返回NULL*/
+static struct task_struct *clock_task_from(pid_t pid)
+{
+    struct task_struct *found = NULL;
+    enum intr_status old_status = spin_lock_irqsave(&all_list_lock);
+    struct list_elem *elem = thread_all_list.head.next;
+    while (elem != &thread_all_list.tail)
+    {
+        struct task_struct *t = elem2entry(struct task_struct, all_list_tag, elem);
+        if (t->pgdir != NULL && t->pid >= pid && (found == NULL || t->pid < found->pid))
         {
-            mfree_page(pf, a, a->cnt);
+            found = t;
         }
-        else
+        elem = elem->next;
+    }
+    spin_unlock_irqrestore(&all_list_lock, old_status);
+    return found;
+}
+
+/*从clock_vaddr开始扫描进程t的用户页表，把第一个最近没有被访问过的私有页换出到槽slot
+ *访问位为1的页清掉访问位，再给它一次机会；扫到用户空间末尾还没找到返回false
+ *t的页表不一定在当前地址空间里，借reclaim_window映射后访问*/
+static bool clock_scan_task(struct task_struct *t, uint32_t slot)
+{
+    uint32_t *pt = reclaim_window;
+    void *page_window = (void *)((uint32_t)reclaim_window + PG_SIZE);
+    uint32_t cr3;
+    asm volatile("movl %%cr3, %0" : "=r"(cr3));
+    // 只有当前加载的地址空间可能在tlb中缓存了t的页表项
+    bool loaded = addr_v2p((uint32_t)t->pgdir) == cr3;
+    while (clock_vaddr < USER_VADDR_END)
+    {
+        uint32_t pde = t->pgdir[PDE_INDEX(clock_vaddr)];
+        if (!(pde & PG_P_1))
+        {
+            clock_vaddr = (clock_vaddr & 0xffc00000) + LARGE_PG_SIZE;
+            continue;
+        }
+        page_table_add(pt, (void *)(pde & 0xfffff000));
+        uint32_t i;
+        for (i = PTE_INDEX(clock_vaddr); i < 1024; i++, clock_vaddr += PG_SIZE)
         {
-            // 先把目前这个小块放回空闲队列
-            list_append(&a->desc->free_list, &b->free_elem);
-            // 然后判断这个arena是否空闲，是的话释放整个arena
-            if (++a->cnt == a->desc->block_per_arena)
+            uint32_t pte = pt[i];
+            if (!(pte & PG_P_1))
             {
-                uint32_t block_idx;
-                for (block_idx = 0; block_idx < a->desc->block_per_arena; ++block_idx)
+                continue;
+            }
+            if (pte & PG_A_1)
+            { // 最近访问过，清掉访问位，指针转回来时还没被访问才换出
+                pt[i] = pte & ~PG_A_1;
+                if (loaded)
                 {
-                    struct mem_block *b = arena2block(a, block_idx);
-                    ASSERT(elem_find(&a->desc->free_list, &b->free_elem));
-                    list_remove(&b->free_elem);
+                    asm volatile("invlpg (%0)" : : "r"(clock_vaddr) : "memory");
                 }
-                mfree_page(pf, a, 1);
+                continue;
             }
+            // fork后共享的页换出时要修改所有共享者的页表，这里只换出私有页
+            uint32_t pg_phy = pte & 0xfffff000;
+            struct frame *f = phys_to_frame(pg_phy);
+            if (f == NULL || f->pool != &user_pool || f->ref_cnt != 1)
+            {
+                continue;
+            }
+            // 先让页表项失效再写盘，写盘期间进程访问这一页会在缺页处理中等待用户内存池的锁
+            pt[i] = (slot << 12) | PG_SWAP;
+            if (loaded)
+            {
+                asm volatile("invlpg (%0)" : : "r"(clock_vaddr) : "memory");
+            }
+            // t可能正在别的处理器上运行，或者它的页目录表还留在别的处理器的cr3里
+            tlb_shootdown(clock_vaddr, 1);
+            page_table_pte_remove((uint32_t)pt);
+            clock_vaddr += PG_SIZE;
+            page_table_add(page_window, (void *)pg_phy);
+            swap_write(slot, page_window);
+            page_table_pte_remove((uint32_t)page_window);
+            pfree(pg_phy);
+            atomic_inc(&alloc_stats.swap_outs);
+            return true;
         }
-        lock_release(&mem_pool->lock);
+        page_table_pte_remove((uint32_t)pt);
+    }
+    return false;
+}
+
+/*用时钟算法换出一个冷的用户页，物理页还给内存池，换出成功返回true
+ *指针按pid顺序走遍所有用户进程，最多转两整圈：第一圈清掉访问位，第二圈一定能选中没有再被访问的页
+ *调用者需持有用户内存池的锁*/
+static bool swap_out_one(void)
+{
+    int32_t slot = swap_slot_alloc();
+    if (slot == SWAP_SLOT_NONE)
+    { // 没有交换分区或者交换分区已满
+        return false;
+    }
+    uint8_t wraps = 0; // 从中途开始，第一次回到开头时只走完了半圈
+    while (wraps < 3)
+    {
+        struct task_struct *t = clock_task_from(clock_pid);
+        if (t == NULL)
+        { // pid最大的进程也扫完了，回到开头
+            clock_pid = 0;
+            clock_vaddr = USER_VADDR_START;
+            wraps++;
+            continue;
+        }
+        if (t->pid != clock_pid)
+        { // 原来的进程已经不在了，从下一个进程的开头扫起
+            clock_pid = t->pid;
+            clock_vaddr = USER_VADDR_START;
+        }
+        if (clock_scan_task(t, slot))
+        {
+            return true;
+        }
+        clock_pid = t->pid + 1;
+        clock_vaddr = USER_VADDR_START;
+    }
+    swap_slot_free(slot);
+    return false;
+}
+
+/*为用户页申请一个物理页，两个池都拿不出空闲页时换出冷页再试，实在换不出才返回NULL
+ *调用者需持有用户内存池的锁*/
+static void *palloc_user(void)
+{
+    void *page_phyaddr;
+    while ((page_phyaddr = palloc(&user_pool)) == NULL && swap_out_one())
+        ;
+    return page_phyaddr;
+}
+
+/*把换出到槽slot的页读回来，映射到当前进程的vaddr，调用者需持有用户内存池的锁*/
+static void swap_in(uint32_t vaddr, uint32_t slot)
+{
+    void *page_phyaddr = palloc_user();
+    if (page_phyaddr == NULL)
+    {
+        PANIC("swap_in: out of user memory");
+    }
+    void *page_window = (void *)((uint32_t)reclaim_window + PG_SIZE);
+    page_table_add(page_window, page_phyaddr);
+    swap_read(slot, page_window);
+    page_table_pte_remove((uint32_t)page_window);
+    // fork后槽可能还被其他进程引用，引用计数减到0才真正空闲
+    swap_slot_free(slot);
+    *pte_ptr(vaddr) = 0;
+    page_table_add((void *)vaddr, page_phyaddr);
+    atomic_inc(&alloc_stats.swap_ins);
+}
+
+/*写时复制：vaddr映射的是fork后共享的只读页，给当前进程换上一份可写的私有副本
+ *调用者需持有用户内存池的锁*/
+static void cow_copy(uint32_t vaddr)
+{
+    uint32_t *pte = pte_ptr(vaddr);
+    uint32_t old_phy = *pte & 0xfffff000;
+    struct frame *f = phys_to_frame(old_phy);
+    ASSERT(f->pool == &user_pool && f->ref_cnt > 0);
+    // 其他共享者都已经复制走了，直接恢复可写即可
+    if (f->ref_cnt == 1)
+    {
+        *pte |= PG_RW_W;
+        asm volatile("invlpg (%0)" : : "r"(vaddr) : "memory");
+        return;
+    }
+    uint32_t new_phy = (uint32_t)palloc_user();
+    if (new_phy == 0)
+    {
+        PANIC("cow_copy: out of user memory");
+    }
+    // 新页不在当前地址空间里，借一个内核虚拟地址临时映射它来复制内容
+    lock_acquire(&kernel_pool.lock);
+    void *window = vaddr_get(PF_KERNEL, 1);
+    if (window == NULL)
+    {
+        PANIC("cow_copy: out of kernel vaddr");
+    }
+    page_table_add(window, (void *)new_phy);
+    memcpy(window, (void *)vaddr, PG_SIZE);
+    page_table_pte_remove((uint32_t)window);
+    vaddr_remove(PF_KERNEL, window, 1);
+    lock_release(&kernel_pool.lock);
+
+    f->ref_cnt--;
+    *pte = new_phy | PG_US_U | PG_RW_W | PG_P_1;
+    asm volatile("invlpg (%0)" : : "r"(vaddr) : "memory");
+}
+
+/*fork时复制当前进程的用户页表到child_pgdir
+ *不复制用户页本身，父子双方的页表项都改为只读，共享的物理页引用计数加1，
+ *以后任何一方写入时由page_fault_handler复制，所以fork的耗时只和页表数量有关
+ *页表所需的内核页在修改任何东西之前就确认够用，失败时不留下半成品，成功返回true*/
+bool user_pgdir_share(uint32_t *child_pgdir)
+{
+    uint32_t user_pde_cnt = 0xc0000000 >> 22; // 用户空间占用的页目录项数，768
+    uint32_t pde_idx, pte_idx, pt_cnt = 0;
+    for (pde_idx = 0; pde_idx < user_pde_cnt; pde_idx++)
+    {
+        if (*pde_ptr(pde_idx << 22) & PG_P_1)
+        {
+            pt_cnt++;
+        }
+    }
+
+    lock_acquire(&user_pool.lock);
+    lock_acquire(&kernel_pool.lock);
+    // 子进程的页表不在当前地址空间里，借一个内核虚拟地址轮流映射它们来填写
+    void *window = vaddr_get(PF_KERNEL, 1);
+    while (kernel_pool.free_pages < pt_cnt && pool_borrow(&kernel_pool, 0))
+        ;
+    if (window == NULL || kernel_pool.free_pages < pt_cnt)
+    {
+        if (window != NULL)
+        {
+            vaddr_remove(PF_KERNEL, window, 1);
+        }
+        lock_release(&kernel_pool.lock);
+        lock_release(&user_pool.lock);
+        return false;
     }
-}
\ No newline at end of file
+    for (pde_idx = 0; pde_idx < user_pde_cnt; pde_idx++)
+    {
+        if (!(*pde_ptr(pde_idx << 22) & PG_P_1))
+        {
+            continue;
+        }
+        uint32_t pt_phy = (uint32_t)palloc(&kernel_pool);
+        page_table_add(window, (void *)pt_phy);
+        uint32_t *child_pt = window;
+        uint32_t *parent_pt = pte_ptr(pde_idx << 22);
+        for (pte_idx = 0; pte_idx < 1024; pte_idx++)
+        {
+            uint32_t pte = parent_pt[pte_idx];
+            if (pte & PG_P_1)
+            {
+                pte &= ~PG_RW_W;
+                parent_pt[pte_idx] = pte;
+                phys_to_frame(pte & 0xfffff000)->ref_cnt++;
+            }
+            else if (pte & PG_SWAP)
+            { // 换出的页，子进程和父进程共享交换槽
+                swap_slot_dup(pte >> 12);
+            }
+            child_pt[pte_idx] = pte;
+        }
+        page_table_pte_remove((uint32_t)window);
+        child_pgdir[pde_idx] = pt_phy | PG_US_U | PG_RW_W | PG_P_1;
+    }
+    vaddr_remove(PF_KERNEL, window, 1);
+    lock_release(&kernel_pool.lock);
+    lock_release(&user_pool.lock);
+    // 父进程的页表项改成了只读，重新加载cr3刷新整个tlb
+    asm volatile("movl %%cr3, %%eax; movl %%eax, %%cr3" : : : "eax", "memory");
+    return true;
+}
+
+/*页错误处理函数，用户内存在这里按需分配
+ *引起异常的地址在cr2中，如果它落在当前进程的某个vma中(用户栈在创建进程时整段预留)，
+ *就映射一页清零的物理页后返回重新执行
+ *用户态的非法访问只结束出错的进程，内核态的非法访问是内核的bug，直接panic*/
+static void page_fault_handler(uint8_t vec_nr)
+{
+    uint32_t fault_vaddr;
+    asm volatile("movl %%cr2, %0" : "=r"(fault_vaddr));
+    struct task_struct *cur = running_thread();
+    uint32_t vaddr = fault_vaddr & 0xfffff000;
+
+    // 内核线程没有用户空间，内核地址的缺页也不该出现
+    if (cur->pgdir == NULL || vaddr < USER_VADDR_START || vaddr >= USER_VADDR_END)
+    {
+        goto bad_access;
+    }
+    // 没有预留过的地址不能访问，用户栈在创建进程时已经整段预留
+    struct vma *v = vma_find(&cur->vmas, vaddr);
+    if (v == NULL || !(v->flags & (VMA_READ | VMA_WRITE)))
+    { // 没有预留，或者是PROT_NONE的区间
+        goto bad_access;
+    }
+    // 页表项可能在等锁期间被换出，所以先拿锁再检查
+    lock_acquire(&user_pool.lock);
+    // 页已经映射却还出错，是权限问题，不是缺页
+    // 用户页都是以可写方式映射的，只读的用户页只能是fork后共享的页，写入时复制一份
+    if (vaddr_mapped(vaddr))
+    {
+        if ((*pte_ptr(vaddr) & PG_RW_W) || !(v->flags & VMA_WRITE))
+        {
+            lock_release(&user_pool.lock);
+            goto bad_access;
+        }
+        cow_copy(vaddr);
+        lock_release(&user_pool.lock);
+        return;
+    }
+
+    uint32_t old_pte = (*pde_ptr(vaddr) & PG_P_1) ? *pte_ptr(vaddr) : 0;
+    if (old_pte & PG_SWAP)
+    { // 换出过的页从交换分区读回来
+        swap_in(vaddr, old_pte >> 12);
+    }
+    else
+    {
+        // 优先用预清零的页，这样缺页路径上就不用再清零
+        void *page_phyaddr = zeroed_frame_get(&user_pool);
+        bool zeroed = page_phyaddr != NULL;
+        if (!zeroed)
+        {
+            page_phyaddr = palloc_user();
+        }
+        if (page_phyaddr == NULL)
+        {
+            PANIC("page_fault_handler: out of user memory");
+        }
+        page_table_add((void *)vaddr, page_phyaddr);
+        if (zeroed)
+        {
+            atomic_inc(&alloc_stats.zero_hits);
+        }
+        else
+        {
+            memset((void *)vaddr, 0, PG_SIZE);
+            atomic_inc(&alloc_stats.zero_misses);
+        }
+    }
+    if (!(v->flags & VMA_WRITE))
+    { // 只读区间，清零之后再去掉写权限
+        *pte_ptr(vaddr) &= ~PG_RW_W;
+        asm volatile("invlpg (%0)" : : "r"(vaddr) : "memory");
+    }
+    lock_release(&user_pool.lock);
+    return;
+
+bad_access:
+    put_str("\npage fault addr is ");
+    put_int(fault_vaddr);
+    put_str(", vector ");
+    put_int(vec_nr);
+    put_char('\n');
+    // 入口程序压入的向量号紧挨着返回地址，它就是中断栈的第一项，从这里找到cpu压入的错误码
+    struct intr_stack *frame = (struct intr_stack *)((uint32_t)__builtin_frame_address(0) + 8);
+    if (!(frame->err_code & PF_ERR_USER))
+    {
+        PANIC("page_fault_handler: bad access");
+    }
+    // 从用户态进来时不持有任何内核锁，上面持有的用户池的锁也已经释放了
+    put_str(cur->name);
+    put_str(" killed by bad access\n");
+    mag_drain(cur);
+    thread_block(TASK_DIED); // 不会再被唤醒
+}
+
+/*回收ptr处的内存*/
+void sys_free(void *ptr)
+{
+    ASSERT(ptr != NULL);
+    if (ptr != NULL)
+    {
+        enum pool_flags pf;
+        struct pool *mem_pool;
+        struct mem_block_desc *descs;
+        struct task_struct *cur = running_thread();
+        /*判断是线程还是进程*/
+        if (cur->pgdir == NULL)
+        {
+            ASSERT((uint32_t)ptr >= K_HEAP_START);
+            pf = PF_KERNEL;
+            mem_pool = &kernel_pool;
+            descs = k_block_descs;
+        }
+        else
+        {
+            pf = PF_USER;
+            mem_pool = &user_pool;
+            descs = cur->u_block_desc;
+        }
+
+        struct mem_block *b = ptr;
+        struct arena *a = ptr2arena(ptr);
+        ASSERT(a->large == 1 || a->large == 0);
+        // 判断是整页还是小块
+        if (a->large == true && pf == PF_KERNEL && (*pde_ptr((uint32_t)a) & PG_PS_1))
+        {
+            mfree_large_page(a, DIV_ROUND_UP(a->cnt, LARGE_PG_PAGES));
+            return;
+        }
+        if (a->large == true)
+        {
+            lock_acquire(&mem_pool->lock);
+            mfree_page(pf, a, a->cnt);
+            lock_release(&mem_pool->lock);
+            return;
+        }
+        /*小块先放进当前线程的magazine，满了才加锁把较早的半个magazine还给共享链表*/
+        struct magazine *mag = &cur->mags[a->desc_idx];
+        if (mag->cnt == MAG_SIZE)
+        {
+            lock_acquire(&mem_pool->lock);
+            atomic_inc(&alloc_stats.lock_acquires);
+            uint32_t blk_idx;
+            for (blk_idx = 0; blk_idx < MAG_SIZE / 2; blk_idx++)
+            {
+                desc_block_put(pf, descs, mag->blocks[blk_idx]);
+            }
+            lock_release(&mem_pool->lock);
+            for (blk_idx = MAG_SIZE / 2; blk_idx < MAG_SIZE; blk_idx++)
+            {
+                mag->blocks[blk_idx - MAG_SIZE / 2] = mag->blocks[blk_idx];
+            }
+            mag->cnt -= MAG_SIZE / 2;
+        }
+        else
+        {
+            atomic_inc(&alloc_stats.mag_free_hits);
+        }
+        mag->blocks[mag->cnt++] = b;
+    }
+}
+
+/*把pthread各规格magazine中缓存的小块全部还给共享的arena，返回因此整个释放掉的arena页数
+ *magazine不加锁，pthread只能是当前线程或者已经不会再运行的线程；用户进程的块在它自己的用户空间里，只能在它的地址空间中还*/
+uint32_t mag_drain(struct task_struct *pthread)
+{
+    enum pool_flags pf;
+    struct pool *mem_pool;
+    struct mem_block_desc *descs;
+    if (pthread->pgdir == NULL)
+    {
+        pf = PF_KERNEL;
+        mem_pool = &kernel_pool;
+        descs = k_block_descs;
+    }
+    else
+    {
+        ASSERT(pthread == running_thread());
+        pf = PF_USER;
+        mem_pool = &user_pool;
+        descs = pthread->u_block_desc;
+    }
+    uint32_t freed_pages = 0;
+    lock_acquire(&mem_pool->lock);
+    uint8_t desc_idx;
+    for (desc_idx = 0; desc_idx < DESC_CNT; desc_idx++)
+    {
+        struct magazine *mag = &pthread->mags[desc_idx];
+        while (mag->cnt > 0)
+        {
+            if (desc_block_put(pf, descs, mag->blocks[--mag->cnt]))
+            {
+                freed_pages++;
+            }
+        }
+    }
+    lock_release(&mem_pool->lock);
+    return freed_pages;
+}
+
+/*在vaddr处紧接着已有的分配再预留pg_cnt个虚拟页，这段地址空闲时才成功
+ *内核页立即分配物理页并映射，用户页只预留，失败时不留下任何东西
+ *调用者需持有对应内存池的锁*/
+static bool vaddr_extend(enum pool_flags pf, uint32_t vaddr, uint32_t pg_cnt)
+{
+    if (pf == PF_USER)
+    {
+        uint32_t end = vaddr + pg_cnt * PG_SIZE;
+        return end > vaddr && end <= USER_VADDR_END &&
+               vma_insert(&running_thread()->vmas, vaddr, end, VMA_READ | VMA_WRITE);
+    }
+    uint32_t bit_idx = (vaddr - kernel_vaddr.vaddr_start) / PG_SIZE;
+    if (bit_idx + pg_cnt > kernel_vaddr.vaddr_bitmap.btmp_bytes_len * 8)
+    {
+        return false;
+    }
+    uint32_t i;
+    for (i = 0; i < pg_cnt; i++)
+    {
+        if (bitmap_scan_test(&kernel_vaddr.vaddr_bitmap, bit_idx + i))
+        {
+            return false;
+        }
+    }
+    for (i = 0; i < pg_cnt; i++)
+    {
+        void *page_phyaddr = palloc(&kernel_pool);
+        if (page_phyaddr == NULL)
+        {
+            unmap_range((void *)vaddr, i);
+            return false;
+        }
+        page_table_add((void *)(vaddr + i * PG_SIZE), page_phyaddr);
+    }
+    bitmap_set_range(&kernel_vaddr.vaddr_bitmap, bit_idx, pg_cnt);
+    return true;
+}
+
+/*把ptr处的内存调整为size字节，返回调整后的地址，内容保留两者中较小的长度
+ *小块在块内放得下、整页分配缩小或者后面的虚拟页空闲时原地完成，不复制也不会同时占着新旧两份内存
+ *ptr为NULL时等同sys_malloc，size为0时等同sys_free并返回NULL，失败返回NULL且原来的内存不变*/
+void *sys_realloc(void *ptr, uint32_t size)
+{
+    if (ptr == NULL)
+    {
+        return sys_malloc(size);
+    }
+    if (size == 0)
+    {
+        sys_free(ptr);
+        return NULL;
+    }
+    enum pool_flags pf;
+    struct pool *mem_pool;
+    struct mem_block_desc *descs;
+    struct task_struct *cur = running_thread();
+    if (cur->pgdir == NULL)
+    {
+        pf = PF_KERNEL;
+        mem_pool = &kernel_pool;
+        descs = k_block_descs;
+    }
+    else
+    {
+        pf = PF_USER;
+        mem_pool = &user_pool;
+        descs = cur->u_block_desc;
+    }
+    if (size >= mem_pool->pool_size)
+    {
+        return NULL;
+    }
+    struct arena *a = ptr2arena(ptr);
+    uint32_t offset = (uint32_t)ptr - (uint32_t)a; // ptr在arena中的偏移
+    uint32_t old_size;                             // ptr处原来可用的字节数
+    if (!a->large)
+    {
+        old_size = descs[a->desc_idx].block_size;
+        if (size <= old_size)
+        {
+            return ptr;
+        }
+    }
+    else if (pf == PF_KERNEL && (*pde_ptr((uint32_t)a) & PG_PS_1))
+    { // 4MB大页只能在已经占用的大页内原地调整
+        old_size = DIV_ROUND_UP(a->cnt, LARGE_PG_PAGES) * LARGE_PG_SIZE - offset;
+        if (size <= old_size)
+        {
+            return ptr;
+        }
+    }
+    else
+    {
+        old_size = a->cnt * PG_SIZE - offset;
+        uint32_t page_cnt = DIV_ROUND_UP(offset + size, PG_SIZE);
+        lock_acquire(&mem_pool->lock);
+        if (page_cnt < a->cnt)
+        { // 缩小时把尾部多余的页还回去
+            mfree_page(pf, (void *)((uint32_t)a + page_cnt * PG_SIZE), a->cnt - page_cnt);
+            a->cnt = page_cnt;
+        }
+        else if (page_cnt > a->cnt && vaddr_extend(pf, (uint32_t)a + a->cnt * PG_SIZE, page_cnt - a->cnt))
+        { // 后面的虚拟页空闲，直接接在后面
+            a->cnt = page_cnt;
+        }
+        lock_release(&mem_pool->lock);
+        if (page_cnt <= a->cnt)
+        {
+            return ptr;
+        }
+    }
+    // 原地放不下，申请新的内存后搬过去
+    void *new_ptr = sys_malloc(size);
+    if (new_ptr == NULL)
+    {
+        return NULL;
+    }
+    memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+    sys_free(ptr);
+    return new_ptr;
+}
+
+/*申请cnt个size字节的元素并清零，cnt * size溢出时返回NULL
+ *整页分配的内存本来就是零：内核页在sys_malloc中已经清零，用户页在缺页时清零，只有小块需要memset*/
+void *sys_calloc(uint32_t cnt, uint32_t size)
+{
+    if (size != 0 && cnt > 0xffffffff / size)
+    {
+        return NULL;
+    }
+    uint32_t total = cnt * size;
+    void *ptr = sys_malloc(total);
+    if (ptr != NULL && total <= 1024)
+    {
+        memset(ptr, 0, total);
+    }
+    return ptr;
+}
+
+/*申请size字节、起始地址按align对齐的内存，align必须是2的幂，用sys_free释放
+ *align不超过8时和sys_malloc一样；否则按整页分配：
+ *align小于一页时arena头在首页开头，返回首页内第一个对齐的地址；
+ *align不小于一页时返回的地址按页对齐，arena头放在它前面一页，对齐多出来的页立即归还*/
+void *sys_malloc_aligned(uint32_t size, uint32_t align)
+{
+    if (align == 0 || (align & (align - 1)) != 0)
+    {
+        return NULL;
+    }
+    if (align <= 8)
+    {
+        return sys_malloc(size);
+    }
+    enum pool_flags pf;
+    struct pool *mem_pool;
+    if (running_thread()->pgdir == NULL)
+    {
+        pf = PF_KERNEL;
+        mem_pool = &kernel_pool;
+    }
+    else
+    {
+        pf = PF_USER;
+        mem_pool = &user_pool;
+    }
+    if (!(size > 0 && size < mem_pool->pool_size && align < mem_pool->pool_size))
+    {
+        return NULL;
+    }
+    uint32_t head_size = align < PG_SIZE ? (sizeof(struct arena) + align - 1) & ~(align - 1) : PG_SIZE;
+    uint32_t data_cnt = DIV_ROUND_UP(head_size + size, PG_SIZE); // 从arena头开始需要的页数
+    uint32_t slack_cnt = align > PG_SIZE ? align / PG_SIZE - 1 : 0; // 为了对齐多申请的页数
+    lock_acquire(&mem_pool->lock);
+    void *run = malloc_page(pf, data_cnt + slack_cnt);
+    if (run == NULL)
+    {
+        lock_release(&mem_pool->lock);
+        return NULL;
+    }
+    uint32_t ptr = ((uint32_t)run + head_size + align - 1) & ~(align - 1);
+    struct arena *a = (struct arena *)(ptr - head_size);
+    uint32_t lead_cnt = ((uint32_t)a - (uint32_t)run) / PG_SIZE;
+    if (lead_cnt > 0)
+    {
+        mfree_page(pf, run, lead_cnt);
+    }
+    if (slack_cnt > lead_cnt)
+    {
+        mfree_page(pf, (void *)((uint32_t)a + data_cnt * PG_SIZE), slack_cnt - lead_cnt);
+    }
+    lock_release(&mem_pool->lock);
+    if (pf == PF_KERNEL)
+    {
+        memset(a, 0, data_cnt * PG_SIZE); // 和sys_malloc的整页分配一样清零，用户页缺页时已经清零
+    }
+    a->cnt = data_cnt;
+    a->large = true;
+    return (void *)ptr;
+}
+
+/* mmap系统调用，在当前进程中预留len字节的匿名内存，成功返回起始地址，失败返回MAP_FAILED
+ * 只预留vma，不分配物理页，页在第一次访问时由缺页处理分配并清零
+ * 不带MAP_FIXED时忽略addr，从低地址找第一段空隙；带MAP_FIXED时addr必须页对齐且整段空闲 */
+void *sys_mmap(void *addr, uint32_t len, int32_t prot, int32_t flags)
+{
+    struct task_struct *cur = running_thread();
+    // len先和用户空间的大小比较，接近4GB的len按页上取整时会溢出成0
+    if (cur->pgdir == NULL || len == 0 || len > USER_VADDR_END - USER_VADDR_START ||
+        !(flags & MAP_ANONYMOUS) || (prot & ~(PROT_READ | PROT_WRITE)) != 0)
+    {
+        return MAP_FAILED;
+    }
+    uint32_t pg_cnt = DIV_ROUND_UP(len, PG_SIZE);
+    if (pg_cnt == 0)
+    {
+        return MAP_FAILED;
+    }
+    uint32_t vma_flags = (prot & PROT_READ ? VMA_READ : 0) | (prot & PROT_WRITE ? VMA_WRITE : 0);
+    if (!(flags & MAP_FIXED))
+    {
+        uint32_t start = vma_alloc(&cur->vmas, pg_cnt, vma_flags);
+        return start == 0 ? MAP_FAILED : (void *)start;
+    }
+    uint32_t start = (uint32_t)addr;
+    if (start % PG_SIZE != 0 || start < USER_VADDR_START ||
+        pg_cnt > (USER_VADDR_END - start) / PG_SIZE ||
+        !vma_insert(&cur->vmas, start, start + pg_cnt * PG_SIZE, vma_flags))
+    {
+        return MAP_FAILED;
+    }
+    return addr;
+}
+
+/* munmap系统调用，释放[addr, addr + len)中已经分配的物理页并取消预留，成功返回0，失败返回-1
+ * 区间可以只覆盖某个vma的一部分，没有预留过的地址直接忽略 */
+int32_t sys_munmap(void *addr, uint32_t len)
+{
+    struct task_struct *cur = running_thread();
+    uint32_t start = (uint32_t)addr;
+    if (cur->pgdir == NULL || len == 0 || len > USER_VADDR_END - USER_VADDR_START ||
+        start % PG_SIZE != 0 || start < USER_VADDR_START)
+    {
+        return -1;
+    }
+    uint32_t pg_cnt = DIV_ROUND_UP(len, PG_SIZE);
+    if (pg_cnt == 0 || pg_cnt > (USER_VADDR_END - start) / PG_SIZE)
+    {
+        return -1;
+    }
+    // 先取消预留，失败时什么都没改；成功后这段地址不会再缺页进来，可以放心解除映射
+    lock_acquire(&user_pool.lock);
+    if (!vma_remove(&cur->vmas, start, start + pg_cnt * PG_SIZE))
+    {
+        lock_release(&user_pool.lock);
+        return -1;
+    }
+    unmap_range(addr, pg_cnt);
+    lock_release(&user_pool.lock);
+    return 0;
+}
+
+/* brk系统调用，把当前进程堆的结束地址设为addr，返回设置后的结束地址
+ * addr为NULL或者无法设置时不做修改，直接返回当前的结束地址，调用者比较返回值判断成败
+ * 堆扩大时只扩展vma，页在第一次访问时分配；缩小时释放多出来的页 */
+void *sys_brk(void *addr)
+{
+    struct task_struct *cur = running_thread();
+    uint32_t new_brk = (uint32_t)addr;
+    if (cur->pgdir == NULL)
+    {
+        return NULL;
+    }
+    if (new_brk < USER_BRK_START || new_brk > USER_VADDR_END)
+    {
+        return (void *)cur->heap_brk;
+    }
+    uint32_t old_end = DIV_ROUND_UP(cur->heap_brk, PG_SIZE) * PG_SIZE; // 堆实际占用到的页边界
+    uint32_t new_end = DIV_ROUND_UP(new_brk, PG_SIZE) * PG_SIZE;
+    if (new_end > old_end)
+    {
+        // 和堆已有的vma相邻，会直接合并；碰到mmap等已经占用的地址时失败
+        if (!vma_insert(&cur->vmas, old_end, new_end, VMA_READ | VMA_WRITE))
+        {
+            return (void *)cur->heap_brk;
+        }
+    }
+    else if (new_end < old_end)
+    {
+        lock_acquire(&user_pool.lock);
+        if (!vma_remove(&cur->vmas, new_end, old_end))
+        {
+            lock_release(&user_pool.lock);
+            return (void *)cur->heap_brk;
+        }
+        unmap_range((void *)new_end, (old_end - new_end) / PG_SIZE);
+        lock_release(&user_pool.lock);
+    }
+    cur->heap_brk = new_brk;
+    return addr;
+}
+
+/*空闲对象的链表节点：小对象放在步长的末尾，不破坏构造函数初始化好的内容
+ *大对象没有构造函数，节点直接放在对象开头*/
+static struct list_elem *obj2link(struct kmem_cache *cache, void *obj)
+{
+    if (cache->large)
+    {
+        return (struct list_elem *)obj;
+    }
+    return (struct list_elem *)((uint32_t)obj + cache->obj_stride - sizeof(struct list_elem));
+}
+
+/*由链表节点得到空闲对象的地址*/
+static void *link2obj(struct kmem_cache *cache, struct list_elem *link)
+{
+    if (cache->large)
+    {
+        return (void *)link;
+    }
+    return (void *)((uint32_t)link - cache->obj_stride + sizeof(struct list_elem));
+}
+
+/*初始化对象缓存cache，对象大小为size，flags可以是KMEM_CACHE_ALIGN，ctor可以为NULL*/
+void kmem_cache_create(struct kmem_cache *cache, char *name, uint32_t size,
+                       uint32_t flags, void (*ctor)(void *))
+{
+    ASSERT(size > 0 && strlen(name) < KMEM_NAME_LEN);
+    uint32_t align = (flags & KMEM_CACHE_ALIGN) ? CACHE_LINE_SIZE : 4;
+    memset(cache, 0, sizeof(struct kmem_cache));
+    strcpy(cache->name, name);
+    cache->obj_size = size;
+    cache->ctor = ctor;
+    // 步长 = 对象大小(4字节对齐) + 链表节点，再按要求对齐
+    cache->obj_stride = DIV_ROUND_UP(size, 4) * 4 + sizeof(struct list_elem);
+    cache->obj_stride = DIV_ROUND_UP(cache->obj_stride, align) * align;
+    cache->obj_offset = DIV_ROUND_UP(sizeof(struct slab), align) * align;
+    cache->large = cache->obj_stride > (PG_SIZE - cache->obj_offset) / 2;
+    if (cache->large)
+    {
+        // 大对象独占整页，天然按页对齐
+        ASSERT(ctor == NULL);
+        cache->obj_offset = 0;
+        cache->obj_per_slab = 1;
+        cache->pages_per_slab = DIV_ROUND_UP(size, PG_SIZE);
+    }
+    else
+    {
+        cache->obj_per_slab = (PG_SIZE - cache->obj_offset) / cache->obj_stride;
+        cache->pages_per_slab = 1;
+    }
+    list_init(&cache->free_objs);
+    list_init(&cache->slabs);
+    spin_init(&cache->lock);
+    enum intr_status old_status = spin_lock_irqsave(&kmem_caches_lock);
+    list_append(&kmem_caches, &cache->cache_tag);
+    spin_unlock_irqrestore(&kmem_caches_lock, old_status);
+}
+
+/*为cache申请一个新的slab，并把切出的对象放进空闲链表，成功返回true*/
+static bool kmem_cache_grow(struct kmem_cache *cache)
+{
+    lock_acquire(&kernel_pool.lock);
+    void *page = malloc_page(PF_KERNEL, cache->pages_per_slab);
+    lock_release(&kernel_pool.lock);
+    if (page == NULL)
+    {
+        return false;
+    }
+    if (cache->large)
+    {
+        enum intr_status old_status = spin_lock_irqsave(&cache->lock);
+        list_push(&cache->free_objs, obj2link(cache, page));
+        cache->free_cnt++;
+        cache->total_cnt++;
+        spin_unlock_irqrestore(&cache->lock, old_status);
+        return true;
+    }
+
+    struct slab *slab = (struct slab *)page;
+    slab->cache = cache;
+    slab->inuse = 0;
+    uint32_t obj_idx;
+    // 构造函数在开中断的情况下执行，每个对象只执行一次
+    if (cache->ctor != NULL)
+    {
+        for (obj_idx = 0; obj_idx < cache->obj_per_slab; obj_idx++)
+        {
+            cache->ctor((void *)((uint32_t)page + cache->obj_offset + obj_idx * cache->obj_stride));
+        }
+    }
+    enum intr_status old_status = spin_lock_irqsave(&cache->lock);
+    list_append(&cache->slabs, &slab->slab_tag);
+    for (obj_idx = 0; obj_idx < cache->obj_per_slab; obj_idx++)
+    {
+        void *obj = (void *)((uint32_t)page + cache->obj_offset + obj_idx * cache->obj_stride);
+        list_append(&cache->free_objs, obj2link(cache, obj));
+    }
+    cache->free_cnt += cache->obj_per_slab;
+    cache->total_cnt += cache->obj_per_slab;
+    spin_unlock_irqrestore(&cache->lock, old_status);
+    return true;
+}
+
+/*从cache中分配一个对象，空闲链表为空时才会向内核内存池申请新的slab
+ *快速路径只持有cache自己的自旋锁一小段时间，不会碰kernel_pool.lock*/
+void *kmem_cache_alloc(struct kmem_cache *cache)
+{
+    enum intr_status old_status = spin_lock_irqsave(&cache->lock);
+    while (list_empty(&cache->free_objs))
+    {
+        spin_unlock_irqrestore(&cache->lock, old_status);
+        if (!kmem_cache_grow(cache))
+        {
+            return NULL;
+        }
+        old_status = spin_lock_irqsave(&cache->lock);
+    }
+    void *obj = link2obj(cache, list_pop(&cache->free_objs));
+    cache->free_cnt--;
+    if (!cache->large)
+    {
+        ((struct slab *)((uint32_t)obj & 0xfffff000))->inuse++;
+    }
+    spin_unlock_irqrestore(&cache->lock, old_status);
+    return obj;
+}
+
+/*把对象obj还给cache，对象留在cache中等待复用，不会归还给内存池*/
+void kmem_cache_free(struct kmem_cache *cache, void *obj)
+{
+    ASSERT(obj != NULL);
+    enum intr_status old_status = spin_lock_irqsave(&cache->lock);
+    if (!cache->large)
+    {
+        struct slab *slab = (struct slab *)((uint32_t)obj & 0xfffff000);
+        ASSERT(slab->cache == cache && slab->inuse > 0);
+        slab->inuse--;
+    }
+    list_push(&cache->free_objs, obj2link(cache, obj)); // 最近释放的对象最先复用，缓存更热
+    cache->free_cnt++;
+    spin_unlock_irqrestore(&cache->lock, old_status);
+}
+
+/*回收钩子：把cache中完全空闲的slab还给内核内存池，返回释放的页数
+ *持有cache->lock时只把要释放的页摘到本地链表，放锁后再释放，解除映射要通知其他处理器刷新tlb，不能在自旋锁内做*/
+uint32_t kmem_cache_reclaim(struct kmem_cache *cache)
+{
+    uint32_t freed_pages = 0;
+    struct list doomed; // 摘下来等待释放的页，复用页首的链表节点
+    list_init(&doomed);
+    lock_acquire(&kernel_pool.lock);
+    enum intr_status old_status = spin_lock_irqsave(&cache->lock);
+    if (cache->large)
+    {
+        while (!list_empty(&cache->free_objs))
+        {
+            list_append(&doomed, list_pop(&cache->free_objs));
+            cache->free_cnt--;
+            cache->total_cnt--;
+        }
+    }
+    else
+    {
+        struct list_elem *elem = cache->slabs.head.next;
+        while (elem != &cache->slabs.tail)
+        {
+            struct slab *slab = elem2entry(struct slab, slab_tag, elem);
+            elem = elem->next;
+            if (slab->inuse != 0)
+            {
+                continue;
+            }
+            // slab内的对象都在空闲链表上，先把它们摘下来
+            uint32_t obj_idx;
+            for (obj_idx = 0; obj_idx < cache->obj_per_slab; obj_idx++)
+            {
+                void *obj = (void *)((uint32_t)slab + cache->obj_offset + obj_idx * cache->obj_stride);
+                list_remove(obj2link(cache, obj));
+            }
+            list_remove(&slab->slab_tag);
+            cache->free_cnt -= cache->obj_per_slab;
+            cache->total_cnt -= cache->obj_per_slab;
+            list_append(&doomed, &slab->slab_tag);
+        }
+    }
+    spin_unlock_irqrestore(&cache->lock, old_status);
+    while (!list_empty(&doomed))
+    {
+        struct list_elem *elem = list_pop(&doomed);
+        void *page = cache->large ? link2obj(cache, elem) : elem2entry(struct slab, slab_tag, elem);
+        mfree_page(PF_KERNEL, page, cache->pages_per_slab);
+        freed_pages += cache->pages_per_slab;
+    }
+    lock_release(&kernel_pool.lock);
+    return freed_pages;
+}
+
+/*持锁读出kmem_caches中elem的下一个节点
+ *回收时要拿kernel_pool的锁，不能在持有自旋锁时遍历整个链表；cache只增不减，节点本身一直有效*/
+static struct list_elem *kmem_caches_next(struct list_elem *elem)
+{
+    enum intr_status old_status = spin_lock_irqsave(&kmem_caches_lock);
+    struct list_elem *next = elem->next;
+    spin_unlock_irqrestore(&kmem_caches_lock, old_status);
+    return next;
+}
+
+/*回收所有kmem_cache中的空闲slab，返回释放的总页数
+ *当前是内核线程时先清空它的magazine，缓存的块还回去可能凑出整个空闲的arena
+ *用户进程的magazine里是用户空间的块，还回去腾不出内核页，而且要拿用户池的锁，调用者可能已经持有内核池的锁*/
+uint32_t kmem_reclaim(void)
+{
+    uint32_t freed_pages = 0;
+    struct task_struct *cur = running_thread();
+    if (cur->pgdir == NULL)
+    {
+        freed_pages += mag_drain(cur);
+    }
+    struct list_elem *elem = kmem_caches_next(&kmem_caches.head);
+    while (elem != &kmem_caches.tail)
+    {
+        freed_pages += kmem_cache_reclaim(elem2entry(struct kmem_cache, cache_tag, elem));
+        elem = kmem_caches_next(elem);
+    }
+    return freed_pages;
+}
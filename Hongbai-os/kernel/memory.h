@@ -4,6 +4,7 @@
 #include "../lib/stdint.h"
 #include "../lib/kernel/bitmap.h"
 #include "../lib/kernel/list.h"
+#include "../thread/spinlock.h"
 
 /* 内存池标记 */
 enum pool_flags
@@ -18,6 +19,13 @@ enum pool_flags
 #define PG_RW_W 2        // 可读可写可执行
 #define PG_US_S 0        // 内核特权级
 #define PG_US_U (1 << 2) // 用户特权级
+#define PG_A_1 (1 << 5)  // 访问位，cpu访问页时自动置1
+#define PG_PS_1 (1 << 7) // 页目录项直接映射4MB大页，需要开启cr4.PSE
+#define PG_PWT_1 (1 << 3) // 写直通
+#define PG_PCD_1 (1 << 4) // 禁止缓存，映射设备寄存器时和PG_PWT_1一起使用
+#define PG_G_1 (1 << 8)  // 全局页，重新加载cr3时不会被刷出tlb，需要开启cr4.PGE
+#define LARGE_PG_SIZE 0x400000 // 大页大小4MB
+#define LARGE_PG_PAGES 1024    // 一个大页包含的4KB页数
 // 虚拟地址结构体，内部有一个位图结构体，还有一个虚拟地址起始位置
 struct virtual_addr
 {
@@ -31,16 +39,97 @@ struct mem_block
     struct list_elem free_elem;
 };
 
-/*内存块描述符*/
+struct arena;       // 定义在memory.c中
+struct task_struct; // 定义在thread/thread.h中
+
+/*内存块描述符
+ *partial_arenas用以NULL结尾的链表而不是struct list，
+ *因为struct list的头尾节点在pcb里，用户arena指向它们的话fork后子进程会指回父进程的pcb*/
 struct mem_block_desc
 {
-    uint32_t block_size;      // 小内存块大小
-    uint32_t block_per_arena; // 每个arena拥有的小内存块数量
-    struct list free_list;    // 目前空闲的小内存块链表
+    uint32_t block_size;           // 小内存块大小
+    uint32_t block_per_arena;      // 每个arena拥有的小内存块数量
+    struct arena *partial_arenas;  // 还有空闲块的arena链表
 };
 
 #define DESC_CNT 7 // 总共有7种mem_block_desc
+#define MAG_SIZE 8 // 每种规格的magazine最多缓存的小块数
+
+/*线程私有的小块缓存，每个线程每种规格一个
+ *sys_malloc/sys_free优先在这里取放，只有空了或满了才去碰加锁的共享arena*/
+struct magazine
+{
+    uint32_t cnt;                         // 目前缓存的块数
+    struct mem_block *blocks[MAG_SIZE];   // 缓存的块，按栈的方式使用
+};
+
+/*小块分配统计，可以据此算出magazine省掉的加锁次数
+ *各处理器都会更新，计数一律用atomic_inc*/
+struct alloc_stats
+{
+    uint32_t mag_alloc_hits; // sys_malloc直接从magazine拿到块的次数
+    uint32_t mag_free_hits;  // sys_free直接放进magazine的次数
+    uint32_t lock_acquires;  // 小块路径实际加锁的次数
+    uint32_t zero_hits;      // 需要清零的单页申请直接拿到预清零页的次数
+    uint32_t zero_misses;    // 需要清零的单页申请当场memset的次数
+    uint32_t swap_outs;      // 换出到交换分区的页数
+    uint32_t swap_ins;       // 从交换分区读回的页数
+};
+
+#define BUDDY_MAX_ORDER 10 // 伙伴系统的最大阶，最大的块是2^10页=4MB
+
+#define FRAME_BUDDY 0x01    // 页是伙伴系统中某个空闲块的首页，order有效
+#define FRAME_RESERVED 0x02 // 页不归任何内存池管理：低端内存、内核映像、e820报告的空洞
+#define FRAME_ZEROED 0x04   // 页已清零，挂在内存池的预清零链表上
+
+/*物理页框描述符，每个物理页对应一个，在mem_init中按可用内存的范围一次建好
+ *伙伴系统、写时复制以及以后的共享内存、页回收都通过它记录页的状态，不再各自建表*/
+struct frame
+{
+    struct list_elem elem; // 空闲时挂在free_area[order]或预清零链表上，分配出去后归持有者使用
+    uint8_t order;         // 空闲块的阶，只在空闲块首页有效
+    uint8_t flags;         // FRAME_xxx的组合
+    uint16_t ref_cnt;      // 已分配页被多少个页表项引用，为0表示页空闲，fork后父子进程共享用户页时大于1
+    struct pool *pool;     // 页框当前属于哪个内存池，池之间借页时会改变，保留页为NULL
+};
+
+/*内存池的使用情况*/
+struct pool_stat
+{
+    uint32_t owned_pages;  // 池当前拥有的页数，包括已分配和空闲的
+    uint32_t free_pages;   // 池内空闲页数，包括预清零的页
+    uint32_t max_pages;    // 池最多能拥有的页数
+    uint32_t low_wmark;    // 空闲页低于这个数时向另一个池借页，借出页时也不会让自己低于它
+    uint32_t borrowed_in;  // 累计从另一个池借入的页数
+    uint32_t lent_out;     // 累计借给另一个池的页数
+};
+
+#define CACHE_LINE_SIZE 64      // cpu缓存行大小
+#define KMEM_CACHE_ALIGN 1      // kmem_cache标志：对象按缓存行对齐
+#define KMEM_NAME_LEN 16        // kmem_cache名字的最大长度
 
+/*对象缓存，同一类内核对象从这里分配，释放后留在本cache的空闲链表里等待复用
+ *小对象从一页大小的slab中切出，页首是slab头；
+ *大对象(超过半页)每个独占若干页，不再切分*/
+struct kmem_cache
+{
+    char name[KMEM_NAME_LEN];
+    uint32_t obj_size;          // 用户请求的对象大小
+    uint32_t obj_stride;        // 对象在slab内的步长，包含链表节点和对齐填充
+    uint32_t obj_offset;        // slab内第一个对象相对页首的偏移
+    uint32_t obj_per_slab;      // 每个slab的对象数，大对象cache为1
+    uint32_t pages_per_slab;    // 每个slab占用的页数
+    bool large;                 // 是否是大对象cache
+    void (*ctor)(void *obj);    // 可选的构造函数，对象第一次进入cache时调用
+    struct list free_objs;      // 空闲对象链表
+    struct list slabs;          // 小对象cache的所有slab
+    uint32_t free_cnt;          // 空闲对象数
+    uint32_t total_cnt;         // 对象总数
+    struct list_elem cache_tag; // 挂在全局kmem_caches链表上，供回收时遍历
+    struct spinlock lock;       // 保护空闲链表、slab链表和计数
+};
+
+extern struct alloc_stats alloc_stats;                  // 小块分配统计，mag_alloc_hits+mag_free_hits就是省掉的加锁次数
 extern struct pool kernel_pool;                         // 内核内存池
 extern struct pool user_pool;                           // 用户内存池
 uint32_t *pte_ptr(uint32_t vaddr);                      /* 得到虚拟地址vaddr对应的pte的指针 */
@@ -56,6 +145,37 @@ void mem_init(void); // 内存管理初始化
 
 void *sys_malloc(uint32_t size);
 void pfree(uint32_t pg_phy_addr);
+struct frame *phys_to_frame(uint32_t pg_phy_addr); // 由物理地址得到页框描述符，超出描述符数组时返回NULL
+uint32_t frame_to_phys(struct frame *f);          // 由页框描述符得到物理页地址
 void mfree_page(enum pool_flags pf, void *_vaddr, uint32_t pg_cnt);
+bool map_range(void *_vaddr, void *_page_phyaddr, uint32_t pg_cnt); // 把连续的虚拟页映射到连续的物理页，没有页表页时返回false
+#if BENCH
+uint64_t mem_bench_palloc(uint32_t iters, uint32_t batch);              // 测量单页palloc/pfree的总周期数
+void mem_bench_free_pages(void **pages, uint32_t cnt);                   // 释放get_kernel_pages(1)申请的cnt个页
+#endif
+void unmap_range(void *_vaddr, uint32_t pg_cnt);                     // 解除映射并回收物理页，tlb批量刷新
+void *ioremap(uint32_t phy_addr, uint32_t size);                     // 把设备寄存器所在的物理地址以不可缓存的方式映射到内核空间
+void tlb_flush_local(uint32_t vaddr, uint32_t pg_cnt);               // 只刷新当前处理器的tlb
 void sys_free(void *ptr);
+void *sys_realloc(void *ptr, uint32_t size);             // 调整已分配内存的大小，能原地完成时不复制
+void *sys_calloc(uint32_t cnt, uint32_t size);           // 申请cnt个size字节的元素并清零
+void *sys_malloc_aligned(uint32_t size, uint32_t align); // 申请起始地址按align对齐的内存
+void *sys_mmap(void *addr, uint32_t len, int32_t prot, int32_t flags); // mmap系统调用，映射匿名内存
+int32_t sys_munmap(void *addr, uint32_t len);                          // munmap系统调用，解除映射
+void *sys_brk(void *addr);                                             // brk系统调用，移动用户堆的结束地址
+bool page_prezero_one(void); // idle线程调用，预清零一个页
+bool pool_balance(void);     // idle线程调用，给低于水位的池补充空闲页
+void mem_pool_stat(enum pool_flags pf, struct pool_stat *st); // 读取内存池的使用情况
+
+void *malloc_large_page(uint32_t cnt);              /* 申请cnt个4MB大页，返回内核虚拟地址 */
+void mfree_large_page(void *_vaddr, uint32_t cnt);   /* 释放malloc_large_page申请的大页 */
+bool user_pgdir_share(uint32_t *child_pgdir); /* fork时让子进程以写时复制的方式共享当前进程的用户页 */
+
+void kmem_cache_create(struct kmem_cache *cache, char *name, uint32_t size,
+                       uint32_t flags, void (*ctor)(void *)); /* 初始化一个对象缓存 */
+void *kmem_cache_alloc(struct kmem_cache *cache);             /* 从cache中分配一个对象 */
+void kmem_cache_free(struct kmem_cache *cache, void *obj);    /* 把对象还给cache */
+uint32_t kmem_cache_reclaim(struct kmem_cache *cache);        /* 释放cache中完全空闲的slab，返回释放的页数 */
+uint32_t kmem_reclaim(void);                                  /* 回收所有cache中的空闲slab */
+uint32_t mag_drain(struct task_struct *pthread);              /* 把线程magazine缓存的小块全部还回arena */
 #endif
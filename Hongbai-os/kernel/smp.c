@@ -0,0 +1,351 @@
+// 多处理器的启动：按MP表找到其他处理器，用INIT-SIPI把它们带进保护模式和分页，再进入各自的idle线程
+#include "./smp.h"
+#include "./global.h"
+#include "./memory.h"
+#include "./debug.h"
+#include "./interrupt.h"
+#include "../lib/string.h"
+#include "../lib/kernel/print.h"
+#include "../device/lapic.h"
+#include "../device/timer.h"
+#include "../userprog/tss.h"
+
+#define PG_SIZE 4096
+#define KERNEL_VADDR_BASE 0xc0000000 // 低端4MB物理内存映射在这里
+#define KERNEL_PGDIR_PHY 0x100000    // 内核页目录表的物理地址，AP开启分页时使用
+#define AP_BOOT_ADDR 0x90000         // AP启动代码所在的物理地址，必须4KB对齐且在1MB以内
+#define AP_BOOT_TIMEOUT 100          // 等待一个AP上线的最长毫秒数
+
+#define BDA_EBDA_SEG 0x40e  // BIOS数据区中扩展BIOS数据区的段地址
+#define BDA_BASE_MEM 0x413  // BIOS数据区中以KB为单位的常规内存大小
+#define BIOS_ROM_START 0xf0000
+#define BIOS_ROM_END 0x100000
+
+#define MP_ENTRY_PROCESSOR 0         // MP配置表中的处理器表项，长20字节，其他表项都是8字节
+#define MP_PROC_ENABLED (1 << 0)     // 处理器可用
+#define MP_PROC_BSP (1 << 1)         // 引导处理器
+
+/* MP浮动指针结构，16字节对齐，位于EBDA的第1KB、常规内存的最后1KB或者BIOS ROM中 */
+struct mp_fp
+{
+    char signature[4]; // "_MP_"
+    uint32_t config;   // MP配置表的物理地址
+    uint8_t length;    // 以16字节为单位的长度
+    uint8_t version;
+    uint8_t checksum;  // 所有字节相加为0
+    uint8_t feature[5];
+} __attribute__((packed));
+
+/* MP配置表头，后面紧跟entry_cnt个表项 */
+struct mp_config
+{
+    char signature[4]; // "PCMP"
+    uint16_t length;   // 包括表头在内的长度
+    uint8_t version;
+    uint8_t checksum;
+    char oem_id[8];
+    char product_id[12];
+    uint32_t oem_table;
+    uint16_t oem_table_size;
+    uint16_t entry_cnt;
+    uint32_t lapic_addr;
+    uint16_t ext_length;
+    uint8_t ext_checksum;
+    uint8_t reserved;
+} __attribute__((packed));
+
+/* 处理器表项 */
+struct mp_proc
+{
+    uint8_t type; // MP_ENTRY_PROCESSOR
+    uint8_t apic_id;
+    uint8_t apic_version;
+    uint8_t flags;
+    uint32_t signature;
+    uint32_t feature;
+    uint32_t reserved[2];
+} __attribute__((packed));
+
+/*AP启动代码的参数，位于apboot.S中，随代码一起拷贝到AP_BOOT_ADDR
+ *AP在保护模式下用它开启分页、切换到自己的idle线程栈，再跳到entry，字段顺序不能改*/
+struct ap_boot_params
+{
+    uint32_t stack; // 栈顶，即idle线程pcb所在页的末尾
+    uint32_t entry; // 开启分页后跳转的地址
+    uint32_t cr3;
+    uint32_t cr4;
+    uint32_t cpu; // 逻辑编号，作为entry的参数
+    uint32_t cr0; // 连同PE、PG位一起照抄引导处理器
+} __attribute__((packed));
+
+extern char ap_boot_start[], ap_boot_end[]; // apboot.S中的启动代码
+extern struct ap_boot_params ap_boot_params;
+
+struct cpu cpus[NR_CPUS];
+uint32_t cpu_cnt;
+
+/*tlb同步请求，同一时刻只有一个处理器在发，由shootdown_lock保护
+ *发起者等所有目标把shootdown_acks减到0才返回*/
+static struct spinlock shootdown_lock;
+static volatile uint32_t shootdown_vaddr;
+static volatile uint32_t shootdown_cnt;
+static volatile uint32_t shootdown_acks;
+
+/* 低端4MB内的物理地址在内核中的虚拟地址 */
+static inline void *phy_to_kvaddr(uint32_t phy_addr)
+{
+    return (void *)(KERNEL_VADDR_BASE + phy_addr);
+}
+
+/* len个字节相加的和，为0说明校验通过 */
+static uint8_t mp_checksum(const uint8_t *p, uint32_t len)
+{
+    uint8_t sum = 0;
+    while (len--)
+    {
+        sum += *p++;
+    }
+    return sum;
+}
+
+/* 在物理地址[start, start+len)中按16字节对齐查找MP浮动指针 */
+static struct mp_fp *mp_search_range(uint32_t start, uint32_t len)
+{
+    uint8_t *p = phy_to_kvaddr(start);
+    uint8_t *end = p + len;
+    for (; p + sizeof(struct mp_fp) <= end; p += 16)
+    {
+        if (memcmp(p, "_MP_", 4) == 0 && mp_checksum(p, sizeof(struct mp_fp)) == 0)
+        {
+            return (struct mp_fp *)p;
+        }
+    }
+    return NULL;
+}
+
+/* 按MP规范的顺序查找浮动指针：EBDA的第1KB、常规内存的最后1KB、BIOS ROM */
+static struct mp_fp *mp_search(void)
+{
+    struct mp_fp *fp;
+    uint32_t ebda = (uint32_t)*(uint16_t *)phy_to_kvaddr(BDA_EBDA_SEG) << 4;
+    if (ebda != 0 && (fp = mp_search_range(ebda, 1024)) != NULL)
+    {
+        return fp;
+    }
+    uint32_t base_mem = (uint32_t)*(uint16_t *)phy_to_kvaddr(BDA_BASE_MEM) * 1024;
+    if (base_mem >= 1024 && (fp = mp_search_range(base_mem - 1024, 1024)) != NULL)
+    {
+        return fp;
+    }
+    return mp_search_range(BIOS_ROM_START, BIOS_ROM_END - BIOS_ROM_START);
+}
+
+/*解析MP配置表，把可用的AP依次放到cpus[1]开始的位置，引导处理器已经是cpus[0]
+ *没有MP表或者表不在低端4MB的，按单处理器运行*/
+static void mp_parse(void)
+{
+    struct mp_fp *fp = mp_search();
+    if (fp == NULL || fp->config == 0 || fp->config >= 0x400000)
+    {
+        return;
+    }
+    struct mp_config *conf = phy_to_kvaddr(fp->config);
+    if (memcmp(conf->signature, "PCMP", 4) != 0 || mp_checksum((uint8_t *)conf, conf->length) != 0)
+    {
+        return;
+    }
+    uint8_t *p = (uint8_t *)(conf + 1);
+    uint8_t *end = (uint8_t *)conf + conf->length;
+    uint32_t i;
+    for (i = 0; i < conf->entry_cnt && p < end; i++)
+    {
+        if (*p != MP_ENTRY_PROCESSOR)
+        {
+            p += 8;
+            continue;
+        }
+        struct mp_proc *proc = (struct mp_proc *)p;
+        p += sizeof(struct mp_proc);
+        if (!(proc->flags & MP_PROC_ENABLED) || (proc->flags & MP_PROC_BSP) || proc->apic_id == cpus[0].apic_id)
+        {
+            continue;
+        }
+        if (cpu_cnt == NR_CPUS)
+        {
+            break;
+        }
+        cpus[cpu_cnt++].apic_id = proc->apic_id;
+    }
+}
+
+/* 处理本处理器上挂着的tlb同步请求 */
+static void tlb_shootdown_service(struct cpu *c)
+{
+    if (atomic_xchg(&c->tlb_pending, 0))
+    {
+        tlb_flush_local(shootdown_vaddr, shootdown_cnt);
+        atomic_dec(&shootdown_acks);
+    }
+}
+
+/*让其他在线处理器的tlb中[vaddr, vaddr+pg_cnt页)失效，等它们都刷新完才返回
+ *等待期间是关中断的，目标处理器如果正关着中断等一把这里持有的自旋锁就会死锁，所以不能在持有自旋锁时调用
+ *两个处理器同时发起时，抢不到锁的一方边等边处理发给自己的请求*/
+void tlb_shootdown(uint32_t vaddr, uint32_t pg_cnt)
+{
+    if (cpu_cnt == 1)
+    {
+        return;
+    }
+    enum intr_status old_status = intr_disable();
+    struct cpu *self = this_cpu();
+    while (!spin_trylock(&shootdown_lock))
+    {
+        tlb_shootdown_service(self);
+        cpu_relax();
+    }
+    uint32_t targets = 0;
+    uint32_t i;
+    for (i = 0; i < cpu_cnt; i++)
+    {
+        if (&cpus[i] != self && cpus[i].online)
+        {
+            targets++;
+        }
+    }
+    if (targets != 0)
+    {
+        shootdown_vaddr = vaddr;
+        shootdown_cnt = pg_cnt;
+        shootdown_acks = targets;
+        for (i = 0; i < cpu_cnt; i++)
+        {
+            struct cpu *c = &cpus[i];
+            if (c != self && c->online)
+            {
+                c->tlb_pending = 1;
+                lapic_send_ipi(c->apic_id, IPI_TLB_VECTOR);
+            }
+        }
+        while (shootdown_acks != 0)
+        {
+            cpu_relax();
+        }
+    }
+    spin_unlock(&shootdown_lock);
+    intr_set_status(old_status);
+}
+
+/* tlb同步的处理器间中断 */
+static void intr_tlb_handler(void)
+{
+    lapic_eoi();
+    tlb_shootdown_service(this_cpu());
+}
+
+/*重新调度的处理器间中断，其他处理器往本处理器的就绪队列放了级别更高的线程，或者要叫醒停机的idle
+ *只需要把处理器从hlt中叫醒，idle醒来后会自己让出*/
+static void intr_resched_handler(void)
+{
+    lapic_eoi();
+    if (this_cpu()->need_resched)
+    {
+        schedule();
+    }
+}
+
+/*AP开启分页后的入口，运行在自己的idle线程栈上
+ *换上自己的gdt、tss和共用的idt，启动本地APIC定时器后就成了一个普通的idle线程*/
+static void ap_main(uint32_t cpu_id)
+{
+    struct cpu *c = &cpus[cpu_id];
+    tss_ap_init(cpu_id);
+    idt_load();
+    lapic_init(false);
+    lapic_timer_start();
+    c->online = true;
+    intr_enable();
+    cpu_idle();
+}
+
+/* 用INIT-SIPI-SIPI启动一个AP，返回它是否上线 */
+static bool ap_start(struct cpu *c)
+{
+    struct ap_boot_params *params =
+        phy_to_kvaddr(AP_BOOT_ADDR + ((uint32_t)&ap_boot_params - (uint32_t)ap_boot_start));
+    struct task_struct *pcb = kmem_cache_alloc(&pcb_cache);
+    if (pcb == NULL)
+    {
+        return false;
+    }
+    char name[16] = "idle";
+    name[4] = '0' + c->id;
+    idle_thread_setup(c, pcb, name, true);
+    uint32_t cr0, cr4;
+    asm volatile("movl %%cr0, %0" : "=r"(cr0));
+    asm volatile("movl %%cr4, %0" : "=r"(cr4));
+    params->stack = (uint32_t)pcb + PG_SIZE;
+    params->entry = (uint32_t)ap_main;
+    params->cr3 = KERNEL_PGDIR_PHY;
+    params->cr4 = cr4;
+    params->cpu = c->id;
+    params->cr0 = cr0;
+
+    lapic_send_init(c->apic_id);
+    mtime_sleep(10);
+    lapic_send_sipi(c->apic_id, AP_BOOT_ADDR >> 12);
+    mtime_sleep(10);
+    if (!c->online)
+    { // 按规范发第二次SIPI，已经在运行启动代码的AP会忽略它
+        lapic_send_sipi(c->apic_id, AP_BOOT_ADDR >> 12);
+    }
+    uint32_t waited = 0;
+    while (!c->online && waited < AP_BOOT_TIMEOUT)
+    {
+        mtime_sleep(10);
+        waited += 10;
+    }
+    return c->online;
+}
+
+/*启动其他处理器，在main中开中断之后调用，此时PIT已经在走，可以用来校准本地APIC定时器和等待AP
+ *AP一个一个地启动，共用同一份启动代码和参数*/
+void smp_init(void)
+{
+    put_str("smp_init start\n");
+    if (!lapic_detect())
+    {
+        put_str("  no local apic, running on one cpu\n");
+        return;
+    }
+    lapic_init(true);
+    cpus[0].apic_id = lapic_id();
+    lapic_timer_calibrate();
+    spin_init(&shootdown_lock);
+    register_handler(IPI_RESCHED_VECTOR, intr_resched_handler);
+    register_handler(IPI_TLB_VECTOR, intr_tlb_handler);
+
+    mp_parse();
+    if (cpu_cnt > 1)
+    {
+        // 启动代码在开启分页后仍要执行几条指令，依赖loader建立的低端1MB的恒等映射
+        ASSERT(((uint32_t *)phy_to_kvaddr(KERNEL_PGDIR_PHY))[0] & PG_P_1);
+        memcpy(phy_to_kvaddr(AP_BOOT_ADDR), ap_boot_start, ap_boot_end - ap_boot_start);
+    }
+    uint32_t online = 1;
+    uint32_t i;
+    for (i = 1; i < cpu_cnt; i++)
+    {
+        if (!ap_start(&cpus[i]))
+        { // 超时的AP可能还会晚些读启动参数，不再启动后面的，免得它们共用参数
+            put_str("  cpu failed to start, apic id ");
+            put_int(cpus[i].apic_id);
+            put_str("\n");
+            break;
+        }
+        online++;
+    }
+    put_str("  cpus online: ");
+    put_int(online);
+    put_str("\nsmp_init done\n");
+}
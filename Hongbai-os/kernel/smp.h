@@ -0,0 +1,37 @@
+// 多处理器支持：每个处理器的私有数据、AP的启动和处理器之间的tlb同步
+#ifndef __KERNEL_SMP_H
+#define __KERNEL_SMP_H
+#include "../lib/stdint.h"
+#include "../thread/thread.h"
+
+#define NR_CPUS 8 // 最多支持的处理器数
+
+/*每个处理器的私有数据，cpus[0]是引导处理器BSP
+ *线程的pcb记着它所在的处理器，running_thread()->cpu就是当前处理器*/
+struct cpu
+{
+    uint8_t id;                    // 逻辑编号，也是cpus数组的下标
+    uint8_t apic_id;               // 本地APIC的id，发送处理器间中断时使用
+    volatile bool online;          // 已经启动并开始调度
+    volatile bool need_resched;    // 有级别更高的线程就绪，下一次中断返回前切换
+    volatile uint32_t tlb_pending; // 有其他处理器请求刷新tlb还没处理
+    struct run_queue rq;           // 本处理器的就绪队列
+    struct task_struct *idle;      // 本处理器的idle线程，不进就绪队列
+    struct task_struct *curr;      // 正在运行的线程，由rq.lock保护
+    struct task_struct *prev;      // 刚被切换下去的线程，由切换后的线程完成收尾
+    struct task_struct *migrate;   // 被换下后不允许留在本处理器的线程，由schedule_tail放到别的处理器上
+    uint32_t *loaded_pgdir;        // cr3中当前加载的页目录表，NULL代表内核页目录表或者需要重新加载
+};
+
+extern struct cpu cpus[NR_CPUS]; // 所有处理器
+extern uint32_t cpu_cnt;         // 发现的处理器数
+
+/* 当前处理器，调用者需关中断，否则可能被迁移到别的处理器上 */
+static inline struct cpu *this_cpu(void)
+{
+    return running_thread()->cpu;
+}
+
+void smp_init(void);                                 // 启动其他处理器，在开中断之后调用
+void tlb_shootdown(uint32_t vaddr, uint32_t pg_cnt); // 让其他处理器的tlb中这段地址失效，不能在持有自旋锁时调用
+#endif
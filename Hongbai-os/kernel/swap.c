@@ -0,0 +1,118 @@
+// 实现swap.h中的函数
+// 槽的分配和引用计数都由调用者持有用户内存池的锁来保证互斥
+#include "swap.h"
+#include "memory.h"
+#include "debug.h"
+#include "global.h"
+#include "../device/ide.h"
+#include "../fs/fs.h"
+#include "../lib/stdio.h"
+#include "../lib/string.h"
+
+#define SECTS_PER_SLOT (PG_SIZE / SECTOR_SIZE) // 一个槽占用的扇区数
+#define SWAP_SLOT_MAX (1 << 20)                // 页表项高20位能表示的槽数
+
+/*交换区，每个槽存放一个换出的页*/
+struct swap_area
+{
+    struct partition *part; // 使用的交换分区，没有找到时为NULL
+    uint32_t slot_cnt;      // 槽的个数
+    uint32_t free_cnt;      // 空闲槽的个数
+    uint32_t hint;          // 下次从这个槽开始找空闲槽
+    uint16_t *slot_ref;     // 每个槽被多少个页表项引用，为0表示空闲
+};
+static struct swap_area swap_area;
+
+/* 在分区链表中找第一个交换分区，找到后停止遍历 */
+static bool swap_part_find(struct list_elem *pelem, int arg)
+{
+    (void)arg;
+    struct partition *part = elem2entry(struct partition, part_tag, pelem);
+    if (part->fs_type == PART_TYPE_SWAP && part->sec_cnt >= SECTS_PER_SLOT)
+    {
+        swap_area.part = part;
+        return true;
+    }
+    return false;
+}
+
+/* 查找交换分区并建立槽的引用计数表，没有交换分区时换出功能不启用 */
+void swap_init(void)
+{
+    printk("swap_init start\n");
+    swap_area.part = NULL;
+    swap_area.slot_cnt = 0;
+    swap_area.free_cnt = 0;
+    swap_area.hint = 0;
+    list_traversal(&partition_list, swap_part_find, 0);
+    if (swap_area.part == NULL)
+    {
+        printk("    no swap partition\n");
+        return;
+    }
+    uint32_t slot_cnt = swap_area.part->sec_cnt / SECTS_PER_SLOT;
+    slot_cnt = slot_cnt < SWAP_SLOT_MAX ? slot_cnt : SWAP_SLOT_MAX;
+    swap_area.slot_ref = sys_malloc(slot_cnt * sizeof(uint16_t));
+    if (swap_area.slot_ref == NULL)
+    {
+        PANIC("swap_init: alloc memory failed!");
+    }
+    memset(swap_area.slot_ref, 0, slot_cnt * sizeof(uint16_t));
+    swap_area.slot_cnt = slot_cnt;
+    swap_area.free_cnt = slot_cnt;
+    printk("    %s: %d slots\n", swap_area.part->name, slot_cnt);
+    printk("swap_init done\n");
+}
+
+/* 申请一个空闲槽，引用计数置为1，成功返回槽号，失败返回SWAP_SLOT_NONE */
+int32_t swap_slot_alloc(void)
+{
+    if (swap_area.free_cnt == 0)
+    {
+        return SWAP_SLOT_NONE;
+    }
+    uint32_t slot = swap_area.hint;
+    while (swap_area.slot_ref[slot] != 0)
+    { // 还有空闲槽，一定能找到
+        slot = slot + 1 < swap_area.slot_cnt ? slot + 1 : 0;
+    }
+    swap_area.slot_ref[slot] = 1;
+    swap_area.free_cnt--;
+    swap_area.hint = slot + 1 < swap_area.slot_cnt ? slot + 1 : 0;
+    return slot;
+}
+
+/* fork时子进程的页表项也指向这个槽，引用计数加1 */
+void swap_slot_dup(uint32_t slot)
+{
+    ASSERT(slot < swap_area.slot_cnt && swap_area.slot_ref[slot] > 0);
+    swap_area.slot_ref[slot]++;
+}
+
+/* 引用计数减1，减到0时槽变为空闲 */
+void swap_slot_free(uint32_t slot)
+{
+    ASSERT(slot < swap_area.slot_cnt);
+    if (swap_area.slot_ref[slot] == 0)
+    {
+        PANIC("swap_slot_free: slot is not allocated");
+    }
+    if (--swap_area.slot_ref[slot] == 0)
+    {
+        swap_area.free_cnt++;
+    }
+}
+
+/* 把buf处的一页数据写入槽slot */
+void swap_write(uint32_t slot, void *buf)
+{
+    ASSERT(slot < swap_area.slot_cnt);
+    ide_write(swap_area.part->my_disk, swap_area.part->start_lba + slot * SECTS_PER_SLOT, buf, SECTS_PER_SLOT);
+}
+
+/* 从槽slot读出一页数据到buf */
+void swap_read(uint32_t slot, void *buf)
+{
+    ASSERT(slot < swap_area.slot_cnt);
+    ide_read(swap_area.part->my_disk, swap_area.part->start_lba + slot * SECTS_PER_SLOT, buf, SECTS_PER_SLOT);
+}
@@ -0,0 +1,15 @@
+// 交换分区管理，换出的用户页按页大小的槽存放在分区表类型为0x82的分区中
+#ifndef __KERNEL_SWAP_H
+#define __KERNEL_SWAP_H
+#include "../lib/stdint.h"
+
+#define PG_SWAP (1 << 9) // 页表项的AVL位，P位为0时表示页已换出，高20位是交换槽号
+#define SWAP_SLOT_NONE (-1) // 没有空闲槽或没有交换分区
+
+void swap_init(void);                    // 查找交换分区并建立槽的引用计数表
+int32_t swap_slot_alloc(void);           // 申请一个空闲槽，引用计数为1
+void swap_slot_dup(uint32_t slot);       // fork时子进程共享槽，引用计数加1
+void swap_slot_free(uint32_t slot);      // 引用计数减1，减到0时槽空闲
+void swap_write(uint32_t slot, void *buf); // 把一页数据写入槽
+void swap_read(uint32_t slot, void *buf);  // 从槽读出一页数据
+#endif
@@ -0,0 +1,210 @@
+// 实现vma.h中的函数
+#include "vma.h"
+#include "memory.h"
+#include "debug.h"
+#include "global.h"
+#include "../userprog/process.h"
+
+#define node2vma(n) (elem2entry(struct vma, node, n)) // 由红黑树节点得到vma
+
+static struct kmem_cache vma_cache; // vma对象缓存
+
+/* 初始化vma对象缓存 */
+void vma_init(void)
+{
+    kmem_cache_create(&vma_cache, "vma", sizeof(struct vma), 0, NULL);
+}
+
+/* 初始化一棵空的vma树 */
+void vma_tree_init(struct vma_tree *tree)
+{
+    tree->root.node = NULL;
+    tree->vma_cnt = 0;
+}
+
+/* 返回第一个end大于vaddr的vma，也就是包含vaddr的vma或者vaddr之后的第一个vma，没有则返回NULL */
+static struct vma *vma_find_next(struct vma_tree *tree, uint32_t vaddr)
+{
+    struct rb_node *node = tree->root.node;
+    struct vma *found = NULL;
+    while (node != NULL)
+    {
+        struct vma *v = node2vma(node);
+        if (vaddr < v->end)
+        {
+            found = v;
+            node = node->left;
+        }
+        else
+        {
+            node = node->right;
+        }
+    }
+    return found;
+}
+
+/* 返回包含vaddr的vma，vaddr没有被预留时返回NULL */
+struct vma *vma_find(struct vma_tree *tree, uint32_t vaddr)
+{
+    struct vma *v = vma_find_next(tree, vaddr);
+    return (v != NULL && v->start <= vaddr) ? v : NULL;
+}
+
+/* 新建一个vma并按start挂到树上，失败返回NULL */
+static struct vma *vma_link(struct vma_tree *tree, uint32_t start, uint32_t end, uint32_t flags)
+{
+    struct vma *v = kmem_cache_alloc(&vma_cache);
+    if (v == NULL)
+    {
+        return NULL;
+    }
+    v->start = start;
+    v->end = end;
+    v->flags = flags;
+    struct rb_node **link = &tree->root.node, *parent = NULL;
+    while (*link != NULL)
+    {
+        parent = *link;
+        link = start < node2vma(parent)->start ? &parent->left : &parent->right;
+    }
+    rb_link_node(&v->node, parent, link);
+    rb_insert_color(&v->node, &tree->root);
+    tree->vma_cnt++;
+    return v;
+}
+
+/* 把v从树上摘下并释放 */
+static void vma_unlink(struct vma_tree *tree, struct vma *v)
+{
+    rb_erase(&v->node, &tree->root);
+    tree->vma_cnt--;
+    kmem_cache_free(&vma_cache, v);
+}
+
+/* 预留[start, end)，和已有的区间重叠或者内存不足时返回false
+ * 和前后相邻且权限相同的vma直接合并，区间都是连续申请时树只有几个节点 */
+bool vma_insert(struct vma_tree *tree, uint32_t start, uint32_t end, uint32_t flags)
+{
+    ASSERT(start < end && start % PG_SIZE == 0 && end % PG_SIZE == 0);
+    struct vma *next = vma_find_next(tree, start);
+    if (next != NULL && next->start < end)
+    {
+        return false;
+    }
+    struct rb_node *prev_node = next != NULL ? rb_prev(&next->node) : NULL;
+    if (next == NULL && tree->root.node != NULL)
+    { // start在所有vma之后，前一个就是最大的vma
+        prev_node = tree->root.node;
+        while (prev_node->right != NULL)
+        {
+            prev_node = prev_node->right;
+        }
+    }
+    struct vma *prev = prev_node != NULL ? node2vma(prev_node) : NULL;
+    if (prev != NULL && prev->end == start && prev->flags == flags)
+    {
+        prev->end = end;
+        if (next != NULL && next->start == end && next->flags == flags)
+        { // 正好填上两个vma之间的空隙
+            prev->end = next->end;
+            vma_unlink(tree, next);
+        }
+        return true;
+    }
+    if (next != NULL && next->start == end && next->flags == flags)
+    { // 区间之间不重叠，向前扩展不会改变顺序
+        next->start = start;
+        return true;
+    }
+    return vma_link(tree, start, end, flags) != NULL;
+}
+
+/* 从低地址开始找第一段能放下pg_cnt页的空隙并预留，成功返回起始地址，失败返回0
+ * 只遍历vma而不是逐页扫描，耗时和区间个数有关 */
+uint32_t vma_alloc(struct vma_tree *tree, uint32_t pg_cnt, uint32_t flags)
+{
+    if (pg_cnt == 0 || pg_cnt > (USER_VADDR_END - USER_VADDR_START) / PG_SIZE)
+    {
+        return 0;
+    }
+    uint32_t size = pg_cnt * PG_SIZE;
+    uint32_t addr = USER_VADDR_START;
+    struct vma *v = vma_find_next(tree, addr);
+    while (v != NULL && v->start < addr + size)
+    {
+        if (v->end > addr)
+        {
+            addr = v->end;
+        }
+        struct rb_node *node = rb_next(&v->node);
+        v = node != NULL ? node2vma(node) : NULL;
+    }
+    if (addr + size > USER_VADDR_END || addr + size < addr)
+    {
+        return 0;
+    }
+    return vma_insert(tree, addr, addr + size, flags) ? addr : 0;
+}
+
+/* 取消[start, end)的预留，只覆盖了一部分的vma会被截短，跨过整个区间的vma被一分为二
+ * 拆分需要的vma在改动之前申请，申请不到时返回false，树保持原样 */
+bool vma_remove(struct vma_tree *tree, uint32_t start, uint32_t end)
+{
+    struct vma *v = vma_find_next(tree, start);
+    if (v != NULL && v->start < start && v->end > end)
+    { // 跨过整个区间的vma只可能有这一个，先挂上后一半再截短前一半
+        if (vma_link(tree, end, v->end, v->flags) == NULL)
+        {
+            return false;
+        }
+        v->end = start;
+        return true;
+    }
+    while (v != NULL && v->start < end)
+    {
+        struct rb_node *node = rb_next(&v->node);
+        struct vma *next = node != NULL ? node2vma(node) : NULL;
+        if (v->start >= start && v->end <= end)
+        {
+            vma_unlink(tree, v);
+        }
+        else if (v->start < start)
+        {
+            v->end = start;
+        }
+        else
+        {
+            v->start = end;
+        }
+        v = next;
+    }
+    return true;
+}
+
+/* 把src中的vma逐个复制到空树dst，失败时dst保持为空，返回false */
+bool vma_tree_copy(struct vma_tree *dst, struct vma_tree *src)
+{
+    vma_tree_init(dst);
+    struct rb_node *node = rb_first(&src->root);
+    while (node != NULL)
+    {
+        struct vma *v = node2vma(node);
+        if (vma_link(dst, v->start, v->end, v->flags) == NULL)
+        {
+            vma_tree_destroy(dst);
+            return false;
+        }
+        node = rb_next(node);
+    }
+    return true;
+}
+
+/* 释放树中所有vma */
+void vma_tree_destroy(struct vma_tree *tree)
+{
+    struct rb_node *node;
+    while ((node = tree->root.node) != NULL)
+    {
+        vma_unlink(tree, node2vma(node));
+    }
+}
@@ -0,0 +1,37 @@
+// 用户进程虚拟地址空间的区间管理
+// 每个已预留的区间[start, end)是一个vma，按起始地址挂在红黑树上
+#ifndef __KERNEL_VMA_H
+#define __KERNEL_VMA_H
+#include "../lib/stdint.h"
+#include "../lib/kernel/rbtree.h"
+
+#define VMA_READ 1  // 区间可读
+#define VMA_WRITE 2 // 区间可写
+
+#define USER_VADDR_END 0xc0000000 // 用户虚拟地址的上界，内核空间从这里开始
+
+/*一段已预留的用户虚拟地址，相邻且权限相同的区间会合并*/
+struct vma
+{
+    struct rb_node node; // 挂在vma_tree上，按start排序
+    uint32_t start;      // 起始地址，页对齐
+    uint32_t end;        // 结束地址(不含)，页对齐
+    uint32_t flags;      // VMA_READ、VMA_WRITE的组合
+};
+
+/*一个进程的全部vma，区间之间互不重叠*/
+struct vma_tree
+{
+    struct rb_root root; // 红黑树根
+    uint32_t vma_cnt;    // vma个数
+};
+
+void vma_init(void);                                                               // 初始化vma对象缓存
+void vma_tree_init(struct vma_tree *tree);                                         // 初始化一棵空的vma树
+struct vma *vma_find(struct vma_tree *tree, uint32_t vaddr);                       // 查找包含vaddr的vma
+bool vma_insert(struct vma_tree *tree, uint32_t start, uint32_t end, uint32_t flags); // 预留[start, end)
+uint32_t vma_alloc(struct vma_tree *tree, uint32_t pg_cnt, uint32_t flags);        // 找一段空闲的虚拟地址并预留
+bool vma_remove(struct vma_tree *tree, uint32_t start, uint32_t end);              // 取消[start, end)的预留
+bool vma_tree_copy(struct vma_tree *dst, struct vma_tree *src);                    // fork时复制vma树
+void vma_tree_destroy(struct vma_tree *tree);                                      // 释放树中所有vma
+#endif
@@ -4,11 +4,81 @@
 #include "../string.h"
 #include "./stdint.h"
 
+/* 位图按32位字处理，位bit_idx位于第bit_idx/32个字的第bit_idx%32位
+ * 小端序下这和按字节的排列方式完全一致，硬盘上的inode、块位图格式不受影响 */
+
+/* 位图一共有多少个字，最后一个字可能不完整 */
+static uint32_t bitmap_word_cnt(struct bitmap *btmp)
+{
+    return DIV_ROUND_UP(btmp->btmp_bytes_len, 4);
+}
+
+/* 读取位图的第word_idx个字，位图末尾不足一个字的部分当作已占用的1 */
+static uint32_t bitmap_word(struct bitmap *btmp, uint32_t word_idx)
+{
+    uint32_t byte_idx = word_idx * 4;
+    if (byte_idx + 4 <= btmp->btmp_bytes_len)
+    {
+        return *(uint32_t *)(btmp->btmp_bits + byte_idx);
+    }
+    uint32_t word = 0xffffffff;
+    uint32_t i;
+    for (i = 0; byte_idx + i < btmp->btmp_bytes_len; i++)
+    {
+        word &= ~(0xffu << (i * 8));
+        word |= (uint32_t)btmp->btmp_bits[byte_idx + i] << (i * 8);
+    }
+    return word;
+}
+
+/* 从from位开始找第一个0，找到返回下标，否则返回-1 */
+static int32_t bitmap_find_zero(struct bitmap *btmp, uint32_t from)
+{
+    uint32_t bit_len = btmp->btmp_bytes_len * 8;
+    if (from >= bit_len)
+    {
+        return -1;
+    }
+    uint32_t word_idx = from / BITS_PER_WORD;
+    uint32_t word_cnt = bitmap_word_cnt(btmp);
+    // 第一个字要屏蔽掉from之前的位
+    uint32_t free_bits = ~bitmap_word(btmp, word_idx) & (0xffffffff << (from % BITS_PER_WORD));
+    while (free_bits == 0)
+    {
+        if (++word_idx == word_cnt)
+        {
+            return -1;
+        }
+        free_bits = ~bitmap_word(btmp, word_idx);
+    }
+    uint32_t bit_idx = word_idx * BITS_PER_WORD + bit_scan_forward(free_bits);
+    return bit_idx < bit_len ? (int32_t)bit_idx : -1;
+}
+
+/* 在[from, limit)内找第一个1，找到返回下标，否则返回limit */
+static uint32_t bitmap_find_one(struct bitmap *btmp, uint32_t from, uint32_t limit)
+{
+    uint32_t word_idx = from / BITS_PER_WORD;
+    uint32_t used_bits = bitmap_word(btmp, word_idx) & (0xffffffff << (from % BITS_PER_WORD));
+    while (used_bits == 0)
+    {
+        word_idx++;
+        if (word_idx * BITS_PER_WORD >= limit)
+        {
+            return limit;
+        }
+        used_bits = bitmap_word(btmp, word_idx);
+    }
+    uint32_t bit_idx = word_idx * BITS_PER_WORD + bit_scan_forward(used_bits);
+    return bit_idx < limit ? bit_idx : limit;
+}
+
 /* 将位图bitmap初始化为0 */
 void bitmap_init(struct bitmap *btmp)
 {
     ASSERT(btmp != NULL);
     memset(btmp->btmp_bits, 0, btmp->btmp_bytes_len);
+    btmp->hint = 0;
 }
 
 /* 判断bit_idx位是否是1,为1返回true，否则返回false */
@@ -21,58 +91,62 @@ bool bitmap_scan_test(struct bitmap *btmp, uint32_t bit_idx)
     return (btmp->btmp_bits[byte_idx] & (BITMAP_MASK << bit_odd)) != 0;
 }
 
-/* 在位图中申请连续的cnt个位，若成功，返回起始下标，失败返回-1 */
+/* 在位图中申请连续的cnt个位，若成功，返回起始下标，失败返回-1
+ * 从hint开始按字扫描，整字为0xffffffff时一次跳过32位 */
 int bitmap_scan(struct bitmap *btmp, uint32_t cnt)
 {
     ASSERT(btmp != NULL);
-    uint32_t idx_byte = 0; // 字节索引
-    // 先找到对应的字节，如果这个字节的值是0xff，说明这个字节的所有位都被占用
-    // 如果这个字节的值不是0xff，说明这个字节中有空闲位
-    while ((idx_byte < btmp->btmp_bytes_len) && (btmp->btmp_bits[idx_byte] == 0xff))
-    {
-        idx_byte++;
-    }
-    ASSERT(idx_byte < btmp->btmp_bytes_len);
-    // 如果idx_byte == btmp->btmp_bytes_len，说明没有找到空闲位
-    if (idx_byte == btmp->btmp_bytes_len)
+    ASSERT(cnt > 0);
+    int32_t bit_idx_start = bitmap_find_zero(btmp, btmp->hint);
+    if (bit_idx_start == -1)
     {
         return -1; // 没有找到空闲位
     }
-    // 如果idx_byte < btmp->btmp_bytes_len，说明找到了空闲位
-    // 找到空闲位后，找到这个字节中第一个空闲位
-    int idx_bit = 0;
-    while ((idx_bit < 8) && ((btmp->btmp_bits[idx_byte] & (BITMAP_MASK << idx_bit)) != 0))
-    {
-        idx_bit++;
-    }
-    int bit_idx_start = idx_byte * 8 + idx_bit; // 起始位索引
-    if (cnt == 1)
+    // hint之后的第一个空闲位就是整个位图的第一个空闲位，顺便更新hint
+    btmp->hint = bit_idx_start;
+    uint32_t bit_len = btmp->btmp_bytes_len * 8;
+    while ((uint32_t)bit_idx_start + cnt <= bit_len)
     {
-        return bit_idx_start;
+        // 看[start, start+cnt)里有没有已占用的位
+        uint32_t limit = bit_idx_start + cnt;
+        uint32_t used = bitmap_find_one(btmp, bit_idx_start, limit);
+        if (used == limit)
+        {
+            return bit_idx_start;
+        }
+        // 有，则从这个已占用位之后的下一个空闲位重新开始
+        bit_idx_start = bitmap_find_zero(btmp, used + 1);
+        if (bit_idx_start == -1)
+        {
+            return -1;
+        }
     }
-    uint32_t bit_left = (btmp->btmp_bytes_len * 8 - bit_idx_start); // 剩余位数
-    uint32_t next_bit = bit_idx_start + 1;
-    uint32_t count = 1; // 计数器
+    return -1;
+}
 
-    bit_idx_start = -1; // 初始化为-1
-    while (bit_left-- > 0)
+/* 在位图中申请连续的cnt个位，起始下标必须是align的整数倍，若成功，返回起始下标，失败返回-1 */
+int bitmap_scan_aligned(struct bitmap *btmp, uint32_t cnt, uint32_t align)
+{
+    ASSERT(btmp != NULL);
+    ASSERT(cnt > 0 && align > 0);
+    uint32_t bit_len = btmp->btmp_bytes_len * 8;
+    int32_t free_idx = bitmap_find_zero(btmp, btmp->hint);
+    while (free_idx != -1)
     {
-        if (bitmap_scan_test(btmp, next_bit) == 0)
+        // 从空闲位往后取第一个对齐的位置
+        uint32_t start = DIV_ROUND_UP((uint32_t)free_idx, align) * align;
+        if (start + cnt > bit_len)
         {
-            count++;
+            return -1;
         }
-        else
+        uint32_t used = bitmap_find_one(btmp, start, start + cnt);
+        if (used == start + cnt)
         {
-            count = 0; // 重置计数器
+            return start;
         }
-        if (count == cnt)
-        {
-            bit_idx_start = next_bit - cnt + 1; // 起始位索引
-            break;
-        }
-        next_bit++;
+        free_idx = bitmap_find_zero(btmp, used + 1);
     }
-    return bit_idx_start; // 返回起始位索引
+    return -1;
 }
 
 /* 将位图的bit_idx位设置为value */
@@ -90,5 +164,50 @@ void bitmap_set(struct bitmap *btmp, uint32_t bit_idx, int8_t value)
     else
     {
         btmp->btmp_bits[byte_idx] &= ~(BITMAP_MASK << bit_odd); // 设置为0
+        if (bit_idx < btmp->hint)
+        {
+            btmp->hint = bit_idx;
+        }
+    }
+}
+
+/* 将bit_idx开始的cnt个位设置为value，中间的整字一次写入 */
+static void bitmap_fill_range(struct bitmap *btmp, uint32_t bit_idx, uint32_t cnt, int8_t value)
+{
+    ASSERT(btmp != NULL);
+    ASSERT(bit_idx + cnt <= btmp->btmp_bytes_len * 8);
+    uint32_t end = bit_idx + cnt;
+    // 头部：逐位处理到字对齐
+    while (bit_idx < end && bit_idx % BITS_PER_WORD != 0)
+    {
+        bitmap_set(btmp, bit_idx++, value);
+    }
+    // 中间：整字写入
+    uint32_t fill = value ? 0xffffffff : 0;
+    while (end - bit_idx >= BITS_PER_WORD)
+    {
+        *(uint32_t *)(btmp->btmp_bits + bit_idx / 8) = fill;
+        bit_idx += BITS_PER_WORD;
     }
-}
\ No newline at end of file
+    // 尾部：剩下不足一个字的位
+    while (bit_idx < end)
+    {
+        bitmap_set(btmp, bit_idx++, value);
+    }
+}
+
+/* 将bit_idx开始的cnt个位置1 */
+void bitmap_set_range(struct bitmap *btmp, uint32_t bit_idx, uint32_t cnt)
+{
+    bitmap_fill_range(btmp, bit_idx, cnt, 1);
+}
+
+/* 将bit_idx开始的cnt个位清0 */
+void bitmap_clear_range(struct bitmap *btmp, uint32_t bit_idx, uint32_t cnt)
+{
+    bitmap_fill_range(btmp, bit_idx, cnt, 0);
+    if (cnt > 0 && bit_idx < btmp->hint)
+    {
+        btmp->hint = bit_idx;
+    }
+}
@@ -5,16 +5,29 @@
 #include "./stdint.h"
 
 #define BITMAP_MASK 1
+#define BITS_PER_WORD 32 // 位图按32位字扫描
+
+/* 返回v中最低的1所在的位，v不能为0 */
+static inline uint32_t bit_scan_forward(uint32_t v)
+{
+    uint32_t idx;
+    asm("bsfl %1, %0" : "=r"(idx) : "rm"(v));
+    return idx;
+}
 
 struct bitmap //0代表不可以使用，1代表可以使用
 {
     uint32_t btmp_bytes_len; // 位图的长度
     /*关于位图指针，遍历位图时，整体以字节为单位，细节上以位为单位，所以位图指针还是从单字节类型*/
     uint8_t *btmp_bits; // 位图的起始字节指针
+    uint32_t hint;      // 提示游标，保证此位之前没有空闲位，扫描从这里开始
 };
 
 void bitmap_init(struct bitmap *btmp);                                // 初始化位图为0
 bool bitmap_scan_test(struct bitmap *btmp, uint32_t bit_idx);         // 测试位图的某一位是0还是1
 int bitmap_scan(struct bitmap *btmp, uint32_t cnt);                   // 申请连续的cnt个位
+int bitmap_scan_aligned(struct bitmap *btmp, uint32_t cnt, uint32_t align); // 申请连续的cnt个位，起始下标按align对齐
 void bitmap_set(struct bitmap *btmp, uint32_t bit_idx, int8_t value); // 设置位图的某一位为0或1
+void bitmap_set_range(struct bitmap *btmp, uint32_t bit_idx, uint32_t cnt);   // 将bit_idx开始的cnt个位置1
+void bitmap_clear_range(struct bitmap *btmp, uint32_t bit_idx, uint32_t cnt); // 将bit_idx开始的cnt个位清0
 #endif
\ No newline at end of file
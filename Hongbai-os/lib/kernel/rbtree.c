@@ -0,0 +1,326 @@
+#include "./rbtree.h"
+
+/* 以node为轴左旋，node的右孩子顶替node的位置 */
+static void rb_rotate_left(struct rb_node *node, struct rb_root *root)
+{
+    struct rb_node *right = node->right;
+    node->right = right->left;
+    if (right->left != NULL)
+    {
+        right->left->parent = node;
+    }
+    right->parent = node->parent;
+    if (node->parent == NULL)
+    {
+        root->node = right;
+    }
+    else if (node == node->parent->left)
+    {
+        node->parent->left = right;
+    }
+    else
+    {
+        node->parent->right = right;
+    }
+    right->left = node;
+    node->parent = right;
+}
+
+/* 以node为轴右旋，node的左孩子顶替node的位置 */
+static void rb_rotate_right(struct rb_node *node, struct rb_root *root)
+{
+    struct rb_node *left = node->left;
+    node->left = left->right;
+    if (left->right != NULL)
+    {
+        left->right->parent = node;
+    }
+    left->parent = node->parent;
+    if (node->parent == NULL)
+    {
+        root->node = left;
+    }
+    else if (node == node->parent->right)
+    {
+        node->parent->right = left;
+    }
+    else
+    {
+        node->parent->left = left;
+    }
+    left->right = node;
+    node->parent = left;
+}
+
+/* 新插入的红色节点node可能和父节点同为红色，逐层向上修正 */
+void rb_insert_color(struct rb_node *node, struct rb_root *root)
+{
+    struct rb_node *parent, *gparent, *uncle;
+    while ((parent = node->parent) != NULL && parent->color == RB_RED)
+    {
+        gparent = parent->parent; // 父节点是红色，一定不是根，祖父节点一定存在
+        if (parent == gparent->left)
+        {
+            uncle = gparent->right;
+            if (uncle != NULL && uncle->color == RB_RED)
+            { // 叔叔也是红色，父叔变黑，祖父变红，问题上移到祖父
+                parent->color = uncle->color = RB_BLACK;
+                gparent->color = RB_RED;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->right)
+            { // 先转成外侧的情况
+                rb_rotate_left(parent, root);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->color = RB_BLACK;
+            gparent->color = RB_RED;
+            rb_rotate_right(gparent, root);
+        }
+        else
+        {
+            uncle = gparent->left;
+            if (uncle != NULL && uncle->color == RB_RED)
+            {
+                parent->color = uncle->color = RB_BLACK;
+                gparent->color = RB_RED;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->left)
+            {
+                rb_rotate_right(parent, root);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->color = RB_BLACK;
+            gparent->color = RB_RED;
+            rb_rotate_left(gparent, root);
+        }
+    }
+    root->node->color = RB_BLACK;
+}
+
+/* 删除一个黑色节点后，经过node(可能为NULL)的路径少了一个黑色节点，逐层向上修正
+ * node为NULL时没法通过它找父节点，所以单独传入parent */
+static void rb_erase_color(struct rb_node *node, struct rb_node *parent, struct rb_root *root)
+{
+    struct rb_node *other; // node的兄弟
+    while ((node == NULL || node->color == RB_BLACK) && node != root->node)
+    {
+        if (parent->left == node)
+        {
+            other = parent->right;
+            if (other->color == RB_RED)
+            { // 兄弟是红色，转成兄弟是黑色的情况
+                other->color = RB_BLACK;
+                parent->color = RB_RED;
+                rb_rotate_left(parent, root);
+                other = parent->right;
+            }
+            if ((other->left == NULL || other->left->color == RB_BLACK) &&
+                (other->right == NULL || other->right->color == RB_BLACK))
+            { // 兄弟的孩子都是黑色，兄弟变红，问题上移到父节点
+                other->color = RB_RED;
+                node = parent;
+                parent = node->parent;
+            }
+            else
+            {
+                if (other->right == NULL || other->right->color == RB_BLACK)
+                { // 先让兄弟外侧的孩子是红色
+                    other->left->color = RB_BLACK;
+                    other->color = RB_RED;
+                    rb_rotate_right(other, root);
+                    other = parent->right;
+                }
+                other->color = parent->color;
+                parent->color = RB_BLACK;
+                other->right->color = RB_BLACK;
+                rb_rotate_left(parent, root);
+                node = root->node;
+                break;
+            }
+        }
+        else
+        {
+            other = parent->left;
+            if (other->color == RB_RED)
+            {
+                other->color = RB_BLACK;
+                parent->color = RB_RED;
+                rb_rotate_right(parent, root);
+                other = parent->left;
+            }
+            if ((other->left == NULL || other->left->color == RB_BLACK) &&
+                (other->right == NULL || other->right->color == RB_BLACK))
+            {
+                other->color = RB_RED;
+                node = parent;
+                parent = node->parent;
+            }
+            else
+            {
+                if (other->left == NULL || other->left->color == RB_BLACK)
+                {
+                    other->right->color = RB_BLACK;
+                    other->color = RB_RED;
+                    rb_rotate_left(other, root);
+                    other = parent->left;
+                }
+                other->color = parent->color;
+                parent->color = RB_BLACK;
+                other->left->color = RB_BLACK;
+                rb_rotate_right(parent, root);
+                node = root->node;
+                break;
+            }
+        }
+    }
+    if (node != NULL)
+    {
+        node->color = RB_BLACK;
+    }
+}
+
+/* 从树中删除node
+ * node有两个孩子时，用它的后继顶替它的位置，这样宿主结构体不用互相拷贝 */
+void rb_erase(struct rb_node *node, struct rb_root *root)
+{
+    struct rb_node *child, *parent;
+    uint8_t color;
+    if (node->left == NULL)
+    {
+        child = node->right;
+    }
+    else if (node->right == NULL)
+    {
+        child = node->left;
+    }
+    else
+    {
+        struct rb_node *old = node;
+        // 后继是右子树中最小的节点，它没有左孩子
+        node = node->right;
+        while (node->left != NULL)
+        {
+            node = node->left;
+        }
+        if (old->parent == NULL)
+        {
+            root->node = node;
+        }
+        else if (old->parent->left == old)
+        {
+            old->parent->left = node;
+        }
+        else
+        {
+            old->parent->right = node;
+        }
+        child = node->right;
+        parent = node->parent;
+        color = node->color; // 实际从原位置消失的是后继的颜色
+        if (parent == old)
+        {
+            parent = node;
+        }
+        else
+        {
+            if (child != NULL)
+            {
+                child->parent = parent;
+            }
+            parent->left = child;
+            node->right = old->right;
+            old->right->parent = node;
+        }
+        node->parent = old->parent;
+        node->color = old->color;
+        node->left = old->left;
+        old->left->parent = node;
+        if (color == RB_BLACK)
+        {
+            rb_erase_color(child, parent, root);
+        }
+        return;
+    }
+    parent = node->parent;
+    color = node->color;
+    if (child != NULL)
+    {
+        child->parent = parent;
+    }
+    if (parent == NULL)
+    {
+        root->node = child;
+    }
+    else if (parent->left == node)
+    {
+        parent->left = child;
+    }
+    else
+    {
+        parent->right = child;
+    }
+    if (color == RB_BLACK)
+    {
+        rb_erase_color(child, parent, root);
+    }
+}
+
+/* 返回树中最小的节点，空树返回NULL */
+struct rb_node *rb_first(struct rb_root *root)
+{
+    struct rb_node *node = root->node;
+    if (node == NULL)
+    {
+        return NULL;
+    }
+    while (node->left != NULL)
+    {
+        node = node->left;
+    }
+    return node;
+}
+
+/* 返回node的中序后继，node是最大的节点时返回NULL */
+struct rb_node *rb_next(struct rb_node *node)
+{
+    if (node->right != NULL)
+    { // 右子树中最小的节点
+        node = node->right;
+        while (node->left != NULL)
+        {
+            node = node->left;
+        }
+        return node;
+    }
+    // 否则向上找第一个从左边上来的祖先
+    while (node->parent != NULL && node == node->parent->right)
+    {
+        node = node->parent;
+    }
+    return node->parent;
+}
+
+/* 返回node的中序前驱，node是最小的节点时返回NULL */
+struct rb_node *rb_prev(struct rb_node *node)
+{
+    if (node->left != NULL)
+    {
+        node = node->left;
+        while (node->right != NULL)
+        {
+            node = node->right;
+        }
+        return node;
+    }
+    while (node->parent != NULL && node == node->parent->left)
+    {
+        node = node->parent;
+    }
+    return node->parent;
+}
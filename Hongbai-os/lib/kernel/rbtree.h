@@ -0,0 +1,41 @@
+// 这个头文件定义了红黑树的节点和操作
+// 和list_elem一样，rb_node嵌入到宿主结构体中，用elem2entry取回宿主
+// 树只负责平衡，按什么排序由调用者查找插入位置时决定
+#ifndef __LIB_KERNEL_RBTREE_H
+#define __LIB_KERNEL_RBTREE_H
+#include "./stdint.h"
+
+#define RB_RED 0
+#define RB_BLACK 1
+
+/* 红黑树节点 */
+struct rb_node
+{
+    struct rb_node *parent; // 父节点，根节点为NULL
+    struct rb_node *left;   // 左子树，都比本节点小
+    struct rb_node *right;  // 右子树，都比本节点大
+    uint8_t color;          // RB_RED或RB_BLACK
+};
+
+/* 红黑树 */
+struct rb_root
+{
+    struct rb_node *node; // 根节点，空树为NULL
+};
+
+/* 把node挂到parent下面link指向的空位上，link是&parent->left或&parent->right，空树时是&root->node
+ * 挂上之后还要调用rb_insert_color恢复平衡 */
+static inline void rb_link_node(struct rb_node *node, struct rb_node *parent, struct rb_node **link)
+{
+    node->parent = parent;
+    node->left = node->right = NULL;
+    node->color = RB_RED;
+    *link = node;
+}
+
+void rb_insert_color(struct rb_node *node, struct rb_root *root); // 插入node后恢复红黑树性质
+void rb_erase(struct rb_node *node, struct rb_root *root);        // 从树中删除node
+struct rb_node *rb_first(struct rb_root *root);                   // 最小的节点
+struct rb_node *rb_next(struct rb_node *node);                    // 中序遍历的后继
+struct rb_node *rb_prev(struct rb_node *node);                    // 中序遍历的前驱
+#endif
@@ -0,0 +1,324 @@
+// 用户态的堆内存分配器
+// 本文件的代码在用户进程里运行，所有状态都放在进程自己的堆里：
+// 内核映像被所有进程共享，这里的全局变量不属于任何一个进程，所以不能使用
+// 小块释放后先缓存在按大小分类的bins里，再次申请同样大小时直接取出；
+// 其余空闲块用边界标记和相邻的空闲块合并，只有堆顶不够用时才通过brk陷入内核
+#include "./malloc.h"
+#include "./syscall.h"
+#include "../string.h"
+
+#define HEAP_MAGIC 0x48454150 // 堆状态已初始化的标记
+#define CHUNK_INUSE 1         // 块已分配，缓存在bins里的块也算已分配，不参与合并
+#define CHUNK_SIZE_MASK (~7u) // 块大小按8字节对齐，低3位用作标志
+#define CHUNK_HDR_SIZE 8      // 块头部prev_size和size的大小
+#define MIN_CHUNK 16          // 最小的块，空闲时要放得下两个链表指针
+#define SMALL_MAX 256         // 不超过这个大小的块释放时先放进bins
+#define BIN_CNT (SMALL_MAX / 8 + 1)
+#define BIN_LIMIT 64          // 每个bin最多缓存的块数，超过的按普通块释放
+#define HEAP_GROW 0x10000     // 堆一次至少扩大64KB，减少陷入内核的次数
+#define HEAP_TRIM 0x40000     // 堆顶空闲超过256KB时把多出来的还给内核
+#define HEAP_MAX_REQ 0x7fff0000 // 单次申请的上限，避免计算块大小时溢出
+
+/*堆中的内存块，头部之后是交给用户的内存*/
+struct chunk
+{
+    uint32_t prev_size; // 前一个块的大小，堆中第一个块为0
+    uint32_t size;      // 本块大小，包括头部，低位是标志
+    // 以下两个指针只在块空闲时有效，占用的是用户内存的位置
+    struct chunk *next; // 空闲链表或bins中的下一个块
+    struct chunk *prev; // 空闲链表中的上一个块，bins是单向链表不使用
+};
+
+/*分配器的状态，放在堆的第一页，由内核在创建进程时预留*/
+struct heap_state
+{
+    uint32_t magic;               // HEAP_MAGIC表示已经初始化
+    uint32_t brk;                 // 堆当前的结束地址，和内核中记录的一致
+    uint32_t top;                 // [top, brk)是还没有切成块的堆顶
+    uint32_t last_size;           // 紧挨着堆顶的那个块的大小，没有块时为0
+    struct chunk *free_list;      // 已经合并过的空闲块
+    struct chunk *bins[BIN_CNT];  // 小块缓存，下标是块大小/8
+    uint32_t bin_cnt[BIN_CNT];    // 每个bin缓存的块数
+};
+
+/* 返回堆状态，第一次使用时初始化，这一页是缺页时内核清零过的 */
+static struct heap_state *heap_get(void)
+{
+    struct heap_state *h = (struct heap_state *)USER_HEAP_BASE;
+    if (h->magic != HEAP_MAGIC)
+    {
+        h->brk = h->top = (uint32_t)sbrk(0);
+        h->last_size = 0;
+        h->magic = HEAP_MAGIC;
+    }
+    return h;
+}
+
+/* 块的大小，去掉标志位 */
+static inline uint32_t chunk_size(struct chunk *c)
+{
+    return c->size & CHUNK_SIZE_MASK;
+}
+
+/* 块c后面紧挨着的块 */
+static inline struct chunk *chunk_next(struct chunk *c)
+{
+    return (struct chunk *)((uint32_t)c + chunk_size(c));
+}
+
+/* 把块c的大小设为size，并更新后面那个块记录的prev_size */
+static void chunk_set_size(struct heap_state *h, struct chunk *c, uint32_t size, uint32_t flags)
+{
+    c->size = size | flags;
+    uint32_t next = (uint32_t)c + size;
+    if (next == h->top)
+    {
+        h->last_size = size;
+    }
+    else
+    {
+        ((struct chunk *)next)->prev_size = size;
+    }
+}
+
+/* 把空闲块c挂到空闲链表头 */
+static void free_list_push(struct heap_state *h, struct chunk *c)
+{
+    c->prev = NULL;
+    c->next = h->free_list;
+    if (h->free_list != NULL)
+    {
+        h->free_list->prev = c;
+    }
+    h->free_list = c;
+}
+
+/* 把空闲块c从空闲链表上摘下 */
+static void free_list_remove(struct heap_state *h, struct chunk *c)
+{
+    if (c->prev != NULL)
+    {
+        c->prev->next = c->next;
+    }
+    else
+    {
+        h->free_list = c->next;
+    }
+    if (c->next != NULL)
+    {
+        c->next->prev = c->prev;
+    }
+}
+
+/* 堆顶至少再扩大need字节，先按HEAP_GROW多要一些，失败时再只要need字节 */
+static bool heap_grow(struct heap_state *h, uint32_t need)
+{
+    uint32_t grow = (need + HEAP_GROW - 1) & ~(HEAP_GROW - 1);
+    if (brk((void *)(h->brk + grow)) == 0)
+    {
+        h->brk += grow;
+        return true;
+    }
+    if (brk((void *)(h->brk + need)) == 0)
+    {
+        h->brk += need;
+        return true;
+    }
+    return false;
+}
+
+/* 堆顶空闲太多时缩小堆，保留HEAP_GROW字节给后面的申请 */
+static void heap_trim(struct heap_state *h)
+{
+    if (h->brk - h->top <= HEAP_TRIM)
+    {
+        return;
+    }
+    uint32_t new_brk = h->top + HEAP_GROW;
+    if (brk((void *)new_brk) == 0)
+    {
+        h->brk = new_brk;
+    }
+}
+
+/* 申请size字节需要的块大小，size不能超过HEAP_MAX_REQ */
+static uint32_t request2size(uint32_t size)
+{
+    uint32_t csize = (size + CHUNK_HDR_SIZE + 7) & CHUNK_SIZE_MASK;
+    return csize < MIN_CHUNK ? MIN_CHUNK : csize;
+}
+
+/* 申请size字节的内存，成功返回8字节对齐的地址，失败返回NULL */
+void *malloc(uint32_t size)
+{
+    if (size == 0 || size > HEAP_MAX_REQ)
+    {
+        return NULL;
+    }
+    struct heap_state *h = heap_get();
+    uint32_t csize = request2size(size);
+    struct chunk *c;
+    // 1.小块先看缓存
+    if (csize <= SMALL_MAX && h->bins[csize / 8] != NULL)
+    {
+        c = h->bins[csize / 8];
+        h->bins[csize / 8] = c->next;
+        h->bin_cnt[csize / 8]--;
+        return (void *)((uint32_t)c + CHUNK_HDR_SIZE);
+    }
+    // 2.在空闲链表中找第一个够大的块，多出来的部分切下来放回去
+    for (c = h->free_list; c != NULL; c = c->next)
+    {
+        if (chunk_size(c) < csize)
+        {
+            continue;
+        }
+        free_list_remove(h, c);
+        uint32_t rest = chunk_size(c) - csize;
+        if (rest >= MIN_CHUNK)
+        {
+            chunk_set_size(h, c, csize, CHUNK_INUSE);
+            struct chunk *r = chunk_next(c);
+            chunk_set_size(h, r, rest, 0);
+            free_list_push(h, r);
+        }
+        else
+        {
+            c->size |= CHUNK_INUSE;
+        }
+        return (void *)((uint32_t)c + CHUNK_HDR_SIZE);
+    }
+    // 3.从堆顶切，堆顶不够时扩大堆，只有这一步会陷入内核
+    if (h->brk - h->top < csize && !heap_grow(h, csize - (h->brk - h->top)))
+    {
+        return NULL;
+    }
+    c = (struct chunk *)h->top;
+    c->prev_size = h->last_size;
+    h->top += csize;
+    chunk_set_size(h, c, csize, CHUNK_INUSE);
+    return (void *)((uint32_t)c + CHUNK_HDR_SIZE);
+}
+
+/* 释放malloc申请的内存，ptr为NULL时什么也不做 */
+void free(void *ptr)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+    struct heap_state *h = heap_get();
+    struct chunk *c = (struct chunk *)((uint32_t)ptr - CHUNK_HDR_SIZE);
+    uint32_t size = chunk_size(c);
+    // 1.小块放进缓存，保持已分配的状态
+    if (size <= SMALL_MAX && h->bin_cnt[size / 8] < BIN_LIMIT)
+    {
+        c->next = h->bins[size / 8];
+        h->bins[size / 8] = c;
+        h->bin_cnt[size / 8]++;
+        return;
+    }
+    // 2.和后面的空闲块合并
+    struct chunk *next = chunk_next(c);
+    if ((uint32_t)next != h->top && !(next->size & CHUNK_INUSE))
+    {
+        free_list_remove(h, next);
+        size += chunk_size(next);
+    }
+    // 3.和前面的空闲块合并
+    if (c->prev_size != 0)
+    {
+        struct chunk *prev = (struct chunk *)((uint32_t)c - c->prev_size);
+        if (!(prev->size & CHUNK_INUSE))
+        {
+            free_list_remove(h, prev);
+            size += chunk_size(prev);
+            c = prev;
+        }
+    }
+    // 4.紧挨着堆顶就并入堆顶，否则挂到空闲链表
+    if ((uint32_t)c + size == h->top)
+    {
+        h->top = (uint32_t)c;
+        h->last_size = c->prev_size;
+        heap_trim(h);
+        return;
+    }
+    chunk_set_size(h, c, size, 0);
+    free_list_push(h, c);
+}
+
+/* 把ptr处的内存调整为size字节，返回调整后的地址，内容保留两者中较小的长度
+ * 后面紧挨着堆顶或者空闲块时原地扩大，缩小时把多出来的部分切下来释放，都不需要复制
+ * ptr为NULL时等同malloc，size为0时等同free并返回NULL，失败返回NULL且原来的内存不变 */
+void *realloc(void *ptr, uint32_t size)
+{
+    if (ptr == NULL)
+    {
+        return malloc(size);
+    }
+    if (size == 0)
+    {
+        free(ptr);
+        return NULL;
+    }
+    if (size > HEAP_MAX_REQ)
+    {
+        return NULL;
+    }
+    struct heap_state *h = heap_get();
+    struct chunk *c = (struct chunk *)((uint32_t)ptr - CHUNK_HDR_SIZE);
+    uint32_t csize = request2size(size);
+    uint32_t old = chunk_size(c);
+    // 1.缩小，多出来的部分够一个块时切下来按普通块释放
+    if (csize <= old)
+    {
+        if (old - csize >= MIN_CHUNK)
+        {
+            chunk_set_size(h, c, csize, CHUNK_INUSE);
+            struct chunk *r = chunk_next(c);
+            chunk_set_size(h, r, old - csize, CHUNK_INUSE);
+            free((void *)((uint32_t)r + CHUNK_HDR_SIZE));
+        }
+        return ptr;
+    }
+    // 2.后面是堆顶，把堆顶并进来，不够时扩大堆
+    struct chunk *next = chunk_next(c);
+    if ((uint32_t)next == h->top)
+    {
+        uint32_t need = csize - old;
+        if (h->brk - h->top >= need || heap_grow(h, need - (h->brk - h->top)))
+        {
+            h->top = (uint32_t)c + csize;
+            chunk_set_size(h, c, csize, CHUNK_INUSE);
+            return ptr;
+        }
+    }
+    // 3.后面是足够大的空闲块，合并后把多余的部分切回空闲链表
+    else if (!(next->size & CHUNK_INUSE) && old + chunk_size(next) >= csize)
+    {
+        uint32_t total = old + chunk_size(next);
+        free_list_remove(h, next);
+        if (total - csize >= MIN_CHUNK)
+        {
+            chunk_set_size(h, c, csize, CHUNK_INUSE);
+            struct chunk *r = chunk_next(c);
+            chunk_set_size(h, r, total - csize, 0);
+            free_list_push(h, r);
+        }
+        else
+        {
+            chunk_set_size(h, c, total, CHUNK_INUSE);
+        }
+        return ptr;
+    }
+    // 4.原地放不下，申请新块后搬过去
+    void *new_ptr = malloc(size);
+    if (new_ptr == NULL)
+    {
+        return NULL;
+    }
+    memcpy(new_ptr, ptr, old - CHUNK_HDR_SIZE);
+    free(ptr);
+    return new_ptr;
+}
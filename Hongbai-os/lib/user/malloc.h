@@ -0,0 +1,9 @@
+// 用户进程调用本文件，用户态的堆内存分配器
+#ifndef __LIB_USER_MALLOC_H
+#define __LIB_USER_MALLOC_H
+#include "../stdint.h"
+
+void *malloc(uint32_t size); // 申请size字节，失败返回NULL
+void free(void *ptr);        // 释放malloc申请的内存
+void *realloc(void *ptr, uint32_t size); // 调整已申请内存的大小，能原地完成时不复制
+#endif
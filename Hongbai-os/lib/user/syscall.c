@@ -1,7 +1,7 @@
 #include "./syscall.h"
 
-/*从上到下，分别是0、1、2、3参数的系统调用，结构基本一致
- *eax是子程序号，剩下三个存在ebx、ecx、edx中*/
+/*从上到下，分别是0、1、2、3、4参数的系统调用，结构基本一致
+ *eax是子程序号，剩下四个存在ebx、ecx、edx、esi中*/
 
 /*({ ... })是gcc扩展
  *将一组语句封装为一个表达式，返回最后一个语句的值*/
@@ -45,6 +45,16 @@
     retval;                                            \
 })
 
+#define _syscall4(NUMBER, ARG1, ARG2, ARG3, ARG4) ({              \
+    int retval;                                                   \
+    asm volatile(                                                 \
+        "int $0x80"                                               \
+        : "=a"(retval)                                            \
+        : "a"(NUMBER), "b"(ARG1), "c"(ARG2), "d"(ARG3), "S"(ARG4) \
+        : "memory");                                              \
+    retval;                                                       \
+})
+
 /*返回当前任务的pid*/
 uint32_t getpid()
 {
@@ -57,12 +67,49 @@ uint32_t write(char *str)
     return _syscall1(SYS_WRITE, str);
 }
 
-void *malloc(uint32_t size)
+/*创建子进程*/
+int32_t fork(void)
+{
+    return _syscall0(SYS_FORK);
+}
+
+/*映射一段匿名内存，页在第一次访问时才分配*/
+void *mmap(void *addr, uint32_t len, int32_t prot, int32_t flags)
+{
+    return (void *)_syscall4(SYS_MMAP, addr, len, prot, flags);
+}
+
+/*解除[addr, addr + len)的映射*/
+int32_t munmap(void *addr, uint32_t len)
 {
-    return (void *)_syscall1(SYS_MALLOC, size);
+    return _syscall2(SYS_MUNMAP, addr, len);
 }
 
-void free(void *ptr)
+/*把堆的结束地址设为addr*/
+int32_t brk(void *addr)
 {
-    return (void *)_syscall1(SYS_FREE, ptr);
-}
\ No newline at end of file
+    void *cur_brk = (void *)_syscall1(SYS_BRK, addr);
+    return cur_brk == addr ? 0 : -1;
+}
+
+/*把堆的结束地址移动increment字节，返回移动前的结束地址
+ *每次都先用brk(NULL)取当前值，进程的状态只保存在内核里*/
+void *sbrk(int32_t increment)
+{
+    char *old_brk = (char *)_syscall1(SYS_BRK, NULL);
+    if (increment == 0)
+    {
+        return old_brk;
+    }
+    if ((char *)_syscall1(SYS_BRK, old_brk + increment) != old_brk + increment)
+    {
+        return (void *)-1;
+    }
+    return old_brk;
+}
+
+/*休眠m_second毫秒，为0时只让出cpu*/
+void sleep(uint32_t m_second)
+{
+    _syscall1(SYS_SLEEP, m_second);
+}
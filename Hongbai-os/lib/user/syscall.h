@@ -8,11 +8,35 @@ enum SYSCALL_NR
     SYS_GETPID,
     SYS_WRITE,
     SYS_MALLOC,
-    SYS_FREE
+    SYS_FREE,
+    SYS_FORK,
+    SYS_MMAP,
+    SYS_MUNMAP,
+    SYS_BRK,
+    SYS_SLEEP
 };
+
+#define PROT_NONE 0  // 不可访问
+#define PROT_READ 1  // 可读
+#define PROT_WRITE 2 // 可写，x86的页可写就一定可读
+
+#define MAP_PRIVATE 0x02   // 私有映射，fork后写时复制
+#define MAP_FIXED 0x10     // 必须映射在addr处
+#define MAP_ANONYMOUS 0x20 // 匿名映射，目前只支持这一种
+#define MAP_FAILED ((void *)-1) // mmap失败的返回值
+
+// 用户堆从USER_HEAP_BASE开始，第一页在创建进程时就预留好，给用户态分配器存放自己的状态
+// brk从USER_BRK_START开始向高地址移动
+#define USER_HEAP_BASE 0x40000000
+#define USER_BRK_START (USER_HEAP_BASE + 0x1000)
+
 uint32_t getpid(void);     // 获取任务pid
 uint32_t write(char *str); // 打印字符串并返回字符串长度
-void *malloc(uint32_t size);
-void free(void *ptr);
+int32_t fork(void); // 创建子进程，父进程返回子进程pid，子进程返回0，失败返回-1
+void *mmap(void *addr, uint32_t len, int32_t prot, int32_t flags); // 映射匿名内存，失败返回MAP_FAILED
+int32_t munmap(void *addr, uint32_t len);                          // 解除映射，成功返回0，失败返回-1
+int32_t brk(void *addr);          // 把堆的结束地址设为addr，成功返回0，失败返回-1
+void *sbrk(int32_t increment);    // 堆的结束地址移动increment字节，返回原来的结束地址，失败返回(void *)-1
+void sleep(uint32_t m_second);    // 休眠m_second毫秒，休眠期间不占用cpu
 
 #endif
\ No newline at end of file
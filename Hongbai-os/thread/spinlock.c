@@ -0,0 +1,51 @@
+// 实现spinlock.h中的函数
+#include "./spinlock.h"
+#include "../kernel/debug.h"
+
+/* 初始化自旋锁为未加锁状态 */
+void spin_init(struct spinlock *lock)
+{
+    lock->locked = 0;
+}
+
+/*加锁，拿不到时一直自旋
+ *先只读地等锁变成空闲再去xchg，避免自旋时不停地抢缓存行*/
+void spin_lock(struct spinlock *lock)
+{
+    ASSERT(intr_get_status() == INTR_OFF);
+    while (atomic_xchg(&lock->locked, 1) != 0)
+    {
+        while (lock->locked != 0)
+        {
+            cpu_relax();
+        }
+    }
+}
+
+/* 尝试加锁，成功返回true，锁被占用时立即返回false */
+bool spin_trylock(struct spinlock *lock)
+{
+    return atomic_xchg(&lock->locked, 1) == 0;
+}
+
+/* 解锁，x86的写操作不会越过之前的读写，普通写入加编译器屏障就够了 */
+void spin_unlock(struct spinlock *lock)
+{
+    asm volatile("" : : : "memory");
+    lock->locked = 0;
+}
+
+/* 关中断后加锁，返回关中断之前的状态，交给spin_unlock_irqrestore恢复 */
+enum intr_status spin_lock_irqsave(struct spinlock *lock)
+{
+    enum intr_status old_status = intr_disable();
+    spin_lock(lock);
+    return old_status;
+}
+
+/* 解锁后把中断恢复到加锁之前的状态 */
+void spin_unlock_irqrestore(struct spinlock *lock, enum intr_status status)
+{
+    spin_unlock(lock);
+    intr_set_status(status);
+}
@@ -0,0 +1,53 @@
+// 自旋锁，多处理器之间的互斥，持有期间不能阻塞
+#ifndef __THREAD_SPINLOCK_H
+#define __THREAD_SPINLOCK_H
+#include "../lib/stdint.h"
+#include "../kernel/interrupt.h"
+
+/*自旋锁，locked为0表示空闲，全局变量清零后就是未加锁状态
+ *持有自旋锁时要关中断，否则本处理器上的中断处理函数再来加同一把锁会死锁*/
+struct spinlock
+{
+    volatile uint32_t locked;
+};
+
+/* 自旋等待时提示cpu，降低功耗，也让超线程的另一半先运行 */
+static inline void cpu_relax(void)
+{
+    asm volatile("pause" : : : "memory");
+}
+
+/* 原子地把*ptr换成val，返回原来的值 */
+static inline uint32_t atomic_xchg(volatile uint32_t *ptr, uint32_t val)
+{
+    asm volatile("xchgl %0, %1" : "+r"(val), "+m"(*ptr) : : "memory");
+    return val;
+}
+
+/* 原子地给*ptr加1 */
+static inline void atomic_inc(volatile uint32_t *ptr)
+{
+    asm volatile("lock incl %0" : "+m"(*ptr) : : "memory");
+}
+
+/* 原子地给*ptr减1 */
+static inline void atomic_dec(volatile uint32_t *ptr)
+{
+    asm volatile("lock decl %0" : "+m"(*ptr) : : "memory");
+}
+
+/* 原子地给*ptr减1，减到0时返回true */
+static inline bool atomic_dec_and_test(volatile uint32_t *ptr)
+{
+    uint8_t zero;
+    asm volatile("lock decl %0; sete %1" : "+m"(*ptr), "=q"(zero) : : "memory");
+    return zero;
+}
+
+void spin_init(struct spinlock *lock);                                       // 初始化自旋锁
+void spin_lock(struct spinlock *lock);                                       // 加锁，调用者需已关中断
+bool spin_trylock(struct spinlock *lock);                                    // 尝试加锁，不自旋
+void spin_unlock(struct spinlock *lock);                                     // 解锁
+enum intr_status spin_lock_irqsave(struct spinlock *lock);                   // 关中断后加锁，返回原来的中断状态
+void spin_unlock_irqrestore(struct spinlock *lock, enum intr_status status); // 解锁后恢复中断状态
+#endif
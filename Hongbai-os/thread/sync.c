@@ -8,6 +8,7 @@ void sema_init(struct semaphore *psema, uint8_t value)
 {
     psema->value = value;
     list_init(&psema->waiters);
+    spin_init(&psema->guard);
 }
 
 /*初始化锁plock*/
@@ -24,8 +25,8 @@ void lock_init(struct lock *plock)
 3. 若信号量等于0，当前线程将自己阻塞，以在此信号量上等待。*/
 void sema_down(struct semaphore *psema)
 {
-    // 关中断保证操作的原子性
-    enum intr_status old_status = intr_disable();
+    // 关中断并加自旋锁保证操作的原子性，关中断只能挡住本处理器
+    enum intr_status old_status = spin_lock_irqsave(&psema->guard);
     // 使用while可以反复判断目前有没有锁，如果使用if只会判断一次，可能导致错误
     while (psema->value == 0)
     { // 此时锁被别人持有，其他的线程应该阻塞
@@ -38,13 +39,14 @@ void sema_down(struct semaphore *psema)
         }
         // 正常情况下
         list_append(&psema->waiters, &running_thread()->general_tag); // 把当前队列加入到等待队列
-        thread_block(TASK_BLOCKED);                                   // 当前线程状态变为阻塞
+        thread_block_on(TASK_BLOCKED, &psema->guard);                 // 当前线程状态变为阻塞，同时放开guard
+        spin_lock(&psema->guard);                                     // 被唤醒后重新加锁再检查
     }
 
     // 当目前value==1，线程可以被唤醒并的获得锁时，会执行下面的代码
     psema->value--;
     ASSERT(psema->value == 0);
-    intr_set_status(old_status);
+    spin_unlock_irqrestore(&psema->guard, old_status);
 }
 
 /*信号量的up操作（p操作）
@@ -52,8 +54,8 @@ void sema_down(struct semaphore *psema)
 2. 唤醒在此信号量上等待的线程。*/
 void sema_up(struct semaphore *psema)
 {
-    // 关中断保证操作的原子性
-    enum intr_status old_status = intr_disable();
+    // 关中断并加自旋锁保证操作的原子性
+    enum intr_status old_status = spin_lock_irqsave(&psema->guard);
     ASSERT(psema->value == 0);
     if (!list_empty(&psema->waiters))
     {
@@ -63,7 +65,7 @@ void sema_up(struct semaphore *psema)
     // 当value==0时执行下面的代码
     psema->value++;
     ASSERT(psema->value == 1);
-    intr_set_status(old_status);
+    spin_unlock_irqrestore(&psema->guard, old_status);
 }
 
 /*获取锁plock
@@ -84,6 +86,29 @@ void lock_acquire(struct lock *plock)
     }
 }
 
+/*尝试获取锁plock，锁被其他线程持有时不等待，直接返回false
+ *给idle这种不能被阻塞的线程使用*/
+bool lock_try_acquire(struct lock *plock)
+{
+    if (plock->holder == running_thread())
+    {
+        plock->holder_repeat_nr++;
+        return true;
+    }
+    enum intr_status old_status = spin_lock_irqsave(&plock->semaphore.guard);
+    if (plock->semaphore.value == 0)
+    {
+        spin_unlock_irqrestore(&plock->semaphore.guard, old_status);
+        return false;
+    }
+    plock->semaphore.value--;
+    plock->holder = running_thread();
+    ASSERT(plock->holder_repeat_nr == 0);
+    plock->holder_repeat_nr = 1;
+    spin_unlock_irqrestore(&plock->semaphore.guard, old_status);
+    return true;
+}
+
 /*释放锁plock
  *如果锁的申请次数大于1,次数减一
  *如果锁的申请次数等于1,将锁的持有者置空，然后信号量+1*/
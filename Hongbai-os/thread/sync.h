@@ -5,11 +5,13 @@
 #include "../lib/stdint.h"
 #include "../lib/kernel/list.h"
 #include "./thread.h"
+#include "./spinlock.h"
 
 struct semaphore
 {                        // 信号量结构体，包含value、waiters两个成员
     uint8_t value;       // 信号量的值，是1时允许申请锁，0说明锁被占用
     struct list waiters; // 用来记录在此信号量上等待的线程
+    struct spinlock guard; // 保护value和waiters，多个处理器可能同时操作同一个信号量
 };
 
 struct lock
@@ -23,5 +25,6 @@ void lock_init(struct lock *plock);
 void sema_down(struct semaphore *psema);
 void sema_up(struct semaphore *psema);
 void lock_acquire(struct lock *plock);
+bool lock_try_acquire(struct lock *plock); // 不阻塞地尝试获取锁
 void lock_release(struct lock *plock);
 #endif
\ No newline at end of file
@@ -7,26 +7,44 @@
 #include "../lib/kernel/print.h"
 #include "../userprog/process.h"
 #include "./sync.h"
+#include "../device/timer.h"
+#include "../device/lapic.h"
+#include "../kernel/smp.h"
 
 #define PG_SIZE 4096
+#define AGE_INTERVAL 10 // 每隔这么多tick检查一次就绪队列中是否有饥饿的线程
+#define STARVE_TICKS 50 // 在就绪队列中等待超过这么多tick的线程直接提升到所有就绪线程之上
+#define BALANCE_INTERVAL 20 // 每隔这么多tick检查一次处理器之间的负载是否均衡
 
 extern void switch_to(struct task_struct *cur, struct task_struct *next); // 任务切换函数
 
 struct lock pid_lock;            // 分配pid锁，此锁用来在分配pid时实现互斥，避免为不同的任务分配重复的pid
-struct task_struct *idle_thread; // idle线程
+struct kmem_cache pcb_cache;     // pcb对象缓存
+struct spinlock all_list_lock;   // 保护thread_all_list
 
-/*设置系统空闲时运行的线程*/
-static void idle(void *arg)
+/*处理器空闲时运行的循环，idle线程不进就绪队列，本处理器的就绪队列为空时由schedule直接选中
+ *预清零窗口只有一个，所以平衡内存池和预清零只在引导处理器上做*/
+void cpu_idle(void)
 {
-    (void)arg; // 显式忽略未使用的参数，相当于UNUSED
+    bool boot_cpu = running_thread()->cpu == &cpus[0]; // idle线程不会迁移，只需要判断一次
     while (1)
     {
-        thread_block(TASK_BLOCKED); // 初始为阻塞状态
-        // 被唤醒后执行下面的代码
-        asm volatile("sti; hlt" : : : "memory");
+        // 先让出，本处理器没有就绪线程时schedule会去别的处理器偷一个，偷不到才回到这里
+        thread_yield();
+        // 没有其他线程就绪时先平衡两个内存池，再逐页预清零物理页，有线程就绪或者都做完了再停机
+        while (boot_cpu && run_queue_empty() && (pool_balance() || page_prezero_one()))
+            ;
+        timer_idle_halt(); // 停机等待中断，没有定时器快到期时不再每个tick都醒来
     }
 }
 
+/*引导处理器的idle线程，由thread_create构造的线程栈进入*/
+static void idle(void *arg)
+{
+    (void)arg; // 显式忽略未使用的参数，相当于UNUSED
+    cpu_idle();
+}
+
 /* 获取当前线程的pcb指针 */
 struct task_struct *running_thread(void)
 {
@@ -39,7 +57,8 @@ struct task_struct *running_thread(void)
 /* 由kernel_thread执行function(func_arg) */
 void kernel_thread(thread_func *function, void *func_arg)
 {
-    intr_enable(); // 开中断,避免后面的时钟中断被屏蔽，而无法调度其他线程
+    schedule_tail(); // 第一次被调度，替schedule完成切换的收尾
+    intr_enable();   // 开中断,避免后面的时钟中断被屏蔽，而无法调度其他线程
     function(func_arg);
 }
 
@@ -53,6 +72,12 @@ static pid_t allocate_pid(void)
     return next_pid;
 }
 
+/* fork子进程时为其分配pid，allocate_pid是静态函数，这里封装一层 */
+pid_t fork_pid(void)
+{
+    return allocate_pid();
+}
+
 /* 初始化线程栈thread_stack */
 void thread_create(struct task_struct *pthread, thread_func function, void *func_arg)
 {
@@ -102,22 +127,23 @@ void init_thread(struct task_struct *pthread, char *name, int prio)
     pthread->ticks = prio;             // 线程时间片
     pthread->elapsed_ticks = 0;        // 线程运行时间
     pthread->pgdir = NULL;             // 线程页表
+    pthread->cpus_allowed = CPU_MASK_ALL; // 默认不限制处理器
     pthread->stack_magic = 0x20250325; // 线程栈的魔数，边界标记，用来检测栈溢出
 }
 
 /* 创建一个优先级为prio的线程，线程名是name，执行的函数是function(func_arg) */
 struct task_struct *thread_start(char *name, int prio, thread_func function, void *func_arg)
 {
-    struct task_struct *thread = get_kernel_pages(1); // 分配1页的内存空间给pcb
+    struct task_struct *thread = kmem_cache_alloc(&pcb_cache); // 从pcb缓存中分配1页给pcb和内核栈
     init_thread(thread, name, prio);                  // 初始化线程基本信息
     thread_create(thread, function, func_arg);        // 初始化线程栈
 
-    /* 确保线程不在就绪线程队列 */
-    ASSERT(!elem_find(&thread_ready_list, &thread->general_tag));
-    list_append(&thread_ready_list, &thread->general_tag); // 将线程加入就绪队列
+    enum intr_status old_status = spin_lock_irqsave(&all_list_lock);
     /* 确保线程不在所有线程队列 */
     ASSERT(!elem_find(&thread_all_list, &thread->all_list_tag));
     list_append(&thread_all_list, &thread->all_list_tag); // 将线程加入所有线程队列
+    spin_unlock_irqrestore(&all_list_lock, old_status);
+    run_queue_add(thread);                            // 将线程加入就绪队列
     return thread;
 }
 
@@ -130,44 +156,379 @@ void make_main_thread(void)
      * 不需要通过get_kernel_page另分配一页*/
     main_thread = running_thread();                                   // 获取主线程pcb
     init_thread(main_thread, "main", 31);                             // 初始化主线程基本信息
+    main_thread->cpu = main_thread->last_cpu = &cpus[0];              // 主线程运行在引导处理器上
+    main_thread->on_cpu = true;
+    cpus[0].curr = main_thread;
+    enum intr_status old_status = spin_lock_irqsave(&all_list_lock);
     ASSERT(!elem_find(&thread_all_list, &main_thread->all_list_tag)); // 确保主线程不在就绪队列
     list_append(&thread_all_list, &main_thread->all_list_tag);        // 将主线程加入就绪队列
+    spin_unlock_irqrestore(&all_list_lock, old_status);
+}
+
+/*把pcb初始化为处理器c的idle线程，idle线程不进就绪队列
+ *boot为true时pcb是AP启动时正在使用的栈，线程已经在运行；否则构造线程栈，第一次被选中时从idle函数开始*/
+void idle_thread_setup(struct cpu *c, struct task_struct *pcb, char *name, bool boot)
+{
+    init_thread(pcb, name, 10);
+    pcb->cpu = c;
+    pcb->cpus_allowed = 1u << c->id;
+    c->idle = pcb;
+    if (boot)
+    {
+        pcb->status = TASK_RUNNING;
+        pcb->on_cpu = true;
+        pcb->last_cpu = c;
+        c->curr = pcb;
+    }
+    else
+    {
+        thread_create(pcb, idle, NULL);
+    }
+    enum intr_status old_status = spin_lock_irqsave(&all_list_lock);
+    list_append(&thread_all_list, &pcb->all_list_tag);
+    spin_unlock_irqrestore(&all_list_lock, old_status);
+}
+
+/* 线程的实际级别，priority超过最高级时按最高级算，再加上动态加成，老化提升还没用完时取两者中高的 */
+static uint8_t thread_level(struct task_struct *pthread)
+{
+    int32_t level = pthread->priority < PRIO_LEVELS ? pthread->priority : PRIO_LEVELS - 1;
+    level += pthread->prio_bonus;
+    if (level < pthread->aged_level)
+    {
+        return pthread->aged_level;
+    }
+    if (level < 0)
+    {
+        return 0;
+    }
+    return level < PRIO_LEVELS ? level : PRIO_LEVELS - 1;
+}
+
+/* 把线程挂到rq第level级队列末尾，调用者需持有rq->lock */
+static void rq_insert(struct run_queue *rq, struct task_struct *pthread, uint8_t level)
+{
+    list_append(&rq->levels[level], &pthread->general_tag);
+    rq->bitmap |= 1u << (PRIO_LEVELS - 1 - level);
+    pthread->rq_level = level;
+    pthread->ready_since = rq->clock;
+    rq->ready_cnt++;
+}
+
+/* 把线程从rq中所在级别的队列中摘下，这一级空了就清掉位图中的位，调用者需持有rq->lock */
+static void rq_remove(struct run_queue *rq, struct task_struct *pthread)
+{
+    list_remove(&pthread->general_tag);
+    if (list_empty(&rq->levels[pthread->rq_level]))
+    {
+        rq->bitmap &= ~(1u << (PRIO_LEVELS - 1 - pthread->rq_level));
+    }
+    rq->ready_cnt--;
+}
+
+/* 取出rq中最高非空级别的队首线程，就绪队列不能为空 */
+static struct task_struct *rq_pop(struct run_queue *rq)
+{
+    ASSERT(rq->bitmap != 0);
+    uint32_t level = PRIO_LEVELS - 1 - bit_scan_forward(rq->bitmap);
+    struct task_struct *next = elem2entry(struct task_struct, general_tag, rq->levels[level].head.next);
+    rq_remove(rq, next);
+    return next;
+}
+
+/* 线程是否允许在处理器c上运行 */
+static bool cpu_allowed(struct task_struct *pthread, struct cpu *c)
+{
+    return (pthread->cpus_allowed & (1u << c->id)) != 0;
+}
+
+/*为就绪的线程选一个处理器：留在它上次所在的处理器上，缓存还是热的；
+ *新线程或者不再允许留在原处的线程选允许的处理器中就绪线程最少的。读别的队列的ready_cnt不加锁，只是估计
+ *允许的处理器都不在线时忽略亲和性，保证线程总能运行*/
+static struct cpu *rq_select(struct task_struct *pthread)
+{
+    if (pthread->cpu != NULL && pthread->cpu->online && cpu_allowed(pthread, pthread->cpu))
+    {
+        return pthread->cpu;
+    }
+    struct cpu *best = NULL;
+    struct cpu *any = &cpus[0];
+    uint32_t i;
+    for (i = 0; i < cpu_cnt; i++)
+    {
+        struct cpu *c = &cpus[i];
+        if (!c->online)
+        {
+            continue;
+        }
+        if (c->rq.ready_cnt < any->rq.ready_cnt)
+        {
+            any = c;
+        }
+        if (cpu_allowed(pthread, c) && (best == NULL || c->rq.ready_cnt < best->rq.ready_cnt))
+        {
+            best = c;
+        }
+    }
+    return best != NULL ? best : any;
+}
+
+/*在c以外的在线处理器中找就绪线程最多的，至少要比c多imbalance个才值得拉过来，没有返回NULL
+ *不加锁读ready_cnt，只是估计，拉的时候会在锁内再检查*/
+static struct cpu *rq_busiest(struct cpu *c, uint32_t imbalance)
+{
+    struct cpu *busiest = NULL;
+    uint32_t most = c->rq.ready_cnt + imbalance - 1;
+    uint32_t i;
+    for (i = 0; i < cpu_cnt; i++)
+    {
+        struct cpu *victim = &cpus[i];
+        if (victim != c && victim->online && victim->rq.ready_cnt > most)
+        {
+            busiest = victim;
+            most = victim->rq.ready_cnt;
+        }
+    }
+    return busiest;
+}
+
+/*从最忙的处理器的就绪队列拉一个线程到c的就绪队列，调用者持有c->rq.lock，返回是否拉到
+ *两个处理器可能同时互相拉，对方的锁只尝试一次，拿不到就放弃，不会死锁
+ *从高到低找第一个非空级别，在这一级从队尾往前找：队首是对方马上要运行的、缓存还热的线程，留给它；
+ *队尾等得最久也最不可能还在对方缓存里，拉过来立刻就能运行。还没在原处理器上切换走的和不允许在c上运行的跳过*/
+static bool rq_pull(struct cpu *c, uint32_t imbalance)
+{
+    struct cpu *victim = rq_busiest(c, imbalance);
+    if (victim == NULL || !spin_trylock(&victim->rq.lock))
+    {
+        return false;
+    }
+    struct task_struct *stolen = NULL;
+    if (victim->rq.ready_cnt >= c->rq.ready_cnt + imbalance)
+    {
+        uint32_t pending = victim->rq.bitmap;
+        while (pending != 0 && stolen == NULL)
+        {
+            uint32_t bit = bit_scan_forward(pending);
+            pending &= pending - 1;
+            struct list *level = &victim->rq.levels[PRIO_LEVELS - 1 - bit];
+            struct list_elem *elem = level->tail.prev;
+            while (elem != &level->head)
+            {
+                struct task_struct *pthread = elem2entry(struct task_struct, general_tag, elem);
+                if (!pthread->on_cpu && cpu_allowed(pthread, c))
+                {
+                    stolen = pthread;
+                    break;
+                }
+                elem = elem->prev;
+            }
+        }
+        if (stolen != NULL)
+        {
+            rq_remove(&victim->rq, stolen);
+            stolen->cpu = c;
+            rq_insert(&c->rq, stolen, thread_level(stolen));
+        }
+    }
+    spin_unlock(&victim->rq.lock);
+    return stolen != NULL;
 }
 
-/* 实现任务调度 */
+/*把就绪的线程按它的级别放到所选处理器就绪队列的末尾
+ *那个处理器空闲或者正在运行的线程级别更低时请求它尽快切换，是别的处理器就发处理器间中断叫醒它*/
+void run_queue_add(struct task_struct *pthread)
+{
+    enum intr_status old_status = intr_disable();
+    ASSERT(pthread->status == TASK_READY);
+    struct cpu *c = rq_select(pthread);
+    spin_lock(&c->rq.lock);
+    pthread->cpu = c;
+    rq_insert(&c->rq, pthread, thread_level(pthread));
+    bool preempt = c->curr == c->idle || pthread->rq_level > thread_level(c->curr);
+    if (preempt)
+    {
+        c->need_resched = true;
+    }
+    spin_unlock(&c->rq.lock);
+    if (!preempt)
+    { // 目标处理器忙，叫醒一个允许运行这个线程的空闲处理器来偷，不必等它下一次时钟中断
+        uint32_t i;
+        for (i = 0; i < cpu_cnt; i++)
+        {
+            struct cpu *idle_cpu = &cpus[i];
+            if (idle_cpu != c && idle_cpu->online && idle_cpu->curr == idle_cpu->idle && cpu_allowed(pthread, idle_cpu))
+            {
+                c = idle_cpu;
+                c->need_resched = true;
+                preempt = true;
+                break;
+            }
+        }
+    }
+    if (preempt && c != this_cpu())
+    {
+        lapic_send_ipi(c->apic_id, IPI_RESCHED_VECTOR);
+    }
+    intr_set_status(old_status);
+}
+
+/* 当前处理器是否没有就绪线程 */
+bool run_queue_empty(void)
+{
+    enum intr_status old_status = intr_disable();
+    bool empty = this_cpu()->rq.ready_cnt == 0;
+    intr_set_status(old_status);
+    return empty;
+}
+
+/*由时钟中断调用，每AGE_INTERVAL次检查一遍当前处理器各级队列，从队首起等待超过STARVE_TICKS的线程
+ *直接提升到目前最高的非空级别之上一级，下一次调度就轮到它们，所以线程最多等STARVE_TICKS+AGE_INTERVAL个tick，
+ *最高级已经有线程时只能排到最高级的末尾，再多等同级每个线程一个时间片
+ *提升一直保留到线程用完一整个时间片，中途被抢占或者阻塞后重新排队时仍按提升后的级别*/
+void run_queue_age(void)
+{
+    struct run_queue *rq = &this_cpu()->rq;
+    spin_lock(&rq->lock);
+    if (++rq->clock % AGE_INTERVAL != 0 || rq->bitmap == 0)
+    {
+        spin_unlock(&rq->lock);
+        return;
+    }
+    uint8_t top = PRIO_LEVELS - 1 - bit_scan_forward(rq->bitmap);
+    uint8_t target = top < PRIO_LEVELS - 1 ? top + 1 : top;
+    uint32_t pending = rq->bitmap & ~(1u << (PRIO_LEVELS - 1 - target)); // target级原来是空的，或者就是最高级
+    while (pending != 0)
+    { // 同一级里越靠前等得越久，队首没有饿到就不用再往后看
+        uint32_t bit = bit_scan_forward(pending);
+        pending &= pending - 1;
+        struct list *level = &rq->levels[PRIO_LEVELS - 1 - bit];
+        while (!list_empty(level))
+        {
+            struct task_struct *head = elem2entry(struct task_struct, general_tag, level->head.next);
+            if (rq->clock - head->ready_since < STARVE_TICKS)
+            {
+                break;
+            }
+            rq_remove(rq, head);
+            head->aged_level = target;
+            rq_insert(rq, head, target);
+        }
+    }
+    spin_unlock(&rq->lock);
+}
+
+/*由时钟中断调用，每BALANCE_INTERVAL次看一下别的处理器是不是比本处理器多出至少2个就绪线程，是就拉一个过来
+ *偷线程只在本处理器空闲时发生，这里处理长期的不均衡：每个处理器都有活干，但有的队列越排越长
+ *各处理器按编号错开检查的时刻，避免同时去抢同一个队列的锁*/
+void run_queue_balance(void)
+{
+    struct cpu *c = this_cpu();
+    struct run_queue *rq = &c->rq;
+    if (cpu_cnt == 1 || (rq->clock + c->id) % BALANCE_INTERVAL != 0)
+    {
+        return;
+    }
+    spin_lock(&rq->lock);
+    if (rq_pull(c, 2))
+    {
+        uint8_t level = rq->ready_cnt != 0 ? PRIO_LEVELS - 1 - bit_scan_forward(rq->bitmap) : 0;
+        if (c->curr == c->idle || level > thread_level(c->curr))
+        {
+            c->need_resched = true; // 本处理器空闲，或者拉来的线程比正在运行的级别高
+        }
+    }
+    spin_unlock(&rq->lock);
+}
+
+/*实现任务调度，优先在当前处理器的就绪队列中选线程，队列空了就从最忙的处理器偷一个
+ *队列的锁从这里一直持有到切换完成，由下一个线程在schedule_tail中释放，
+ *这期间别的处理器看不到被换下的线程，不会在它的栈还在使用时就把它调度走*/
 void schedule(void)
 {
     ASSERT(intr_get_status() == INTR_OFF);      // 确保中断关闭
     struct task_struct *cur = running_thread(); // 获取当前线程pcb
+    struct cpu *c = cur->cpu;
+    struct run_queue *rq = &c->rq;
+    spin_lock(&rq->lock);
 
     if (cur->status == TASK_RUNNING)
-    {                                                              // 如果当前线程是运行状态
-        ASSERT(!elem_find(&thread_ready_list, &cur->general_tag)); // 确保当前线程不在就绪队列
-        list_append(&thread_ready_list, &cur->general_tag);        // 将当前线程加入就绪队列
-        cur->status = TASK_READY;                                  // 设置当前线程状态为就绪
-        cur->ticks = cur->priority;                                // 重置时间片
+    { // 如果当前线程是运行状态，说明是时间片用完或者被抢占
+        if (cur->ticks == 0)
+        {
+            if (cur->prio_bonus > -PRIO_BONUS_MAX)
+            {
+                cur->prio_bonus--; // 用完了整个时间片，偏向计算，降一级
+            }
+            cur->aged_level = 0;   // 老化得到的提升到此用完
+        }
+        cur->status = TASK_READY;   // 设置当前线程状态为就绪
+        cur->ticks = cur->priority; // 重置时间片
+        if (cur != c->idle)
+        { // 将当前线程加入就绪队列，idle线程不排队；亲和性不再包括本处理器的，切换完成后再放到别处
+            if (cpu_allowed(cur, c))
+            {
+                rq_insert(rq, cur, thread_level(cur));
+            }
+            else
+            {
+                c->migrate = cur;
+            }
+        }
     }
-    else
+    c->need_resched = false;
+    // 取出级别最高的就绪线程，就绪队列为空时先去别的处理器偷，还是没有才运行idle线程
+    if (rq->ready_cnt == 0)
     {
+        rq_pull(c, 1);
     }
-    if (list_empty(&thread_ready_list))
+    struct task_struct *next = rq->ready_cnt != 0 ? rq_pop(rq) : c->idle;
+    next->status = TASK_RUNNING; // 设置下一个线程状态为运行
+    if (next == cur)
     {
-        thread_unblock(idle_thread); // 如果就绪队列为空，唤醒idle线程
+        spin_unlock(&rq->lock);
+        return;
     }
-    struct task_struct *thread_tag = (struct task_struct *)list_pop(&thread_ready_list); // 从就绪队列中取出一个线程节点
-    struct task_struct *next = (struct task_struct *)((uint32_t)thread_tag & 0xfffff000);
+    // 刚被唤醒的线程可能还在别的处理器上切换出去，等它的上下文保存好
+    while (next->on_cpu)
+    {
+        cpu_relax();
+    }
+    next->on_cpu = true;
+    if (next->last_cpu != c)
+    {
+        c->loaded_pgdir = NULL; // 换了处理器，这里cr3中的页表可能是它离开后又被修改过的旧内容
+    }
+    next->cpu = next->last_cpu = c;
+    c->curr = next;
+    c->prev = cur;
+    process_activate(next); // 激活任务页表
+    switch_to(cur, next);   // 任务切换
+    schedule_tail();
+}
 
-    next->status = TASK_RUNNING; // 设置下一个线程状态为运行
-    process_activate(next);      // 激活任务页表
-    switch_to(cur, next);        // 任务切换
+/*切换完成后由换上来的线程调用：被换下的线程已经保存好上下文，可以被其他处理器调度了，再释放就绪队列的锁
+ *新线程第一次运行时不从schedule返回，在kernel_thread和fork子进程的返回路径上调用*/
+void schedule_tail(void)
+{
+    struct cpu *c = running_thread()->cpu;
+    struct task_struct *migrate = c->migrate;
+    c->migrate = NULL;
+    asm volatile("" : : : "memory"); // prev的上下文写完之后才能清除on_cpu
+    c->prev->on_cpu = false;
+    spin_unlock(&c->rq.lock);
+    if (migrate != NULL)
+    { // 放锁之后再去拿别的处理器的队列锁，两把队列锁不同时持有
+        run_queue_add(migrate);
+    }
 }
 
 /*当前线程将自己阻塞，目前的状态变为stat
- *stat的取值是blocked、waiting、hanging*/
+ *stat的取值是blocked、waiting、hanging，出错的用户进程用died结束自己，之后不会再被唤醒*/
 void thread_block(enum thread_status stat)
 {
-    // 先检验stat是否处于这三种状态
-    ASSERT(stat == TASK_BLOCKED || stat == TASK_WAITING || stat == TASK_HANGING);
+    // 先检验stat是否处于这四种状态
+    ASSERT(stat == TASK_BLOCKED || stat == TASK_WAITING || stat == TASK_HANGING || stat == TASK_DIED);
     enum intr_status old_status = intr_disable();
 
     struct task_struct *cur_thread = running_thread();
@@ -178,6 +539,18 @@ void thread_block(enum thread_status stat)
     intr_set_status(old_status); // schedule-swich后，才会执行
 }
 
+/*在持有自旋锁lock时阻塞，lock保护着唤醒者要检查的条件
+ *先改状态再放锁，放锁之后唤醒者随时可能把本线程放回就绪队列，schedule会处理这种情况
+ *返回时不再持有lock，中断仍是关闭的*/
+void thread_block_on(enum thread_status stat, struct spinlock *lock)
+{
+    ASSERT(stat == TASK_BLOCKED || stat == TASK_WAITING || stat == TASK_HANGING);
+    ASSERT(intr_get_status() == INTR_OFF);
+    running_thread()->status = stat;
+    spin_unlock(lock);
+    schedule();
+}
+
 /*锁的拥有者，将名为pthread的线程解除阻塞*/
 void thread_unblock(struct task_struct *pthread)
 {
@@ -185,52 +558,92 @@ void thread_unblock(struct task_struct *pthread)
     ASSERT((pthread->status == TASK_BLOCKED) || (pthread->status == TASK_WAITING) || (pthread->status == TASK_HANGING));
     if (pthread->status != TASK_READY)
     {
-        // 当前线程不应该在就绪队列里
-        ASSERT(!elem_find(&thread_ready_list, &pthread->general_tag));
-        // 如果线程因为某些特殊原因还在就绪队列里
-        if (elem_find(&thread_ready_list, &pthread->general_tag))
+        // 阻塞后被唤醒的线程偏向交互或I/O，升一级，排在同级线程后面而不是插队到最前
+        if (pthread->prio_bonus < PRIO_BONUS_MAX)
         {
-            PANIC("thread_unblock:block thread in ready list");
+            pthread->prio_bonus++;
         }
-        // 正常情况下，即不在就绪队列里
-        list_push(&thread_ready_list, &pthread->general_tag);
         pthread->status = TASK_READY;
+        run_queue_add(pthread);
     }
     intr_set_status(old_status);
 }
 
-/*主动让出CPU，切换其他线程运行*/
+/*设置线程允许运行的处理器，mask的第i位对应cpus[i]，至少要包括一个处理器
+ *当前线程不再允许留在本处理器时马上让出，由schedule_tail放到允许的处理器上；
+ *其他线程在下一次被换下时才迁移，已经在别处就绪队列中排着的会先在那里运行一次*/
+void thread_set_affinity(struct task_struct *pthread, uint32_t mask)
+{
+    ASSERT((mask & ((1u << NR_CPUS) - 1)) != 0);
+    enum intr_status old_status = intr_disable();
+    pthread->cpus_allowed = mask;
+    if (pthread == running_thread() && !cpu_allowed(pthread, pthread->cpu))
+    {
+        schedule();
+    }
+    intr_set_status(old_status);
+}
+
+/*主动让出CPU，切换其他线程运行，schedule会把仍在运行态的当前线程放回就绪队列*/
 void thread_yield(void)
 {
-    struct task_struct *cur = running_thread();
     enum intr_status old_status = intr_disable();
-    ASSERT(!elem_find(&thread_ready_list, &cur->general_tag));
-    cur->status = TASK_READY;
     schedule();
     intr_set_status(old_status);
 }
 
+/* 初始化处理器c的就绪队列 */
+static void run_queue_init(struct run_queue *rq)
+{
+    spin_init(&rq->lock);
+    uint32_t level;
+    for (level = 0; level < PRIO_LEVELS; level++)
+    {
+        list_init(&rq->levels[level]); // 初始化各级就绪线程队列
+    }
+    rq->bitmap = rq->ready_cnt = rq->clock = 0;
+}
+
 /* 初始化线程环境 */
 void thread_init(void)
 {
     put_str("thread_init start\n");
-    list_init(&thread_ready_list); // 初始化就绪线程队列
+    uint32_t i;
+    for (i = 0; i < NR_CPUS; i++)
+    {
+        cpus[i].id = i;
+        run_queue_init(&cpus[i].rq); // 每个处理器一个就绪队列
+    }
+    cpu_cnt = 1; // 其他处理器在smp_init中发现
+    cpus[0].online = true;
+    spin_init(&all_list_lock);
     list_init(&thread_all_list);   // 初始化所有线程队列
     lock_init(&pid_lock);          // 初始化pid锁
+    // pcb所在页的顶端是内核栈，running_thread靠esp取整页找到pcb，所以对象大小是整页
+    kmem_cache_create(&pcb_cache, "task_struct", PG_SIZE, 0, NULL);
     make_main_thread();            // 创建主线程
-    // 创建idle线程
-    idle_thread = thread_start("idle", 10, idle, NULL);
+    // 创建引导处理器的idle线程
+    idle_thread_setup(&cpus[0], kmem_cache_alloc(&pcb_cache), "idle", false);
     put_str("thread_init done\n");
 }
 
 void ready_list_len()
-{ // 测试就绪队列是否为空，输出就绪队列的元素数
-    put_int(list_len(&thread_ready_list));
+{ // 测试就绪队列是否为空，输出所有处理器就绪队列的元素数之和
+    uint32_t cnt = 0;
+    uint32_t i;
+    for (i = 0; i < cpu_cnt; i++)
+    {
+        cnt += cpus[i].rq.ready_cnt;
+    }
+    put_int(cnt);
     put_str("\n");
 }
 
 void all_list_len()
 {
-    put_int(list_len(&thread_all_list));
+    enum intr_status old_status = spin_lock_irqsave(&all_list_lock);
+    uint32_t len = list_len(&thread_all_list);
+    spin_unlock_irqrestore(&all_list_lock, old_status);
+    put_int(len);
     put_str("\n");
 }
@@ -5,8 +5,15 @@
 #include "../lib/kernel/list.h"
 #include "../lib/kernel/bitmap.h"
 #include "../kernel/memory.h"
+#include "../kernel/vma.h"
+#include "./spinlock.h"
 
 #define MAX_FILES_OPEN_PER_PROC 8 // 每个进程最大能同时打开的文件数
+#define CPU_MASK_ALL 0xffffffff   // 允许在任何处理器上运行
+#define PRIO_LEVELS 32            // 就绪队列的级数，priority超过31的线程按31级排队
+#define PRIO_BONUS_MAX 4          // 动态调整的幅度，线程的实际级别在priority上下浮动最多这么多级
+
+struct cpu; // 定义在kernel/smp.h中
 
 /* 自定义通用函数类型，用来承载线程中函数的类型 */
 typedef void thread_func(void *);
@@ -83,6 +90,17 @@ struct thread_stack
     void *func_arg;        // kernel_thread内核线程要执行的函数的参数
 };
 
+/*多级就绪队列，每个处理器一个，每一级是一条FIFO链表，级别越高越先运行
+ *位图第i位对应第PRIO_LEVELS-1-i级，最高的非空级别就是最低位的1，一条bsf就能找到*/
+struct run_queue
+{
+    struct spinlock lock;            // 保护本队列，schedule持有它直到切换到下一个线程之后
+    struct list levels[PRIO_LEVELS]; // 各级的就绪线程，下标就是级别
+    uint32_t bitmap;                 // 非空级别的位图
+    uint32_t ready_cnt;              // 就绪线程总数
+    uint32_t clock;                  // 时钟中断次数，用来计算线程在队列中等了多久
+};
+
 /* 线程或进程的pcb程序控制块 */
 struct task_struct
 {
@@ -91,6 +109,14 @@ struct task_struct
     enum thread_status status; // 线程的状态
     uint8_t priority;          // 线程的优先级
     uint8_t ticks;             // 线程的时间片，在处理器上运行的时间滴答数
+    int8_t prio_bonus;         // 动态加成，阻塞后被唤醒加1，用完整个时间片减1
+    uint8_t rq_level;          // 线程在就绪队列中所处的级别
+    uint8_t aged_level;        // 等待太久被老化提升到的级别，0表示没有提升，用完一整个时间片后清零
+    uint32_t ready_since;      // 线程进入当前级别就绪队列的时间，用于老化
+    struct cpu *cpu;           // 线程最近一次运行或者排队所在的处理器
+    volatile bool on_cpu;      // 线程正在某个处理器上运行，包括刚阻塞但还没切换走的时候
+    struct cpu *last_cpu;      // 线程上一次实际运行的处理器，换了处理器时要重新加载cr3
+    uint32_t cpus_allowed;     // 允许运行的处理器位图，第i位对应cpus[i]，fork时随pcb一起复制
     uint32_t elapsed_ticks;    // 线程的运行时间，也就是这个线程已经执行了多久
     char name[16];             // 线程的名字
 
@@ -100,8 +126,10 @@ struct task_struct
     struct list_elem all_list_tag; // 用于线程在thread_all_list队列中的节点
 
     uint32_t *pgdir;                              // 如果是进程，这是进程的页表结构中页目录表的虚拟地址，线程则置为NULL
-    struct virtual_addr userprog_vaddr;           // 用户进程的虚拟地址，后续转化为物理地址后存入cr3寄存器
+    struct vma_tree vmas;                         // 用户进程已预留的虚拟地址区间
+    uint32_t heap_brk;                            // 用户堆的结束地址，由brk系统调用移动
     struct mem_block_desc u_block_desc[DESC_CNT]; // 进程内存块描述符数组，用于用户进程的堆内存管理
+    struct magazine mags[DESC_CNT];               // 每种规格的小块缓存，只有本线程访问
     uint32_t stack_magic;                         // 线程栈的魔数，边界标记，用来检测栈溢出
 };
 
@@ -114,12 +142,23 @@ void make_main_thread(void);
 void schedule(void);                                                                          // 线程调度函数
 void thread_init(void);                                                                       // 线程初始化函数
 void thread_block(enum thread_status stat);                                                   // 线程阻塞函数
+void thread_block_on(enum thread_status stat, struct spinlock *lock);                         // 状态改好后释放lock再阻塞，lock之后由调用者重新获取
+void schedule_tail(void);                                                                     // 切换到新线程后释放就绪队列的锁
 void thread_unblock(struct task_struct *pthread);                                             // 线程解除阻塞函数
 void ready_list_len(void);
 void all_list_len(void);
 void thread_yield(void);
+void run_queue_add(struct task_struct *pthread); // 把就绪线程按它的级别放到就绪队列末尾
+bool run_queue_empty(void);                      // 是否没有就绪线程
+void run_queue_age(void);                        // 时钟中断调用，提升等待太久的线程
+void run_queue_balance(void);                    // 时钟中断调用，从最忙的处理器拉线程过来
+void thread_set_affinity(struct task_struct *pthread, uint32_t mask); // 设置线程允许运行的处理器
+void idle_thread_setup(struct cpu *c, struct task_struct *pcb, char *name, bool boot); // 把pcb初始化为处理器c的idle线程
+void cpu_idle(void);                             // idle线程的主循环，AP启动后直接进入
+pid_t fork_pid(void); // 为fork出的子进程分配pid
 
+extern struct kmem_cache pcb_cache; // pcb对象缓存，pcb和内核栈共用一页
 struct task_struct *main_thread; // 主线程pcb
-struct list thread_ready_list;   // 就绪线程队列
 struct list thread_all_list;     // 所有线程队列
+extern struct spinlock all_list_lock; // 保护thread_all_list
 #endif
\ No newline at end of file
@@ -0,0 +1,130 @@
+#include "./fork.h"
+#include "./process.h"
+#include "../kernel/memory.h"
+#include "../kernel/interrupt.h"
+#include "../kernel/debug.h"
+#include "../kernel/global.h"
+#include "../lib/string.h"
+#include "../fs/file.h"
+#include "../fs/inode.h"
+
+/*复制父进程的pcb和内核栈、vma树到子进程，成功返回0，失败返回-1*/
+static int32_t copy_pcb_vmas_stack0(struct task_struct *child, struct task_struct *parent)
+{
+    // 1.整页复制，pcb、u_block_desc、magazine和内核栈里的中断栈都一起带过来
+    memcpy(child, parent, PG_SIZE);
+    // 再单独修改子进程自己的信息
+    child->pid = fork_pid();
+    child->elapsed_ticks = 0;
+    child->status = TASK_READY;
+    child->ticks = child->priority;
+    child->general_tag.prev = child->general_tag.next = NULL;
+    // 父进程正在运行，子进程还没有上过处理器，由run_queue_add挑一个空闲的处理器
+    child->on_cpu = false;
+    child->cpu = child->last_cpu = NULL;
+    child->all_list_tag.prev = child->all_list_tag.next = NULL;
+
+    // 2.复制vma树，父子进程以后各自预留虚拟地址
+    if (!vma_tree_copy(&child->vmas, &parent->vmas))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+extern void fork_child_ret(void); // 定义在switch.S中，完成schedule_tail后跳到intr_exit
+
+/*为子进程构建thread_stack，让它第一次被调度时经fork_child_ret从intr_exit直接返回用户态，并且fork的返回值为0*/
+static void build_child_stack(struct task_struct *child)
+{
+    // 1.子进程的中断栈在pcb页的最顶端，内容是父进程进入fork系统调用时的上下文
+    struct intr_stack *intr_0_stack = (struct intr_stack *)((uint32_t)child + PG_SIZE - sizeof(struct intr_stack));
+    intr_0_stack->eax = 0; // 子进程fork返回0
+
+    // 2.在中断栈下面构造switch_to要弹出的ebp、ebx、edi、esi和返回地址
+    uint32_t *ret_addr_in_thread_stack = (uint32_t *)intr_0_stack - 1;
+    uint32_t *esi_ptr_in_thread_stack = (uint32_t *)intr_0_stack - 2;
+    uint32_t *edi_ptr_in_thread_stack = (uint32_t *)intr_0_stack - 3;
+    uint32_t *ebx_ptr_in_thread_stack = (uint32_t *)intr_0_stack - 4;
+    uint32_t *ebp_ptr_in_thread_stack = (uint32_t *)intr_0_stack - 5;
+    *ret_addr_in_thread_stack = (uint32_t)fork_child_ret;
+    *ebp_ptr_in_thread_stack = *ebx_ptr_in_thread_stack =
+        *edi_ptr_in_thread_stack = *esi_ptr_in_thread_stack = 0;
+
+    // 3.switch_to从self_kstack开始弹栈
+    child->self_kstack = ebp_ptr_in_thread_stack;
+}
+
+/*子进程继承了父进程打开的文件，增加这些文件inode的打开次数*/
+static void update_inode_open_cnts(struct task_struct *thread)
+{
+    int32_t local_fd = 3, global_fd = 0;
+    while (local_fd < MAX_FILES_OPEN_PER_PROC)
+    {
+        global_fd = thread->fd_table[local_fd];
+        ASSERT(global_fd < MAX_FILE_OPEN);
+        if (global_fd != -1)
+        {
+            inode_dup(file_table[global_fd].fd_inode);
+        }
+        local_fd++;
+    }
+}
+
+/*把父进程的资源复制给子进程，用户页写时复制，成功返回0，失败返回-1*/
+static int32_t copy_process(struct task_struct *child, struct task_struct *parent)
+{
+    /*1.复制pcb、内核栈和vma树*/
+    if (copy_pcb_vmas_stack0(child, parent) == -1)
+    {
+        return -1;
+    }
+
+    /*2.为子进程创建页目录表，内核部分加入所有线程队列时再复制*/
+    child->pgdir = create_page_dir();
+    if (child->pgdir == NULL)
+    {
+        vma_tree_destroy(&child->vmas);
+        return -1;
+    }
+
+    /*3.复制用户页表，用户页本身共享，写时再复制*/
+    if (!user_pgdir_share(child->pgdir))
+    {
+        mfree_page(PF_KERNEL, child->pgdir, 1);
+        vma_tree_destroy(&child->vmas);
+        return -1;
+    }
+
+    /*4.构建子进程的内核栈，更新文件打开数*/
+    build_child_stack(child);
+    update_inode_open_cnts(child);
+    return 0;
+}
+
+/*fork子进程，只有用户进程可以调用*/
+pid_t sys_fork(void)
+{
+    struct task_struct *parent = running_thread();
+    if (parent->pgdir == NULL)
+    {
+        return -1; // 内核线程没有用户空间可以复制
+    }
+    struct task_struct *child = kmem_cache_alloc(&pcb_cache);
+    if (child == NULL)
+    {
+        return -1;
+    }
+    ASSERT(INTR_OFF == intr_get_status());
+    if (copy_process(child, parent) == -1)
+    {
+        kmem_cache_free(&pcb_cache, child);
+        return -1;
+    }
+
+    /*添加到就绪队列和所有线程队列*/
+    process_all_list_add(child);
+    run_queue_add(child);
+
+    return child->pid; // 父进程返回子进程的pid
+}
@@ -0,0 +1,7 @@
+#ifndef __USERPROG_FORK_H
+#define __USERPROG_FORK_H
+#include "../thread/thread.h"
+
+/*fork子进程，父进程返回子进程pid，子进程返回0，失败返回-1*/
+pid_t sys_fork(void);
+#endif
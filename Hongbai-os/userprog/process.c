@@ -9,6 +9,7 @@
 #include "../lib/string.h"
 #include "../kernel/interrupt.h"
 #include "../lib/user/syscall.h"
+#include "../kernel/smp.h"
 
 /*构建用户进程初始化上下文信息*/
 void start_process(void *filename_)
@@ -31,23 +32,28 @@ void start_process(void *filename_)
     // 初始化elfgs
     proc_stack->eflags = (EFLAGS_IOPL_0 | EFLAGS_MBS | EFLAGS_IF_1);
     // 初始化ss:sp
-    proc_stack->esp = (void *)((uint32_t)get_a_page(PF_USER, USER_STACK3_VADDR) + PG_SIZE);
+    // 栈顶的页也不预先分配，第一次压栈时由缺页处理分配
+    proc_stack->esp = (void *)(USER_STACK3_VADDR + PG_SIZE);
     proc_stack->ss = SELECTOR_U_DATA;
     // 通过内联汇编，欺骗cpu，让它进行一次中断返回，把proc_stack中的数据压入cpu
     asm volatile("movl %0,%%esp;jmp intr_exit" : : "g"(proc_stack) : "memory");
 }
 
-/*激活页表，pthread可能是用户进程或者内核线程，
- *如果是内核线程，重新加载内核页表，否则加载进程的页表*/
+/*激活页表，pthread可能是用户进程或者内核线程
+ *内核线程只访问内核空间，而所有页目录表的内核部分都相同，所以直接借用上一个任务的地址空间，不重新加载cr3
+ *进程的页目录表已经在cr3中时也不重新加载，避免无谓地刷新tlb*/
 void page_dir_activate(struct task_struct *pthread)
 {
-    // 默认值就是内核线程的页目录表基址
-    // 0x100000对应1mb，我们的页目录表就是从0x00100000开始的，定义在boot.int
-    uint32_t page_dir_phy_addr = 0x00100000;
-    if (pthread->pgdir != NULL)
-    { // 说明pthread是一个用户进程，激活进程的二级页表结构
-        page_dir_phy_addr = addr_v2p((uint32_t)pthread->pgdir);
+    // 每个处理器各自记录cr3中的页目录表，pthread->cpu是即将运行它的处理器
+    // 以后进程退出释放页目录表时，如果它正被某个处理器借用，要先让那个处理器切回内核页目录表
+    struct cpu *c = pthread->cpu;
+    if (pthread->pgdir == NULL || pthread->pgdir == c->loaded_pgdir)
+    {
+        return;
     }
+    c->loaded_pgdir = pthread->pgdir;
+    // 激活进程的二级页表结构，内核空间是全局页，不受cr3重新加载的影响
+    uint32_t page_dir_phy_addr = addr_v2p((uint32_t)pthread->pgdir);
     // 通过内联汇编，更新cr3中页目录表的物理地址基址
     asm volatile("movl %0,%%cr3" : : "r"(page_dir_phy_addr) : "memory");
 }
@@ -66,7 +72,8 @@ void process_activate(struct task_struct *pthread)
     }
 }
 
-/*创建页目录表，成功返回页目录的虚拟地址，失败返回-1*/
+/*创建页目录表，成功返回页目录的虚拟地址，失败返回NULL
+ *内核部分的页目录项在process_all_list_add中复制，加入所有线程队列之前不能切换到这个页目录表*/
 uint32_t *create_page_dir(void)
 {
     /*我们通过线程创建进程，所以先在内核申请内存*/
@@ -76,42 +83,47 @@ uint32_t *create_page_dir(void)
         console_put_str("create_page_dir error:get_kernel_page failed!\n");
         return NULL;
     }
-    /*1.复制页表*/
-    // 0x300 = 768,一个项4个字节 0xfffff000是最后一个分页，它同时映射页目录表本身，关键词：递归页表
-    memcpy((uint32_t *)((uint32_t)page_dir_vaddr + 0x300 * 4), (uint32_t *)(0xfffff000 + 0x300 * 4), 1024);
-    /*2.更新页目录基址*/
+    /*更新页目录基址*/
     uint32_t new_page_dir_phy_addr = addr_v2p((uint32_t)page_dir_vaddr);
     page_dir_vaddr[1023] = new_page_dir_phy_addr | PG_US_U | PG_RW_W | PG_P_1;
 
     return page_dir_vaddr;
 }
 
-/*创建用户进程虚拟地址位图*/
-void create_user_vaddr_bitmap(struct task_struct *user_prog)
+/*复制内核部分的页目录项，再把用户进程加入所有线程队列
+ *kernel_pde_set持有all_list_lock修改内核页目录项，并同步到队列中每个进程的页目录表，
+ *两步在同一把锁内完成，中间换上或拆掉的4MB大页不会漏掉这个新的地址空间*/
+void process_all_list_add(struct task_struct *pthread)
+{
+    enum intr_status old_status = spin_lock_irqsave(&all_list_lock);
+    // 0x300 = 768,一个项4个字节 0xfffff000是最后一个分页，它同时映射页目录表本身，关键词：递归页表
+    // 最后一项是各自的递归映射，不复制
+    memcpy(pthread->pgdir + 0x300, (uint32_t *)(0xfffff000 + 0x300 * 4), (1023 - 0x300) * 4);
+    ASSERT(!elem_find(&thread_all_list, &pthread->all_list_tag));
+    list_append(&thread_all_list, &pthread->all_list_tag);
+    spin_unlock_irqrestore(&all_list_lock, old_status);
+}
+
+/*初始化用户进程的虚拟地址空间
+ *只预留用户栈可以增长到的范围和堆的第一页，其余的vma随申请增加，不再需要覆盖整个用户空间的位图*/
+void create_user_vaddr_space(struct task_struct *user_prog)
 {
-    // 我们为用户进程定的起始地址是USER_VADDR_START
-    // 该值定义在 process.h 中，其值为 0x8048000，可以通过readelf查看
-    user_prog->userprog_vaddr.vaddr_start = USER_VADDR_START;
-    uint32_t bitmap_pg_cnt = DIV_ROUND_UP((0xc0000000 - USER_VADDR_START) / PG_SIZE / 8, PG_SIZE);
-    user_prog->userprog_vaddr.vaddr_bitmap.btmp_bits = get_kernel_pages(bitmap_pg_cnt);
-    user_prog->userprog_vaddr.vaddr_bitmap.btmp_bytes_len = (0xc0000000 - USER_VADDR_START) / PG_SIZE / 8;
-    bitmap_init(&user_prog->userprog_vaddr.vaddr_bitmap); // 通过初始化填充0
+    vma_tree_init(&user_prog->vmas);
+    vma_insert(&user_prog->vmas, USER_VADDR_END - USER_STACK_SIZE, USER_VADDR_END, VMA_READ | VMA_WRITE);
+    vma_insert(&user_prog->vmas, USER_HEAP_BASE, USER_BRK_START, VMA_READ | VMA_WRITE);
+    user_prog->heap_brk = USER_BRK_START;
 }
 
 /*通过线程创建用户进程*/
 void process_execute(void *filename, char *name)
 {
-    struct task_struct *thread = get_kernel_pages(1);
+    struct task_struct *thread = kmem_cache_alloc(&pcb_cache);
     init_thread(thread, name, default_prio);        // 初始化线程
-    create_user_vaddr_bitmap(thread);               // 位图
+    create_user_vaddr_space(thread);                // 虚拟地址空间
     thread_create(thread, start_process, filename); // 线程结构体-具体功能(创建进程)-线程名
     thread->pgdir = create_page_dir();              // 页目录表
     block_init(thread->u_block_desc);               // 进程内存块描述符数组初始化
 
-    enum intr_status old_status = intr_disable();
-    ASSERT(!elem_find(&thread_ready_list, &thread->general_tag));
-    list_append(&thread_ready_list, &thread->general_tag);
-    ASSERT(!elem_find(&thread_all_list, &thread->all_list_tag));
-    list_append(&thread_all_list, &thread->all_list_tag);
-    intr_set_status(old_status);
+    process_all_list_add(thread);
+    run_queue_add(thread);
 }
\ No newline at end of file
@@ -6,6 +6,8 @@
 #include "../lib/kernel/print.h"
 #include "../device/console.h"
 #include "../lib/string.h"
+#include "./fork.h"
+#include "../device/timer.h"
 
 #define syscall_nr 32 // 最大支持的子功能个数
 typedef void *syscall;
@@ -42,5 +44,10 @@ void syscall_init(void)
     syscall_table[SYS_WRITE] = sys_wirte;
     syscall_table[SYS_MALLOC] = sys_malloc;
     syscall_table[SYS_FREE] = sys_free;
+    syscall_table[SYS_FORK] = sys_fork;
+    syscall_table[SYS_MMAP] = sys_mmap;
+    syscall_table[SYS_MUNMAP] = sys_munmap;
+    syscall_table[SYS_BRK] = sys_brk;
+    syscall_table[SYS_SLEEP] = sys_sleep;
     put_str("syscall_init done\n");
 }
\ No newline at end of file
@@ -5,9 +5,11 @@
 #include "../kernel/global.h"
 #include "../lib/kernel/print.h"
 #include "../lib/string.h"
+#include "../kernel/smp.h"
 
 #define PG_SIZE 4096             // 标准页大小
-#define GDT_BASE_ADDR 0xc0000903 // gdt基地址，可以用info gdt查看
+#define GDT_BASE_ADDR 0xc0000903 // loader建立的gdt基地址，可以用info gdt查看
+#define GDT_ENTRY_CNT 7          // 空描述符、内核代码、内核数据、显存、tss、用户代码、用户数据
 /*TSS结构，由程序员定义，CPU维护*/
 struct tss
 {
@@ -42,12 +44,15 @@ struct tss
     uint32_t trace;
     uint32_t io_base; // io位图
 };
-static struct tss tss;
+/*每个处理器一份tss和gdt，tss描述符的busy位在ltr时置上，不能被两个处理器共用
+ *各处理器的gdt内容只有tss描述符不同，选择子在所有处理器上都一样*/
+static struct tss tss[NR_CPUS];
+static struct gdt_desc gdt[NR_CPUS][GDT_ENTRY_CNT];
 
-/*更新tss中esp0字段的值为 pthread的0级栈*/
+/*更新pthread所在处理器的tss中esp0字段的值为 pthread的0级栈*/
 void update_tss_esp(struct task_struct *pthread)
 {
-    tss.esp0 = (uint32_t *)((uint32_t)pthread + PG_SIZE);
+    tss[pthread->cpu->id].esp0 = (uint32_t *)((uint32_t)pthread + PG_SIZE);
 }
 
 /*创建gdt描述符*/
@@ -66,29 +71,46 @@ static struct gdt_desc make_gdt_desc(uint32_t *desc_addr, uint32_t limit,
     return desc;
 }
 
-/*在gdt中创建tss并重新加载gdt*/
-void tss_init()
+/*为处理器cpu_id建立tss和gdt，并加载到GDTR和TR寄存器
+ *前4项照抄loader建立的gdt，后面是本处理器的tss和用户级代码段、数据段*/
+static void tss_gdt_load(uint32_t cpu_id)
 {
-    put_str("tss_init start\n");
-    uint32_t tss_size = sizeof(tss);
-    memset(&tss, 0, tss_size);
-    tss.ss0 = SELECTOR_K_STACK; // 0特权级栈就是内核栈，将选择子赋给ss0字段
-    tss.io_base = tss_size;
+    struct tss *t = &tss[cpu_id];
+    struct gdt_desc *g = gdt[cpu_id];
+    uint32_t tss_size = sizeof(struct tss);
+    memset(t, 0, tss_size);
+    t->ss0 = SELECTOR_K_STACK; // 0特权级栈就是内核栈，将选择子赋给ss0字段
+    t->io_base = tss_size;
+    memcpy(g, (void *)GDT_BASE_ADDR, 4 * sizeof(struct gdt_desc));
     // 注册TSS
-    *((struct gdt_desc *)(GDT_BASE_ADDR + 0x20)) =
-        make_gdt_desc((uint32_t *)&tss, tss_size - 1, TSS_ATTR_LOW, TSS_ATTR_HIGH);
+    g[4] = make_gdt_desc((uint32_t *)t, tss_size - 1, TSS_ATTR_LOW, TSS_ATTR_HIGH);
     // 注册用户级代码段和数据段
-    *((struct gdt_desc *)(GDT_BASE_ADDR + 0x28)) =
-        make_gdt_desc((uint32_t *)0, 0xfffff, GDT_CODE_ATTR_LOW_DPL3, GDT_ATTR_HIGH);
-    *((struct gdt_desc *)(GDT_BASE_ADDR + 0x30)) =
-        make_gdt_desc((uint32_t *)0, 0xfffff, GDT_DATA_ATTR_LOW_DPL3, GDT_ATTR_HIGH);
+    g[5] = make_gdt_desc((uint32_t *)0, 0xfffff, GDT_CODE_ATTR_LOW_DPL3, GDT_ATTR_HIGH);
+    g[6] = make_gdt_desc((uint32_t *)0, 0xfffff, GDT_DATA_ATTR_LOW_DPL3, GDT_ATTR_HIGH);
     /*构建GDT的操作数，用于LGDT指令，传递信息到GDTR寄存器
      *结构：|16位GDT限长 (Limit)|32位 GDT基地址(Base Address)|16位保留（通常为0）|
      *Limit类似数组下标，需要-1*/
     uint64_t gdt_operand =
-        ((8 * 7 - 1) | ((uint64_t)(uint32_t)GDT_BASE_ADDR << 16));
+        ((sizeof(gdt[cpu_id]) - 1) | ((uint64_t)(uint32_t)g << 16));
     // 将GDT信息和TSS信息用lgdt和ltr指令分别写入GDTR和TR寄存器
     asm volatile("lgdt %0" : : "m"(gdt_operand));
     asm volatile("ltr %w0" : : "r"(SELECTOR_TSS));
+}
+
+/*在gdt中创建tss并重新加载gdt，引导处理器调用*/
+void tss_init()
+{
+    put_str("tss_init start\n");
+    tss_gdt_load(0);
     put_str("tss_init done\n");
+}
+
+/*AP启动后调用，换掉启动代码里的临时gdt，重新加载各段寄存器，cs通过远跳转重新加载*/
+void tss_ap_init(uint32_t cpu_id)
+{
+    tss_gdt_load(cpu_id);
+    asm volatile("ljmp %0, $1f\n1:" : : "i"(SELECTOR_K_CODE));
+    asm volatile("movw %w0, %%ds; movw %w0, %%es; movw %w0, %%fs; movw %w0, %%ss"
+                 : : "r"(SELECTOR_K_DATA) : "memory");
+    asm volatile("movw %w0, %%gs" : : "r"(SELECTOR_K_GS));
 }
\ No newline at end of file
@@ -4,4 +4,5 @@
 #include "../thread/thread.h"
 void update_tss_esp(struct task_struct *pthread);
 void tss_init(void);
+void tss_ap_init(uint32_t cpu_id); // AP加载自己的gdt和tss
 #endif
\ No newline at end of file